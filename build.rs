@@ -1,12 +1,12 @@
 use std::borrow::Cow;
-use std::collections::HashMap;
+use std::collections::{BTreeMap, HashMap};
 use std::convert::TryFrom;
 use std::env;
 use std::ffi::CStr;
 use std::fs;
 use std::io;
 use std::mem::MaybeUninit;
-use std::net::Ipv4Addr;
+use std::net::{Ipv4Addr, SocketAddrV4};
 use std::path::Path;
 use std::ptr;
 use std::str;
@@ -35,6 +35,294 @@ struct UiConfig {
     env: HashMap<String, String>,
 }
 
+fn default_term_timeout_ms() -> u32 {
+    5000
+}
+
+fn default_kill_timeout_ms() -> u32 {
+    2000
+}
+
+/// Configuration of the shutdown.
+#[derive(Deserialize)]
+struct ShutdownConfig {
+    /// Time given to processes to exit after `SIGTERM`, before they are killed.
+    #[serde(default = "default_term_timeout_ms")]
+    term_timeout_ms: u32,
+    /// Time given to processes to die after `SIGKILL`, before the shutdown goes on anyway.
+    #[serde(default = "default_kill_timeout_ms")]
+    kill_timeout_ms: u32,
+    /// Scheduling policy of `dmesg`, which saves the kernel log.
+    #[serde(default)]
+    dmesg_sched: SchedConfig,
+}
+
+impl Default for ShutdownConfig {
+    fn default() -> Self {
+        Self {
+            term_timeout_ms: default_term_timeout_ms(),
+            kill_timeout_ms: default_kill_timeout_ms(),
+            dmesg_sched: SchedConfig::default(),
+        }
+    }
+}
+
+fn default_thaw_after_ms() -> u32 {
+    2000
+}
+
+/// Pressure monitoring, see the `pressure` module.
+#[derive(Deserialize)]
+#[serde(deny_unknown_fields)]
+struct PressureConfig {
+    /// Name of the cgroup that is frozen while there is pressure.
+    freeze: Option<String>,
+    /// Time without any trigger firing after which the cgroup is thawed.
+    #[serde(default = "default_thaw_after_ms")]
+    thaw_after_ms: u32,
+    #[serde(default)]
+    triggers: Vec<TriggerConfig>,
+}
+
+impl Default for PressureConfig {
+    fn default() -> Self {
+        Self {
+            freeze: None,
+            thaw_after_ms: default_thaw_after_ms(),
+            triggers: Vec::new(),
+        }
+    }
+}
+
+#[derive(Deserialize, Clone, Copy)]
+#[serde(rename_all = "kebab-case")]
+enum PressureResource {
+    Memory,
+    Io,
+    Cpu,
+}
+
+#[derive(Deserialize, Clone, Copy)]
+#[serde(rename_all = "kebab-case")]
+enum StallKind {
+    /// Some tasks stalled.
+    Some,
+    /// All non-idle tasks stalled at the same time.
+    Full,
+}
+
+/// A PSI trigger, see `Documentation/accounting/psi.rst` in the kernel.
+#[derive(Deserialize)]
+#[serde(deny_unknown_fields)]
+struct TriggerConfig {
+    resource: PressureResource,
+    /// Name of the cgroup whose pressure is watched, instead of the whole system.
+    cgroup: Option<String>,
+    kind: StallKind,
+    /// Total stall time within the window that fires the trigger.
+    stall_us: u32,
+    window_us: u32,
+}
+
+fn default_available_percent() -> u64 {
+    5
+}
+
+fn default_pressure_available_percent() -> u64 {
+    10
+}
+
+fn default_oom_interval_ms() -> u32 {
+    1000
+}
+
+/// Userspace OOM killer, see the `oom` module.
+#[derive(Deserialize)]
+#[serde(deny_unknown_fields)]
+struct OomConfig {
+    /// A process is killed when `MemAvailable` is below this percentage of `MemTotal`.
+    #[serde(default = "default_available_percent")]
+    available_percent: u64,
+    /// Threshold while the memory pressure trigger fires.
+    #[serde(default = "default_pressure_available_percent")]
+    pressure_available_percent: u64,
+    /// Interval between checks while there is pressure, or always if there is no trigger.
+    #[serde(default = "default_oom_interval_ms")]
+    interval_ms: u32,
+    /// Memory stall time within `window_us` that starts the checks.
+    stall_us: Option<u32>,
+    #[serde(default)]
+    window_us: u32,
+    /// Cgroup whose memory is watched instead of the memory of the system.
+    cgroup: Option<String>,
+    /// Command names of the processes that are never killed.
+    #[serde(default)]
+    protect: Vec<String>,
+    /// Score multipliers of the processes in each top-level cgroup.
+    #[serde(default)]
+    cgroup_weights: BTreeMap<String, u64>,
+}
+
+/// Compressed swap in memory, see the `zram` module.
+#[derive(Deserialize)]
+#[serde(deny_unknown_fields)]
+struct ZramConfig {
+    /// Index of the device, which is `/dev/zram<device>`.
+    #[serde(default)]
+    device: u32,
+    /// Size of the swap, in bytes or with a `K`, `M` or `G` suffix.
+    size: String,
+    /// Compression algorithm, like `lzo-rle` or `zstd`. The default of the kernel if it is not set.
+    algorithm: Option<String>,
+    /// Number of compression streams.
+    streams: Option<u32>,
+    /// Swap priority, from 0 to 32767.
+    priority: Option<u16>,
+}
+
+/// CPU scheduling policy, see `sched(7)`.
+#[derive(Deserialize, Clone, Copy, PartialEq, Eq)]
+#[serde(rename_all = "kebab-case")]
+enum SchedPolicy {
+    Other,
+    Batch,
+    Idle,
+    Fifo,
+    Rr,
+    Deadline,
+}
+
+/// I/O scheduling class, see `ioprio_set(2)`.
+#[derive(Deserialize, Clone, Copy)]
+#[serde(rename_all = "kebab-case")]
+enum IoClass {
+    None,
+    Realtime,
+    BestEffort,
+    Idle,
+}
+
+/// Scheduling policy of a program, see the `sched` module. Settings that are not given are
+/// inherited from init.
+#[derive(Deserialize, Default)]
+#[serde(deny_unknown_fields)]
+struct SchedConfig {
+    policy: Option<SchedPolicy>,
+    /// Real-time priority of the `fifo` and `rr` policies.
+    #[serde(default)]
+    priority: u32,
+    /// Nice level of the `other` and `batch` policies.
+    #[serde(default)]
+    nice: i32,
+    /// Parameters of the `deadline` policy.
+    #[serde(default)]
+    runtime_ns: u64,
+    #[serde(default)]
+    deadline_ns: u64,
+    #[serde(default)]
+    period_ns: u64,
+    io_class: Option<IoClass>,
+    /// Priority within the I/O class, from 0 (highest) to 7.
+    #[serde(default)]
+    io_priority: u16,
+    /// CPUs that the program may run on. All of them if it is empty.
+    #[serde(default)]
+    cpus: Vec<u32>,
+    timer_slack_ns: Option<u64>,
+}
+
+/// When a service is restarted, see the `service` module.
+#[derive(Deserialize, Clone, Copy, Default)]
+#[serde(rename_all = "kebab-case")]
+enum RestartPolicy {
+    Never,
+    #[default]
+    OnFailure,
+    Always,
+}
+
+#[derive(Deserialize, Clone, Copy, Default)]
+#[serde(rename_all = "kebab-case")]
+enum SocketType {
+    #[default]
+    Stream,
+    Datagram,
+}
+
+fn default_socket_mode() -> u32 {
+    0o666
+}
+
+/// A socket that starts a service when it is used.
+#[derive(Deserialize)]
+struct SocketConfig {
+    /// Path of a Unix socket, or IPv4 address and port.
+    listen: String,
+    #[serde(default, rename = "type")]
+    socket_type: SocketType,
+    /// Permissions of a Unix socket.
+    #[serde(default = "default_socket_mode")]
+    mode: u32,
+}
+
+fn default_backoff_ms() -> u32 {
+    100
+}
+
+fn default_max_backoff_ms() -> u32 {
+    30000
+}
+
+/// A long-running process that is supervised by init.
+#[derive(Deserialize)]
+struct ServiceConfig {
+    name: String,
+    argv: Vec<String>,
+    #[serde(default)]
+    env: BTreeMap<String, String>,
+    /// The service runs as root if there is no user.
+    user: Option<String>,
+    #[serde(default)]
+    restart: RestartPolicy,
+    #[serde(default = "default_backoff_ms")]
+    backoff_ms: u32,
+    #[serde(default = "default_max_backoff_ms")]
+    max_backoff_ms: u32,
+    /// Names of the services that must be started before this one.
+    #[serde(default)]
+    after: Vec<String>,
+    /// Whether the service is started after the late steps of the boot.
+    #[serde(default)]
+    late: bool,
+    /// Whether the service is the user interface. It gets the seat, and the environment and the
+    /// user of the `[ui]` section.
+    #[serde(default)]
+    ui: bool,
+    /// Whether the service sends `READY=1` to `NOTIFY_SOCKET` when it is ready, instead of being
+    /// ready as soon as it is started.
+    #[serde(default)]
+    notify: bool,
+    /// Sockets that start the service on demand, which passes them with `LISTEN_FDS`.
+    #[serde(default)]
+    sockets: Vec<SocketConfig>,
+    #[serde(default)]
+    sched: SchedConfig,
+    /// Name of the cgroup of the service. It runs in the root cgroup if there is none.
+    cgroup: Option<String>,
+}
+
+/// A cgroup v2 slice that services are placed in. Memory sizes are written as they are, so they
+/// can have a suffix like `512M`.
+#[derive(Deserialize)]
+#[serde(deny_unknown_fields)]
+struct CgroupConfig {
+    name: String,
+    cpu_weight: Option<u32>,
+    io_weight: Option<u32>,
+    memory_low: Option<String>,
+    memory_high: Option<String>,
+}
+
 /// Filesystem to mount at boot.
 #[derive(Deserialize)]
 struct Mount {
@@ -61,6 +349,34 @@ struct Config {
     net: NetConfig,
     ui: UiConfig,
     mounts: Vec<Mount>,
+
+    /// Sysctl options, as a table of `toml::Value`s since keys can be nested with dots.
+    #[serde(default)]
+    sysctl: BTreeMap<String, toml::Value>,
+
+    #[serde(default)]
+    shutdown: ShutdownConfig,
+
+    #[serde(default)]
+    services: Vec<ServiceConfig>,
+
+    #[serde(default)]
+    cgroups: Vec<CgroupConfig>,
+
+    #[serde(default)]
+    pressure: PressureConfig,
+
+    oom: Option<OomConfig>,
+
+    zram: Option<ZramConfig>,
+
+    /// Memory management settings under `/sys/kernel/mm`, nested like sysctl options.
+    #[serde(default)]
+    mm: BTreeMap<String, toml::Value>,
+
+    /// Parameters of zswap, under `/sys/module/zswap/parameters`.
+    #[serde(default)]
+    zswap: BTreeMap<String, toml::Value>,
 }
 
 impl Config {
@@ -217,32 +533,837 @@ fn format_addr(s: Option<&str>) -> Cow<str> {
     .unwrap_or(Cow::Borrowed("None"))
 }
 
-fn format_mount_function<'a, I: Iterator<Item = &'a Mount>>(fn_name: &str, mounts: I) -> String {
-    let body = mounts
-        .map(|m| {
-            let mkdir = match m.mkdir {
-                Some(mode) => format!("        ret = linux::mkdir(b\"{}\\0\" as *const u8, {mode});\n        if ret < 0 {{\n            return ret;\n        }}\n", m.dir),
-                None => "".to_owned(),
+/// A step of the boot that is not a mount.
+struct BuiltinStep {
+    name: &'static str,
+    early: bool,
+    /// Rust expression of type `fn() -> i32` that runs the step.
+    run: &'static str,
+    /// Paths that must be mounted before the step can run.
+    requires: &'static [&'static str],
+    /// Names of the steps of the same phase that must be done before this one.
+    after: &'static [&'static str],
+}
+
+const BUILTIN_STEPS: &[BuiltinStep] = &[
+    BuiltinStep {
+        name: "record /proc/uptime",
+        early: true,
+        run: "|| {\n            crate::trace::record_proc_uptime();\n            0\n        }",
+        requires: &["/proc/uptime"],
+        after: &[],
+    },
+    BuiltinStep {
+        name: "create /dev symlinks",
+        early: true,
+        run: "|| {\n            crate::create_dev_symlinks();\n            0\n        }",
+        requires: &["/dev/fd"],
+        after: &[],
+    },
+    BuiltinStep {
+        name: "add DRI render permissions",
+        early: true,
+        run: "|| {\n            crate::ui::add_dri_render_permissions();\n            0\n        }",
+        requires: &["/dev/dri/renderD128"],
+        after: &[],
+    },
+    BuiltinStep {
+        name: "set backlight brightness",
+        early: true,
+        run: "|| {\n            crate::ui::set_backlight_brightness();\n            0\n        }",
+        requires: &["/sys/class/backlight"],
+        after: &[],
+    },
+    BuiltinStep {
+        name: "tune memory management",
+        early: true,
+        run: "crate::mm::apply_mm",
+        requires: &["/sys/kernel/mm"],
+        after: &[],
+    },
+    BuiltinStep {
+        name: "create cgroups",
+        early: true,
+        run: "crate::cgroup::create_cgroups",
+        requires: &["/sys/fs/cgroup/cgroup.subtree_control"],
+        after: &[],
+    },
+    BuiltinStep {
+        name: "apply sysctl",
+        early: false,
+        run: "|| {\n            crate::sysctl::apply_sysctl();\n            0\n        }",
+        requires: &["/proc/sys"],
+        after: &[],
+    },
+    BuiltinStep {
+        name: "set up zram swap",
+        early: false,
+        run: "crate::zram::setup_zram",
+        requires: &["/sys/block", "/dev"],
+        after: &[],
+    },
+    BuiltinStep {
+        name: "setup networking",
+        early: false,
+        run: "crate::net::setup_networking",
+        requires: &[],
+        after: &["apply sysctl"],
+    },
+];
+
+/// A step of the boot with its dependencies resolved.
+struct Step {
+    name: String,
+    early: bool,
+    run: String,
+    /// Mounts that must be done before this step.
+    mounts: Vec<usize>,
+    after: Vec<&'static str>,
+}
+
+/// Returns the mount, other than `exclude`, that contains `path` and that is the deepest.
+fn find_mount(mounts: &[Mount], path: &str, exclude: Option<usize>) -> Option<usize> {
+    mounts
+        .iter()
+        .enumerate()
+        .filter(|(i, m)| {
+            Some(*i) != exclude
+                && (m.dir == "/"
+                    || path == m.dir
+                    || (path.starts_with(&m.dir) && path[m.dir.len()..].starts_with('/')))
+        })
+        .max_by_key(|(_, m)| m.dir.len())
+        .map(|(i, _)| i)
+}
+
+fn format_mount_step(index: usize, m: &Mount) -> String {
+    let mkdir = match m.mkdir {
+        Some(mode) => format!("        let ret = linux::mkdir(b\"{}\\0\" as *const u8, {mode});\n        if ret < 0 {{\n            return ret;\n        }}\n", m.dir),
+        None => "".to_owned(),
+    };
+    let data = match &m.data {
+        Some(d) => format!("b\"{}\\0\" as *const u8", d),
+        None => "ptr::null()".to_owned(),
+    };
+    format!(
+        "fn mount_{index}() -> i32 {{
+    unsafe {{
+{mkdir}        linux::mount(
+            b\"{}\\0\" as *const u8,
+            b\"{}\\0\" as *const u8,
+            b\"{}\\0\" as *const u8,
+            {},
+            {data},
+        )
+    }}
+}}
+",
+        m.device, m.dir, m.fs_type, m.flags
+    )
+}
+
+/// Formats the table of the steps of one phase of the boot, as a dependency graph for the `exec`
+/// module.
+fn format_steps(const_name: &str, steps: &[Step], mount_steps: &[usize], early: bool) -> String {
+    let phase: Vec<usize> = (0..steps.len())
+        .filter(|i| steps[*i].early == early)
+        .collect();
+    let local = |global: usize| phase.iter().position(|i| *i == global);
+    let mut prerequisites = vec![Vec::new(); phase.len()];
+    for (l, g) in phase.iter().enumerate() {
+        let step = &steps[*g];
+        for m in &step.mounts {
+            let dep = mount_steps[*m];
+            match local(dep) {
+                Some(d) => prerequisites[l].push(d),
+                None if early => panic!(
+                    "early step `{}` depends on late step `{}`",
+                    step.name, steps[dep].name
+                ),
+                None => {}
+            }
+        }
+        for name in &step.after {
+            let d = phase
+                .iter()
+                .position(|i| steps[*i].name == *name)
+                .unwrap_or_else(|| panic!("unknown step `{}` in the same phase", name));
+            prerequisites[l].push(d);
+        }
+    }
+    let body = phase
+        .iter()
+        .enumerate()
+        .map(|(l, g)| {
+            let successors = (0..phase.len())
+                .filter(|s| prerequisites[*s].contains(&l))
+                .map(|s| s.to_string())
+                .collect::<Vec<String>>()
+                .join(", ");
+            format!(
+                "    Step {{
+        name: \"{}\",
+        run: {},
+        prerequisites: {},
+        successors: &[{successors}],
+    }},\n",
+                steps[*g].name,
+                steps[*g].run,
+                prerequisites[l].len()
+            )
+        })
+        .collect::<Vec<String>>()
+        .concat();
+    format!("pub const {const_name}: &[Step] = &[\n{body}];")
+}
+
+/// Formats the functions that mount filesystems and the tables of the steps of the boot. Steps
+/// that do not depend on each other are run concurrently by the `exec` module.
+fn format_boot_steps(mounts: &[Mount]) -> String {
+    let mut steps = Vec::new();
+    let mut mount_steps = Vec::new();
+    for (i, m) in mounts.iter().enumerate() {
+        mount_steps.push(steps.len());
+        steps.push(Step {
+            name: format!("mount {}", m.dir),
+            early: m.early,
+            run: format!("mount_{i}"),
+            mounts: find_mount(mounts, &m.dir, Some(i))
+                .into_iter()
+                // The device might be a file that lives on another filesystem, such as `/dev`.
+                .chain(
+                    Some(&m.device)
+                        .filter(|d| d.starts_with('/'))
+                        .and_then(|d| find_mount(mounts, d, Some(i))),
+                )
+                .collect(),
+            after: Vec::new(),
+        });
+    }
+    for b in BUILTIN_STEPS {
+        steps.push(Step {
+            name: b.name.to_owned(),
+            early: b.early,
+            run: b.run.to_owned(),
+            mounts: b
+                .requires
+                .iter()
+                .filter_map(|p| find_mount(mounts, p, None))
+                .collect(),
+            after: b.after.to_vec(),
+        });
+    }
+
+    let functions = mounts
+        .iter()
+        .enumerate()
+        .map(|(i, m)| format_mount_step(i, m))
+        .collect::<Vec<String>>()
+        .join("\n");
+    format!(
+        "{functions}
+{early}
+
+{late}",
+        early = format_steps("EARLY_STEPS", &steps, &mount_steps, true),
+        late = format_steps("LATE_STEPS", &steps, &mount_steps, false),
+    )
+}
+
+/// Returns the services in an order where each one comes after the ones it depends on.
+fn sort_services(services: &[ServiceConfig]) -> Vec<&ServiceConfig> {
+    let mut sorted: Vec<&ServiceConfig> = Vec::new();
+    while sorted.len() < services.len() {
+        let next = services
+            .iter()
+            .find(|s| {
+                !sorted.iter().any(|t| t.name == s.name)
+                    && s.after.iter().all(|a| sorted.iter().any(|t| &t.name == a))
+            })
+            .unwrap_or_else(|| panic!("unknown service or dependency cycle in services"));
+        for a in &next.after {
+            let dep = sorted.iter().find(|t| &t.name == a).unwrap();
+            if dep.late && !next.late {
+                panic!("service `{}` depends on late service `{a}`", next.name);
+            }
+        }
+        sorted.push(next);
+    }
+    sorted
+}
+
+/// Path of the socket that services notify their readiness to.
+const NOTIFY_SOCKET: &str = "/run/notify";
+
+fn format_argv(argv: &[String]) -> String {
+    let items = argv
+        .iter()
+        .map(|a| format!("b\"{a}\\0\" as *const u8, "))
+        .collect::<Vec<String>>()
+        .concat();
+    format!("&[{items}ptr::null()] as *const *const u8")
+}
+
+fn format_sockets(sockets: &[SocketConfig]) -> String {
+    let items = sockets
+        .iter()
+        .map(|s| {
+            let address = if s.listen.starts_with('/') {
+                // The path must fit in `sun_path` with its NUL byte.
+                if s.listen.len() >= 108 {
+                    panic!("socket path `{}` is too long", s.listen);
+                }
+                format!("Address::Unix(b\"{}\\0\", {:#o})", s.listen, s.mode)
+            } else {
+                let addr: SocketAddrV4 = s.listen.parse().unwrap();
+                let octets = addr.ip().octets();
+                format!(
+                    "Address::Inet(u32::from_be_bytes([{}, {}, {}, {}]), {})",
+                    octets[0],
+                    octets[1],
+                    octets[2],
+                    octets[3],
+                    addr.port()
+                )
             };
-            let data = match &m.data {
-                Some(d) => format!("b\"{}\\0\" as *const u8", d),
-                None => "ptr::null()".to_owned(),
+            let sock_type = match s.socket_type {
+                SocketType::Stream => "SOCK_STREAM",
+                SocketType::Datagram => "SOCK_DGRAM",
             };
-            format!("{mkdir}        ret = linux::mount(b\"{}\\0\" as *const u8, b\"{}\\0\" as *const u8, b\"{}\\0\" as *const u8, {}, {});\n        if ret < 0 {{\n            return ret;\n        }}\n", m.device, m.dir, m.fs_type, m.flags, data)
+            format!("Socket {{ sock_type: linux::{sock_type}, address: {address} }}")
+        })
+        .collect::<Vec<String>>()
+        .join(", ");
+    format!("&[{items}]")
+}
+
+/// Formats a scheduling policy as a `sched::Policy`.
+fn format_sched(sched: &SchedConfig) -> String {
+    // A nice level alone is set with the default policy.
+    let policy = match (sched.policy, sched.nice) {
+        (None, 0) => None,
+        (None, _) => Some(SchedPolicy::Other),
+        (Some(p), _) => Some(p),
+    };
+    let attr = match policy {
+        None => "None".to_owned(),
+        Some(policy) => {
+            let realtime = matches!(policy, SchedPolicy::Fifo | SchedPolicy::Rr);
+            if realtime != (1..=99).contains(&sched.priority) {
+                panic!("the priority must be from 1 to 99 with the fifo and rr policies only");
+            }
+            if !(-20..=19).contains(&sched.nice) {
+                panic!("the nice level must be from -20 to 19");
+            }
+            if policy == SchedPolicy::Deadline
+                && !(0 < sched.runtime_ns
+                    && sched.runtime_ns <= sched.deadline_ns
+                    && sched.deadline_ns <= sched.period_ns)
+            {
+                panic!("the deadline policy needs 0 < runtime_ns <= deadline_ns <= period_ns");
+            }
+            let (name, flags) = match policy {
+                SchedPolicy::Other => ("SCHED_OTHER", "0"),
+                SchedPolicy::Batch => ("SCHED_BATCH", "0"),
+                SchedPolicy::Idle => ("SCHED_IDLE", "0"),
+                SchedPolicy::Fifo => ("SCHED_FIFO", "linux::SCHED_FLAG_RESET_ON_FORK"),
+                SchedPolicy::Rr => ("SCHED_RR", "linux::SCHED_FLAG_RESET_ON_FORK"),
+                SchedPolicy::Deadline => ("SCHED_DEADLINE", "linux::SCHED_FLAG_RESET_ON_FORK"),
+            };
+            format!(
+                "Some(linux::sched_attr {{
+                size: linux::SCHED_ATTR_SIZE_VER0,
+                sched_policy: linux::{name},
+                sched_flags: {flags},
+                sched_nice: {},
+                sched_priority: {},
+                sched_runtime: {},
+                sched_deadline: {},
+                sched_period: {},
+            }})",
+                sched.nice, sched.priority, sched.runtime_ns, sched.deadline_ns, sched.period_ns
+            )
+        }
+    };
+    let ioprio = match sched.io_class {
+        None => "None".to_owned(),
+        Some(class) => {
+            if sched.io_priority > 7 {
+                panic!("the I/O priority must be from 0 to 7");
+            }
+            let class: u16 = match class {
+                IoClass::None => 0,
+                IoClass::Realtime => 1,
+                IoClass::BestEffort => 2,
+                IoClass::Idle => 3,
+            };
+            // The class is in the top 3 bits.
+            format!("Some({:#x})", class << 13 | sched.io_priority)
+        }
+    };
+    let mut cpus = Vec::new();
+    for &cpu in &sched.cpus {
+        let word = usize::try_from(cpu / 64).unwrap();
+        if cpus.len() <= word {
+            cpus.resize(word + 1, 0u64);
+        }
+        cpus[word] |= 1 << (cpu % 64);
+    }
+    let cpus = cpus
+        .iter()
+        .map(|w| format!("{w:#x}"))
+        .collect::<Vec<String>>()
+        .join(", ");
+    let timer_slack_ns = match sched.timer_slack_ns {
+        Some(ns) => format!("Some({ns})"),
+        None => "None".to_owned(),
+    };
+    format!(
+        "sched::Policy {{
+            attr: {attr},
+            ioprio: {ioprio},
+            cpus: &[{cpus}],
+            timer_slack_ns: {timer_slack_ns},
+        }}"
+    )
+}
+
+/// Formats the table of cgroups and the controllers that their settings need.
+fn format_cgroups(cgroups: &[CgroupConfig]) -> String {
+    let mut controllers = Vec::new();
+    let body = cgroups
+        .iter()
+        .map(|c| {
+            if c.name.is_empty() || c.name.contains('/') {
+                panic!("invalid cgroup name `{}`", c.name);
+            }
+            let mut settings = Vec::new();
+            let mut add = |controller: &'static str, file: &str, value: String| {
+                if !controllers.contains(&controller) {
+                    controllers.push(controller);
+                }
+                settings.push(format!("(b\"{file}\\0\", b\"{value}\")"));
+            };
+            for (file, weight) in [("cpu.weight", c.cpu_weight), ("io.weight", c.io_weight)] {
+                if let Some(weight) = weight {
+                    if !(1..=10000).contains(&weight) {
+                        panic!("`{file}` of cgroup `{}` must be from 1 to 10000", c.name);
+                    }
+                    add(&file[..file.find('.').unwrap()], file, weight.to_string());
+                }
+            }
+            if let Some(low) = &c.memory_low {
+                add("memory", "memory.low", low.clone());
+            }
+            if let Some(high) = &c.memory_high {
+                add("memory", "memory.high", high.clone());
+            }
+            format!(
+                "    Cgroup {{
+        name: \"{name}\",
+        path: b\"/sys/fs/cgroup/{name}\\0\",
+        settings: &[{settings}],
+    }},\n",
+                name = c.name,
+                settings = settings.join(", "),
+            )
         })
         .collect::<Vec<String>>()
         .concat();
+    let controllers = controllers
+        .iter()
+        .map(|c| format!("+{c}"))
+        .collect::<Vec<String>>()
+        .join(" ");
     format!(
-        "pub fn {fn_name}() -> i32 {{
-    #[allow(unused)]
-    let mut ret;
-    unsafe {{
-{body}    }}
-    0
-}}"
+        "pub const CGROUPS: &[Cgroup] = &[\n{body}];
+
+pub const CGROUP_CONTROLLERS: &[u8] = b\"{controllers}\";"
+    )
+}
+
+fn find_cgroup(cgroups: &[CgroupConfig], name: &str) -> usize {
+    cgroups
+        .iter()
+        .position(|c| c.name == name)
+        .unwrap_or_else(|| panic!("unknown cgroup `{}`", name))
+}
+
+/// Formats the pressure triggers and the cgroup that they freeze.
+fn format_pressure(pressure: &PressureConfig, cgroups: &[CgroupConfig]) -> String {
+    // Same limit as `MAX_TRIGGERS` in the `pressure` module.
+    if pressure.triggers.len() > 16 {
+        panic!("too many pressure triggers");
+    }
+    let triggers = pressure
+        .triggers
+        .iter()
+        .map(|t| {
+            // Limits of the kernel.
+            if !(500_000..=10_000_000).contains(&t.window_us) || t.stall_us > t.window_us {
+                panic!("pressure windows must be from 0.5 to 10 s and longer than the stall time");
+            }
+            let resource = match t.resource {
+                PressureResource::Memory => "memory",
+                PressureResource::Io => "io",
+                PressureResource::Cpu => "cpu",
+            };
+            let kind = match t.kind {
+                StallKind::Some => "some",
+                StallKind::Full => "full",
+            };
+            let (name, path) = match &t.cgroup {
+                Some(c) => {
+                    find_cgroup(cgroups, c);
+                    (
+                        format!("{c} {resource} {kind}"),
+                        format!("/sys/fs/cgroup/{c}/{resource}.pressure"),
+                    )
+                }
+                None => (
+                    format!("{resource} {kind}"),
+                    format!("/proc/pressure/{resource}"),
+                ),
+            };
+            format!(
+                "    Trigger {{
+        name: \"{name}\",
+        path: b\"{path}\\0\",
+        threshold: b\"{kind} {} {}\\0\",
+    }},\n",
+                t.stall_us, t.window_us
+            )
+        })
+        .collect::<Vec<String>>()
+        .concat();
+    let freeze = match &pressure.freeze {
+        Some(c) => format!("Some({})", find_cgroup(cgroups, c)),
+        None => "None".to_owned(),
+    };
+    format!(
+        "pub const PRESSURE_TRIGGERS: &[Trigger] = &[\n{triggers}];
+
+pub const PRESSURE_FREEZE: Option<usize> = {freeze};
+pub const PRESSURE_THAW_AFTER_MS: u32 = {};",
+        pressure.thaw_after_ms
+    )
+}
+
+/// Formats the policy of the OOM killer, if it is enabled.
+fn format_oom(oom: &Option<OomConfig>, cgroups: &[CgroupConfig]) -> String {
+    let oom = match oom {
+        Some(o) => o,
+        None => return "pub const OOM: Option<oom::Policy> = None;".to_owned(),
+    };
+    if oom.available_percent > oom.pressure_available_percent
+        || oom.pressure_available_percent > 100
+    {
+        panic!("oom thresholds must be percentages, the one under pressure being the highest");
+    }
+    let trigger = match oom.stall_us {
+        Some(stall_us) => {
+            if !(500_000..=10_000_000).contains(&oom.window_us) || stall_us > oom.window_us {
+                panic!("pressure windows must be from 0.5 to 10 s and longer than the stall time");
+            }
+            format!("Some(b\"some {stall_us} {}\\0\")", oom.window_us)
+        }
+        None => "None".to_owned(),
+    };
+    let cgroup = match &oom.cgroup {
+        Some(c) => {
+            find_cgroup(cgroups, c);
+            format!("Some(b\"{c}\\0\")")
+        }
+        None => "None".to_owned(),
+    };
+    let protect = oom
+        .protect
+        .iter()
+        .map(|name| {
+            // Longer names are truncated in `/proc/<pid>/stat`.
+            if name.len() > 15 {
+                panic!("command name `{}` is longer than 15 bytes", name);
+            }
+            format!("b\"{name}\"")
+        })
+        .collect::<Vec<String>>()
+        .join(", ");
+    let cgroup_weights = oom
+        .cgroup_weights
+        .iter()
+        .map(|(name, weight)| {
+            find_cgroup(cgroups, name);
+            format!("(b\"{name}\", {weight})")
+        })
+        .collect::<Vec<String>>()
+        .join(", ");
+    format!(
+        "pub const OOM: Option<oom::Policy> = Some(oom::Policy {{
+    available_percent: {},
+    pressure_available_percent: {},
+    interval_ms: {},
+    trigger: {trigger},
+    cgroup: {cgroup},
+    protect: &[{protect}],
+    cgroup_weights: &[{cgroup_weights}],
+}});",
+        oom.available_percent, oom.pressure_available_percent, oom.interval_ms
+    )
+}
+
+/// Parses a size in bytes, with an optional `K`, `M` or `G` suffix.
+fn parse_size(size: &str) -> u64 {
+    let (digits, unit) = match size.as_bytes().last() {
+        Some(b'K') => (&size[..size.len() - 1], 1 << 10),
+        Some(b'M') => (&size[..size.len() - 1], 1 << 20),
+        Some(b'G') => (&size[..size.len() - 1], 1 << 30),
+        _ => (size, 1),
+    };
+    let n: u64 = digits
+        .parse()
+        .unwrap_or_else(|_| panic!("invalid size `{}`", size));
+    n * unit
+}
+
+/// Formats the zram device, if there is one.
+fn format_zram(zram: &Option<ZramConfig>) -> String {
+    let zram = match zram {
+        Some(z) => z,
+        None => return "pub const ZRAM: Option<zram::Device> = None;".to_owned(),
+    };
+    // Same as `PAGE_SIZE` in the `zram` module. The kernel rounds the size up to a page, but the
+    // swap header must give the exact number of pages.
+    let pages = parse_size(&zram.size) / 4096;
+    // The kernel refuses swap areas of less than 10 pages.
+    if pages < 10 || pages > u64::from(u32::MAX) {
+        panic!("invalid zram size `{}`", zram.size);
+    }
+    if zram.priority.is_some_and(|p| p > 0x7fff) {
+        panic!("zram priority must be from 0 to 32767");
+    }
+    let option = |o: Option<String>| match o {
+        Some(v) => format!("Some(b\"{v}\")"),
+        None => "None".to_owned(),
+    };
+    format!(
+        "pub const ZRAM: Option<zram::Device> = Some(zram::Device {{
+    sysfs_path: b\"/sys/block/zram{device}\\0\",
+    dev_path: b\"/dev/zram{device}\\0\",
+    disksize: b\"{disksize}\",
+    pages: {pages},
+    algorithm: {algorithm},
+    streams: {streams},
+    priority: {priority:?},
+}});",
+        device = zram.device,
+        disksize = pages * 4096,
+        algorithm = option(zram.algorithm.clone()),
+        streams = option(zram.streams.map(|s| s.to_string())),
+        priority = zram.priority,
     )
 }
 
+/// Formats the table of services, sorted so that they can be started in order.
+fn format_services(services: &[ServiceConfig], cgroups: &[CgroupConfig]) -> String {
+    let sorted = sort_services(services);
+    let body = sorted
+        .iter()
+        .map(|s| {
+            if s.ui && !s.sockets.is_empty() {
+                panic!("the user interface cannot be started on demand");
+            }
+            if s.ui && (s.user.is_some() || !s.env.is_empty()) {
+                panic!(
+                    "the user and the environment of the user interface are set in the [ui] section"
+                );
+            }
+            let envp = if s.ui {
+                "SWAY_ENVP".to_owned()
+            } else {
+                let mut env: Vec<String> = s.env.iter().map(|(k, v)| format!("{k}={v}")).collect();
+                if s.notify {
+                    env.push(format!("NOTIFY_SOCKET={NOTIFY_SOCKET}"));
+                }
+                format_argv(&env)
+            };
+            let user = match &s.user {
+                Some(name) => {
+                    let passwd = Passwd::get_from_username(name);
+                    let groups = getgrouplist(name, passwd.gid)
+                        .iter()
+                        .map(|g| g.to_string())
+                        .collect::<Vec<String>>()
+                        .join(", ");
+                    format!(
+                        "Some(User {{
+            uid: {},
+            gid: {},
+            groups: &[{groups}],
+            home: b\"{}\\0\" as *const u8,
+        }})",
+                        passwd.uid, passwd.gid, passwd.dir
+                    )
+                }
+                None => "None".to_owned(),
+            };
+            let restart = match s.restart {
+                RestartPolicy::Never => "Never",
+                RestartPolicy::OnFailure => "OnFailure",
+                RestartPolicy::Always => "Always",
+            };
+            let after = s
+                .after
+                .iter()
+                .map(|a| {
+                    sorted
+                        .iter()
+                        .position(|t| &t.name == a)
+                        .unwrap()
+                        .to_string()
+                })
+                .collect::<Vec<String>>()
+                .join(", ");
+            format!(
+                "    Service {{
+        name: \"{name}\",
+        path: b\"{path}\\0\" as *const u8,
+        argv: {argv},
+        envp: {envp},
+        user: {user},
+        restart: Restart::{restart},
+        backoff_ms: {backoff_ms},
+        max_backoff_ms: {max_backoff_ms},
+        late: {late},
+        ui: {ui},
+        notify: {notify},
+        after: &[{after}],
+        sockets: {sockets},
+        sched: {sched},
+        cgroup: {cgroup},
+    }},\n",
+                name = s.name,
+                path = s.argv[0],
+                argv = format_argv(&s.argv),
+                backoff_ms = s.backoff_ms,
+                max_backoff_ms = s.max_backoff_ms,
+                late = s.late,
+                ui = s.ui,
+                notify = s.notify,
+                sockets = format_sockets(&s.sockets),
+                sched = format_sched(&s.sched),
+                cgroup = match &s.cgroup {
+                    Some(name) => format!("Some({})", find_cgroup(cgroups, name)),
+                    None => "None".to_owned(),
+                },
+            )
+        })
+        .collect::<Vec<String>>()
+        .concat();
+    format!("pub const SERVICES: &[Service] = &[\n{body}];")
+}
+
+/// Adds the sysctl options of `value` to `options`, as pairs of a path relative to `/proc/sys`, or
+/// to the directory of other options like memory management settings, and a value. Dots in keys
+/// separate directories, like for the `sysctl` command, unless the key contains a slash.
+fn flatten_sysctl(prefix: &str, value: &toml::Value, options: &mut Vec<(String, String)>) {
+    let value = match value {
+        toml::Value::Table(t) => {
+            for (k, v) in t {
+                let k = if k.contains('/') {
+                    k.to_owned()
+                } else {
+                    k.replace('.', "/")
+                };
+                let path = if prefix.is_empty() {
+                    k
+                } else {
+                    format!("{prefix}/{k}")
+                };
+                flatten_sysctl(&path, v, options);
+            }
+            return;
+        }
+        toml::Value::String(s) => s.clone(),
+        toml::Value::Integer(i) => i.to_string(),
+        toml::Value::Boolean(b) => u8::from(*b).to_string(),
+        // Options with several values, like `net.ipv4.tcp_rmem`, separate them with tabs.
+        toml::Value::Array(a) => a
+            .iter()
+            .map(|v| match v {
+                toml::Value::String(s) => s.clone(),
+                v => v.to_string(),
+            })
+            .collect::<Vec<String>>()
+            .join("\t"),
+        v => panic!("unsupported value for sysctl option `{}`: {}", prefix, v),
+    };
+    options.push((prefix.to_owned(), value));
+}
+
+/// Groups the options of `table`, whose nested keys are directories under `root`, by directory.
+fn group_options(
+    root: &str,
+    table: &BTreeMap<String, toml::Value>,
+    dirs: &mut BTreeMap<String, Vec<(String, String)>>,
+) {
+    let mut options = Vec::new();
+    for (k, v) in table {
+        let mut t = toml::value::Table::new();
+        t.insert(k.clone(), v.clone());
+        flatten_sysctl("", &toml::Value::Table(t), &mut options);
+    }
+    for (path, value) in options {
+        let (dir, name) = match path.rsplit_once('/') {
+            Some((d, n)) => (format!("{root}/{d}"), n.to_owned()),
+            None => (root.to_owned(), path),
+        };
+        dirs.entry(dir).or_default().push((name, value));
+    }
+}
+
+/// Formats a table of `SysctlDir`s named `const_name`.
+fn format_option_dirs(
+    const_name: &str,
+    mut dirs: BTreeMap<String, Vec<(String, String)>>,
+) -> String {
+    let dirs_str = dirs
+        .iter_mut()
+        .map(|(dir, options)| {
+            options.sort();
+            let options_str = options
+                .iter()
+                .map(|(name, value)| format!("            (b\"{name}\\0\", b\"{value}\"),\n"))
+                .collect::<Vec<String>>()
+                .concat();
+            format!(
+                "    SysctlDir {{
+        path: b\"{dir}\\0\",
+        options: &[
+{options_str}        ],
+    }},\n"
+            )
+        })
+        .collect::<Vec<String>>()
+        .concat();
+    format!("pub const {const_name}: &[SysctlDir] = &[\n{dirs_str}];")
+}
+
+/// Generates the table of sysctl options, grouped by directory so that each directory is opened
+/// only once.
+fn format_sysctl(sysctl: &BTreeMap<String, toml::Value>) -> String {
+    let mut dirs = BTreeMap::new();
+    group_options("/proc/sys", sysctl, &mut dirs);
+    format_option_dirs("SYSCTL", dirs)
+}
+
+/// Generates the table of memory management settings, in the same form as sysctl options.
+fn format_mm(mm: &BTreeMap<String, toml::Value>, zswap: &BTreeMap<String, toml::Value>) -> String {
+    let mut dirs = BTreeMap::new();
+    group_options("/sys/kernel/mm", mm, &mut dirs);
+    group_options("/sys/module/zswap/parameters", zswap, &mut dirs);
+    format_option_dirs("MM", dirs)
+}
+
 fn main() {
     let profile_env = get_profile_env();
     let system_path = profile_env.get("ROOTPATH").unwrap();
@@ -281,6 +1402,19 @@ fn main() {
         .join(", ");
 
     let xdg_runtime_dir = format!("/run/{}", passwd.uid);
+    // The DRM devices that the compositor will use are opened before it starts.
+    let drm_devices = cfg
+        .ui
+        .env
+        .get("WLR_DRM_DEVICES")
+        .map(|d| &**d)
+        .unwrap_or("/dev/dri/card0");
+    let drm_devices_str = drm_devices
+        .split(':')
+        .filter(|d| !d.is_empty())
+        .map(|d| format!("b\"{d}\\0\""))
+        .collect::<Vec<String>>()
+        .join(", ");
     let mut sway_env: Vec<(&str, &str)> = profile_env
         .iter()
         .filter(|(k, _)| k != &"ROOTPATH")
@@ -290,13 +1424,18 @@ fn main() {
     sway_env.push(("HOME", &passwd.dir));
     sway_env.push(("MOZ_ENABLE_WAYLAND", "1"));
     sway_env.push(("QT_QPA_PLATFORM", "wayland"));
-    sway_env.push(("WLR_DRM_DEVICES", "/dev/dri/card0"));
+    if !cfg.ui.env.contains_key("WLR_DRM_DEVICES") {
+        sway_env.push(("WLR_DRM_DEVICES", drm_devices));
+    }
     sway_env.push(("WLR_LIBINPUT_NO_DEVICES", "1"));
     sway_env.push(("XDG_RUNTIME_DIR", &xdg_runtime_dir));
     sway_env.push(("XDG_SEAT", "seat0"));
     sway_env.push(("XDG_SESSION_DESKTOP", "sway"));
     sway_env.push(("XDG_SESSION_TYPE", "wayland"));
     sway_env.push(("_JAVA_AWT_WM_NONREPARENTING", "1"));
+    if cfg.services.iter().any(|s| s.ui && s.notify) {
+        sway_env.push(("NOTIFY_SOCKET", NOTIFY_SOCKET));
+    }
     sway_env.sort_unstable();
     let sway_envp_str = sway_env
         .iter()
@@ -326,19 +1465,47 @@ pub const SWAY_ENVP: *const *const u8 = &[
 {sway_envp_str}    ptr::null(),
 ] as *const *const u8;
 
+pub const NOTIFY_SOCKET: &[u8] = b\"{NOTIFY_SOCKET}\\0\";
+
 pub const XDG_RUNTIME_DIR: *const u8 = b\"{xdg_runtime_dir}\\0\" as *const u8;
 
-{mount_early}
+pub const DRM_DEVICES: &[&[u8]] = &[{drm_devices_str}];
+
+pub const SHUTDOWN_TERM_TIMEOUT_MS: u32 = {term_timeout_ms};
+pub const SHUTDOWN_KILL_TIMEOUT_MS: u32 = {kill_timeout_ms};
+
+pub const DMESG_SCHED: sched::Policy = {dmesg_sched};
+
+{boot_steps}
+
+{sysctl}
+
+{mm}
+
+{cgroups}
+
+{pressure}
+
+{oom}
+
+{zram}
 
-{mount_late}
+{services}
 ",
+            term_timeout_ms = cfg.shutdown.term_timeout_ms,
+            kill_timeout_ms = cfg.shutdown.kill_timeout_ms,
+            dmesg_sched = format_sched(&cfg.shutdown.dmesg_sched),
             user_home = passwd.dir,
             user_uid = passwd.uid,
             user_gid = passwd.gid,
-            mount_early =
-                format_mount_function("mount_early", cfg.mounts.iter().filter(|m| m.early)),
-            mount_late =
-                format_mount_function("mount_late", cfg.mounts.iter().filter(|m| !m.early)),
+            boot_steps = format_boot_steps(&cfg.mounts),
+            sysctl = format_sysctl(&cfg.sysctl),
+            mm = format_mm(&cfg.mm, &cfg.zswap),
+            cgroups = format_cgroups(&cfg.cgroups),
+            pressure = format_pressure(&cfg.pressure, &cfg.cgroups),
+            oom = format_oom(&cfg.oom, &cfg.cgroups),
+            zram = format_zram(&cfg.zram),
+            services = format_services(&cfg.services, &cfg.cgroups),
         ),
     )
     .unwrap();
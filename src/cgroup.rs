@@ -0,0 +1,177 @@
+//! cgroup v2 slices that services are placed in, from the `[[cgroups]]` section of
+//! `config.toml`.
+//!
+//! The cgroups are created under `/sys/fs/cgroup` by an early step of the boot, with the
+//! controllers that their settings need enabled at the root. Services are created directly in
+//! their cgroup with `CLONE_INTO_CGROUP`, so they never run in the root cgroup, even briefly. The
+//! `cpu.stat` and `io.stat` files of each cgroup are written to the log once the boot is done and
+//! when the system shuts down.
+
+use core::convert::{TryFrom, TryInto};
+use core::fmt::Write;
+
+use crate::config;
+use crate::linux::{self, Fd};
+use crate::procfs;
+use crate::service::Service;
+
+/// Maximum size of a statistics file that is logged.
+const MAX_STAT_LEN: usize = 4096;
+
+/// A cgroup, generated by the `build.rs` script.
+pub struct Cgroup {
+    pub name: &'static str,
+    /// NUL-terminated path of the directory of the cgroup.
+    pub path: &'static [u8],
+    /// Interface files that are written when the cgroup is created, as pairs of a NUL-terminated
+    /// file name and a value.
+    pub settings: &'static [(&'static [u8], &'static [u8])],
+}
+
+/// Opens the directory of the cgroup at `path`.
+fn open_dir(path: &[u8]) -> Result<Fd, i32> {
+    let fd = unsafe {
+        linux::open(
+            path.as_ptr(),
+            linux::O_RDONLY | linux::O_DIRECTORY | linux::O_CLOEXEC,
+            0,
+        )
+    };
+    if fd < 0 {
+        return Err(fd);
+    }
+    Ok(Fd(fd.try_into().unwrap()))
+}
+
+/// Creates the cgroups and applies their settings.
+///
+/// Like for sysctl options, errors are logged instead of being returned, so that the other
+/// cgroups are still set up. A service whose cgroup is missing is started in the root cgroup.
+pub fn create_cgroups() -> i32 {
+    let root = match open_dir(b"/sys/fs/cgroup\0") {
+        Ok(fd) => fd,
+        Err(err) => {
+            writeln!(linux::Stderr, "failed to open /sys/fs/cgroup: {err}").unwrap();
+            return 0;
+        }
+    };
+    // Controllers can only be used by the children of a cgroup once they are enabled in it.
+    let ret = procfs::write_file_at(
+        i32::try_from(root.0).unwrap(),
+        b"cgroup.subtree_control\0",
+        config::CGROUP_CONTROLLERS,
+    );
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to enable cgroup controllers: {ret}").unwrap();
+    }
+    for cgroup in config::CGROUPS {
+        let ret = unsafe { linux::mkdir(cgroup.path.as_ptr(), 0o755) };
+        if ret < 0 && ret != -linux::EEXIST {
+            writeln!(
+                linux::Stderr,
+                "failed to create cgroup {}: {ret}",
+                cgroup.name
+            )
+            .unwrap();
+            continue;
+        }
+        let dir = match open_dir(cgroup.path) {
+            Ok(fd) => fd,
+            Err(err) => {
+                writeln!(
+                    linux::Stderr,
+                    "failed to open cgroup {}: {err}",
+                    cgroup.name
+                )
+                .unwrap();
+                continue;
+            }
+        };
+        for (name, value) in cgroup.settings {
+            let ret = procfs::write_file_at(i32::try_from(dir.0).unwrap(), name, value);
+            if ret < 0 {
+                writeln!(
+                    linux::Stderr,
+                    "failed to set {} of cgroup {}: {ret}",
+                    core::str::from_utf8(&name[..name.len() - 1]).unwrap(),
+                    cgroup.name
+                )
+                .unwrap();
+            }
+        }
+    }
+    0
+}
+
+/// Opens the directory of the cgroup of `service`, for `CLONE_INTO_CGROUP`. Returns `None` if the
+/// service is in the root cgroup, or if its cgroup cannot be used, in which case the service is
+/// started in the root cgroup.
+pub fn open_for(service: &Service) -> Option<Fd> {
+    let cgroup = &config::CGROUPS[service.cgroup?];
+    match open_dir(cgroup.path) {
+        Ok(fd) => Some(fd),
+        Err(err) => {
+            writeln!(
+                linux::Stderr,
+                "failed to open cgroup {}: {err}",
+                cgroup.name
+            )
+            .unwrap();
+            None
+        }
+    }
+}
+
+/// Freezes or thaws the processes of the cgroup at `index` in `config::CGROUPS`.
+pub fn set_frozen(index: usize, frozen: bool) -> i32 {
+    let dir = match open_dir(config::CGROUPS[index].path) {
+        Ok(fd) => fd,
+        Err(err) => return err,
+    };
+    procfs::write_file_at(
+        i32::try_from(dir.0).unwrap(),
+        b"cgroup.freeze\0",
+        if frozen { b"1" } else { b"0" },
+    )
+}
+
+/// Writes the CPU and I/O statistics of each cgroup to the log. `when` tells which moment the
+/// statistics are from.
+pub fn report(when: &str) {
+    for cgroup in config::CGROUPS {
+        let dir = match open_dir(cgroup.path) {
+            Ok(fd) => fd,
+            Err(_) => continue,
+        };
+        for file in [&b"cpu.stat\0"[..], &b"io.stat\0"[..]] {
+            let fd = unsafe {
+                linux::openat(
+                    i32::try_from(dir.0).unwrap(),
+                    file.as_ptr(),
+                    linux::O_RDONLY | linux::O_CLOEXEC,
+                    0,
+                )
+            };
+            if fd < 0 {
+                continue;
+            }
+            let fd = Fd(fd.try_into().unwrap());
+            let mut buf = [0u8; MAX_STAT_LEN];
+            let n = match usize::try_from(linux::read(fd.0, &mut buf)) {
+                Ok(n) => n,
+                Err(_) => continue,
+            };
+            let file = core::str::from_utf8(&file[..file.len() - 1]).unwrap();
+            for line in buf[..n].split(|&b| b == b'\n').filter(|l| !l.is_empty()) {
+                if let Ok(line) = core::str::from_utf8(line) {
+                    writeln!(
+                        linux::Stdout,
+                        "cgroup {} {file} {when}: {line}",
+                        cgroup.name
+                    )
+                    .unwrap();
+                }
+            }
+        }
+    }
+}
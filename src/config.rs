@@ -2,8 +2,18 @@
 //! changed during runtime but has the benefit that we don't have to do any
 //! parsing at runtime which is easier and faster.
 
+use crate::cgroup::Cgroup;
+use crate::exec::Step;
 use crate::linux;
 use crate::net::Ipv4Addr;
+use crate::oom;
+use crate::pressure::Trigger;
+use crate::sched;
+// `User` is only used if a service has a user, and `Address` and `Socket` if one has sockets.
+#[allow(unused_imports)]
+use crate::service::{Address, Restart, Service, Socket, User};
+use crate::sysctl::SysctlDir;
+use crate::zram;
 use core::ptr;
 
 pub struct NetInterface {
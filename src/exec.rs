@@ -0,0 +1,371 @@
+//! A small executor that runs the steps of a dependency graph on worker threads, so that steps
+//! which do not depend on each other (for instance, mounting `/proc` and mounting `/sys`) run at
+//! the same time on different cores.
+//!
+//! The calling thread only schedules steps: it publishes ready steps in an append-only array that
+//! workers claim with an atomic counter, and workers push the results of finished steps to an
+//! append-only completion queue. As every step becomes ready and finishes exactly once, neither
+//! array ever wraps around, so no locks are needed. Threads sleep on futexes when there is nothing
+//! to do.
+//!
+//! Each worker gets its own stack, mapped when the graph starts, with an inaccessible guard page
+//! below it so that a step that overflows its stack crashes instead of corrupting another one.
+//! Steps must fit in `STACK_SIZE`: the largest ones, like `net::setup_networking` with its
+//! receive buffer and its batch of requests, or the io_uring batches of `sysctl`, use less than
+//! 16 KiB.
+
+use core::convert::{TryFrom, TryInto};
+use core::fmt::Write;
+use core::ptr;
+use core::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+
+use crate::linux;
+use crate::trace;
+
+const MAX_WORKERS: usize = 8;
+const STACK_SIZE: usize = 64 * 1024;
+const GUARD_SIZE: usize = 4096;
+
+/// Maximum number of steps in a graph.
+pub const MAX_STEPS: usize = 4096;
+
+/// Value of `published` that tells workers to exit.
+const STOP: u32 = u32::MAX;
+
+/// A graph of steps to run.
+pub trait Graph: Sync {
+    /// Returns the number of steps in the graph.
+    fn step_count(&self) -> usize;
+
+    /// Returns the number of steps that must finish before the given step can start.
+    fn prerequisites(&self, step: usize) -> usize;
+
+    /// Returns the steps that depend on the given step.
+    fn successors(&self, step: usize) -> &[usize];
+
+    /// Runs the given step. This is called on a worker thread.
+    fn run(&self, step: usize) -> i32;
+
+    /// Called on the thread that runs the graph when a step has finished, with the value that
+    /// `run` returned.
+    fn finished(&self, step: usize, ret: i32);
+}
+
+/// A step of the boot, generated by the `build.rs` script.
+pub struct Step {
+    pub name: &'static str,
+    pub run: fn() -> i32,
+    pub prerequisites: usize,
+    pub successors: &'static [usize],
+}
+
+/// Runs a table of steps, printing an error for the steps that fail.
+pub struct Steps(pub &'static [Step]);
+
+impl Graph for Steps {
+    fn step_count(&self) -> usize {
+        self.0.len()
+    }
+
+    fn prerequisites(&self, step: usize) -> usize {
+        self.0[step].prerequisites
+    }
+
+    fn successors(&self, step: usize) -> &[usize] {
+        self.0[step].successors
+    }
+
+    fn run(&self, step: usize) -> i32 {
+        let step = &self.0[step];
+        trace::stage(step.name, step.run)
+    }
+
+    fn finished(&self, step: usize, ret: i32) {
+        if ret < 0 {
+            writeln!(linux::Stderr, "failed to {}: {ret}", self.0[step].name).unwrap();
+        }
+    }
+}
+
+/// The stack of a worker, unmapped when it is dropped.
+struct Stack {
+    base: *mut u8,
+}
+
+impl Stack {
+    fn new() -> Result<Self, i32> {
+        // Only the stack itself is made accessible, so that the guard page is not counted in the
+        // committed memory.
+        let base = unsafe {
+            linux::mmap(
+                ptr::null_mut(),
+                GUARD_SIZE + STACK_SIZE,
+                linux::PROT_NONE,
+                linux::MAP_PRIVATE | linux::MAP_ANONYMOUS | linux::MAP_STACK,
+                -1,
+                0,
+            )
+        };
+        if base < 0 {
+            return Err(base.try_into().unwrap());
+        }
+        let stack = Self {
+            base: base as *mut u8,
+        };
+        let ret = unsafe {
+            linux::mprotect(
+                stack.base.add(GUARD_SIZE),
+                STACK_SIZE,
+                linux::PROT_READ | linux::PROT_WRITE,
+            )
+        };
+        if ret < 0 {
+            return Err(ret);
+        }
+        Ok(stack)
+    }
+
+    /// Returns the top of the stack, since it grows downwards.
+    fn top(&self) -> *mut u8 {
+        unsafe { self.base.add(GUARD_SIZE + STACK_SIZE) }
+    }
+}
+
+impl Drop for Stack {
+    fn drop(&mut self) {
+        unsafe { linux::munmap(self.base, GUARD_SIZE + STACK_SIZE) };
+    }
+}
+
+/// State shared between the thread that runs the graph and the workers.
+struct Shared<'a> {
+    graph: &'a dyn Graph,
+    /// Steps that are ready to run. The first `published` entries are valid.
+    ready: [AtomicU32; MAX_STEPS],
+    /// Number of valid entries in `ready`, or `STOP`.
+    published: AtomicU32,
+    /// Number of entries in `ready` that were taken by a worker.
+    claimed: AtomicU32,
+    /// Finished steps and their results, encoded by `encode_completion`. Zero means that the
+    /// entry was not written yet.
+    completions: [AtomicU64; MAX_STEPS],
+    /// Number of entries in `completions` that were reserved by a worker.
+    reserved: AtomicU32,
+    /// Number of entries in `completions` that were written. This is the futex that the thread
+    /// running the graph sleeps on.
+    completed: AtomicU32,
+    /// Thread IDs of the workers, cleared by the kernel when they exit.
+    tids: [AtomicU32; MAX_WORKERS],
+}
+
+fn encode_completion(step: u32, ret: i32) -> u64 {
+    (1 << 63) | (u64::from(step) << 32) | u64::from(ret as u32)
+}
+
+fn decode_completion(val: u64) -> (usize, i32) {
+    (
+        usize::try_from((val >> 32) & 0x7fff_ffff).unwrap(),
+        val as u32 as i32,
+    )
+}
+
+impl Shared<'_> {
+    /// Claims a ready step, if there is one. On success, the step is returned. Otherwise, the
+    /// value of `published` is returned.
+    fn claim(&self) -> Result<u32, u32> {
+        loop {
+            let published = self.published.load(Ordering::Acquire);
+            let claimed = self.claimed.load(Ordering::Acquire);
+            if published == STOP || claimed >= published {
+                return Err(published);
+            }
+            if self
+                .claimed
+                .compare_exchange_weak(claimed, claimed + 1, Ordering::AcqRel, Ordering::Relaxed)
+                .is_ok()
+            {
+                return Ok(self.ready[usize::try_from(claimed).unwrap()].load(Ordering::Acquire));
+            }
+        }
+    }
+
+    fn run_and_complete(&self, step: u32) {
+        let ret = self.graph.run(usize::try_from(step).unwrap());
+        let i = self.reserved.fetch_add(1, Ordering::AcqRel);
+        self.completions[usize::try_from(i).unwrap()]
+            .store(encode_completion(step, ret), Ordering::Release);
+        self.completed.fetch_add(1, Ordering::AcqRel);
+        linux::futex_wake(&self.completed, 1, linux::FUTEX_PRIVATE_FLAG);
+    }
+
+    fn publish(&self, step: usize) {
+        let i = self.published.load(Ordering::Relaxed);
+        self.ready[usize::try_from(i).unwrap()]
+            .store(u32::try_from(step).unwrap(), Ordering::Release);
+        self.published.store(i + 1, Ordering::Release);
+    }
+}
+
+unsafe fn worker(arg: usize) {
+    let shared = &*(arg as *const Shared);
+    loop {
+        match shared.claim() {
+            Ok(step) => shared.run_and_complete(step),
+            Err(STOP) => break,
+            Err(published) => {
+                linux::futex_wait(&shared.published, published, linux::FUTEX_PRIVATE_FLAG);
+            }
+        }
+    }
+    linux::exit(0);
+}
+
+/// Spawns a worker thread on `stack`, whose thread ID is stored at the given index.
+fn spawn_worker(shared: &Shared, index: usize, stack: &Stack) -> i32 {
+    let tid = &shared.tids[index];
+    unsafe {
+        linux::clone(
+            linux::CLONE_VM
+                | linux::CLONE_FS
+                | linux::CLONE_FILES
+                | linux::CLONE_SIGHAND
+                | linux::CLONE_THREAD
+                | linux::CLONE_SYSVSEM
+                | linux::CLONE_PARENT_SETTID
+                | linux::CLONE_CHILD_CLEARTID,
+            stack.top(),
+            tid.as_ptr() as *mut i32,
+            tid.as_ptr() as *mut i32,
+            ptr::null_mut(),
+            worker,
+            shared as *const Shared as usize,
+        )
+    }
+}
+
+/// Runs all the steps of `graph`, using as many worker threads as it is useful, and returns once
+/// they are all finished. If no worker can be created, steps are run on the calling thread.
+///
+/// Steps that are part of a cycle or that depend on one are never run.
+pub fn run(graph: &dyn Graph) {
+    let len = graph.step_count();
+    if len > MAX_STEPS {
+        writeln!(
+            linux::Stderr,
+            "too many steps to run: {len}, only the first {MAX_STEPS} will be run"
+        )
+        .unwrap();
+    }
+    let len = len.min(MAX_STEPS);
+    if len == 0 {
+        return;
+    }
+
+    let shared = Shared {
+        graph,
+        ready: [const { AtomicU32::new(0) }; MAX_STEPS],
+        published: AtomicU32::new(0),
+        claimed: AtomicU32::new(0),
+        completions: [const { AtomicU64::new(0) }; MAX_STEPS],
+        reserved: AtomicU32::new(0),
+        completed: AtomicU32::new(0),
+        tids: [const { AtomicU32::new(0) }; MAX_WORKERS],
+    };
+
+    let mut remaining = [0usize; MAX_STEPS];
+    for (step, r) in remaining[..len].iter_mut().enumerate() {
+        *r = graph.prerequisites(step);
+        if *r == 0 {
+            shared.publish(step);
+        }
+    }
+
+    let wanted = linux::cpu_count().min(MAX_WORKERS).min(len);
+    // Declared before the workers are spawned, so that the stacks are unmapped after they exit.
+    let mut stacks = [const { None }; MAX_WORKERS];
+    let mut workers = 0;
+    while workers < wanted {
+        let stack = match Stack::new() {
+            Ok(s) => stacks[workers].insert(s),
+            Err(err) => {
+                writeln!(linux::Stderr, "failed to map worker stack: {err}").unwrap();
+                break;
+            }
+        };
+        let ret = spawn_worker(&shared, workers, stack);
+        if ret < 0 {
+            writeln!(linux::Stderr, "failed to spawn worker thread: {ret}").unwrap();
+            break;
+        }
+        workers += 1;
+    }
+    trace::counter("workers", i64::try_from(workers).unwrap());
+
+    let mut head = 0;
+    while head < len {
+        let val = shared.completions[head].load(Ordering::Acquire);
+        if val == 0 {
+            if usize::try_from(shared.published.load(Ordering::Relaxed)).unwrap() == head {
+                // Every step that became ready has finished, so the remaining ones are part of a
+                // cycle.
+                break;
+            }
+            if workers == 0 {
+                // Nobody else is going to run the steps.
+                if let Ok(step) = shared.claim() {
+                    shared.run_and_complete(step);
+                }
+                continue;
+            }
+            let completed = shared.completed.load(Ordering::Acquire);
+            if shared.completions[head].load(Ordering::Acquire) == 0 {
+                linux::futex_wait(&shared.completed, completed, linux::FUTEX_PRIVATE_FLAG);
+            }
+            continue;
+        }
+        head += 1;
+
+        let (step, ret) = decode_completion(val);
+        graph.finished(step, ret);
+        let mut woken = 0;
+        for &next in graph.successors(step) {
+            if next >= len {
+                continue;
+            }
+            remaining[next] -= 1;
+            if remaining[next] == 0 {
+                shared.publish(next);
+                woken += 1;
+            }
+        }
+        if woken > 0 {
+            linux::futex_wake(&shared.published, woken, linux::FUTEX_PRIVATE_FLAG);
+        }
+    }
+    if head < len {
+        writeln!(
+            linux::Stderr,
+            "{} steps were not run because of a dependency cycle",
+            len - head
+        )
+        .unwrap();
+    }
+
+    // Stop the workers and wait for them to exit before their stacks are unmapped.
+    shared.published.store(STOP, Ordering::Release);
+    linux::futex_wake(
+        &shared.published,
+        u32::try_from(workers).unwrap(),
+        linux::FUTEX_PRIVATE_FLAG,
+    );
+    for tid in &shared.tids[..workers] {
+        loop {
+            let val = tid.load(Ordering::Acquire);
+            if val == 0 {
+                break;
+            }
+            // The kernel does not use a private futex to wake us up when the thread exits.
+            linux::futex_wait(tid, val, 0);
+        }
+    }
+}
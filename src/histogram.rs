@@ -0,0 +1,85 @@
+//! A histogram with logarithmic buckets, in the style of HdrHistogram. Each power of two is split
+//! into `SUB_BUCKETS` linear sub-buckets, so that values of any magnitude are recorded with a
+//! relative error of at most 1/`SUB_BUCKETS`, in a fixed amount of memory and without allocating.
+
+use core::convert::TryFrom;
+
+const SUB_BITS: u32 = 3;
+const SUB_BUCKETS: usize = 1 << SUB_BITS;
+const BUCKETS: usize = (64 - SUB_BITS as usize + 1) * SUB_BUCKETS;
+
+pub struct Histogram {
+    counts: [u32; BUCKETS],
+    count: u64,
+    max: u64,
+}
+
+fn bucket(value: u64) -> usize {
+    if value < SUB_BUCKETS as u64 {
+        return usize::try_from(value).unwrap();
+    }
+    let shift = 63 - value.leading_zeros() - SUB_BITS;
+    let top = usize::try_from(value >> shift).unwrap();
+    (usize::try_from(shift).unwrap() + 1) * SUB_BUCKETS + top - SUB_BUCKETS
+}
+
+/// Returns the smallest value that is recorded in `bucket`.
+fn lowest_value(bucket: usize) -> u64 {
+    if bucket < SUB_BUCKETS {
+        return u64::try_from(bucket).unwrap();
+    }
+    let shift = bucket / SUB_BUCKETS - 1;
+    u64::try_from(SUB_BUCKETS + bucket % SUB_BUCKETS).unwrap() << shift
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl Histogram {
+    pub const fn new() -> Self {
+        Self {
+            counts: [0; BUCKETS],
+            count: 0,
+            max: 0,
+        }
+    }
+
+    pub fn record(&mut self, value: u64) {
+        let b = &mut self.counts[bucket(value)];
+        *b = b.saturating_add(1);
+        self.count += 1;
+        self.max = self.max.max(value);
+    }
+
+    /// Returns the number of recorded values.
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    /// Returns the largest recorded value.
+    pub fn max(&self) -> u64 {
+        self.max
+    }
+
+    /// Returns a value such that `percentile` percent of the recorded values are lower or equal,
+    /// within the precision of the buckets.
+    pub fn percentile(&self, percentile: u64) -> u64 {
+        if self.count == 0 {
+            return 0;
+        }
+        let target = (self.count * percentile).div_ceil(100);
+        let mut seen = 0;
+        for (i, &c) in self.counts.iter().enumerate() {
+            seen += u64::from(c);
+            if seen >= target.max(1) && i + 1 < BUCKETS {
+                // The highest value of the bucket, but never more than what was recorded.
+                let highest = lowest_value(i + 1).saturating_sub(1);
+                return highest.min(self.max);
+            }
+        }
+        self.max
+    }
+}
@@ -1,7 +1,8 @@
 use core::arch::asm;
-use core::convert::TryInto;
+use core::convert::{TryFrom, TryInto};
 use core::fmt::Write;
 use core::mem::MaybeUninit;
+use core::sync::atomic::{AtomicU32, Ordering};
 use core::{fmt, mem, ptr};
 
 pub const AF_UNSPEC: i32 = 0;
@@ -11,15 +12,92 @@ pub const AF_NETLINK: i32 = 16;
 
 pub const ARPHRD_NONE: u16 = 0xFFFE;
 
+pub const BPF_LD: u16 = 0x00;
+pub const BPF_JMP: u16 = 0x05;
+pub const BPF_RET: u16 = 0x06;
+pub const BPF_W: u16 = 0x00;
+pub const BPF_H: u16 = 0x08;
+pub const BPF_B: u16 = 0x10;
+pub const BPF_ABS: u16 = 0x20;
+pub const BPF_JEQ: u16 = 0x10;
+pub const BPF_K: u16 = 0x00;
+
+pub const CLOCK_MONOTONIC: u32 = 1;
+pub const CLOCK_BOOTTIME: u32 = 7;
+
 pub const CLONE_VM: u64 = 0x100;
+pub const CLONE_FS: u64 = 0x200;
+pub const CLONE_FILES: u64 = 0x400;
+pub const CLONE_SIGHAND: u64 = 0x800;
+pub const CLONE_PIDFD: u64 = 0x1000;
 pub const CLONE_VFORK: u64 = 0x4000;
+pub const CLONE_THREAD: u64 = 0x10000;
+pub const CLONE_SYSVSEM: u64 = 0x40000;
+pub const CLONE_PARENT_SETTID: u64 = 0x100000;
+pub const CLONE_CHILD_CLEARTID: u64 = 0x200000;
+pub const CLONE_INTO_CGROUP: u64 = 0x200000000;
+
+/// Marks the FDs as close-on-exec with `close_range` instead of closing them.
+pub const CLOSE_RANGE_CLOEXEC: u32 = 1 << 2;
+
+pub const AT_FDCWD: i32 = -100;
+pub const AT_EMPTY_PATH: i32 = 0x1000;
+
+pub const DT_CHR: u8 = 2;
+pub const DT_DIR: u8 = 4;
+
+pub const EPOLLIN: u32 = 0x1;
+pub const EPOLLPRI: u32 = 0x2;
+pub const EPOLLERR: u32 = 0x8;
+pub const EPOLLHUP: u32 = 0x10;
+pub const EPOLLET: u32 = 1 << 31;
+
+pub const EPOLL_CLOEXEC: i32 = 0o2000000;
 
+pub const EPOLL_CTL_ADD: i32 = 1;
+pub const EPOLL_CTL_DEL: i32 = 2;
+pub const EPOLL_CTL_MOD: i32 = 3;
+
+pub const ENOENT: i32 = 2;
 pub const ESRCH: i32 = 3;
 pub const EINTR: i32 = 4;
 pub const ECHILD: i32 = 10;
 pub const EAGAIN: i32 = 11;
 pub const ENOMEM: i32 = 12;
+pub const EBUSY: i32 = 16;
+pub const EEXIST: i32 = 17;
 pub const EINVAL: i32 = 22;
+pub const ENOSYS: i32 = 38;
+pub const EOVERFLOW: i32 = 75;
+pub const ENOBUFS: i32 = 105;
+pub const ETIMEDOUT: i32 = 110;
+pub const ECANCELED: i32 = 125;
+
+pub const FUTEX_WAIT: u32 = 0;
+pub const FUTEX_WAKE: u32 = 1;
+pub const FUTEX_PRIVATE_FLAG: u32 = 128;
+
+pub const IORING_OFF_SQ_RING: u64 = 0;
+pub const IORING_OFF_CQ_RING: u64 = 0x8000000;
+pub const IORING_OFF_SQES: u64 = 0x10000000;
+
+pub const IORING_FEAT_SINGLE_MMAP: u32 = 1 << 0;
+pub const IORING_FEAT_CQE_SKIP: u32 = 1 << 11;
+
+pub const IORING_ENTER_GETEVENTS: u32 = 1 << 0;
+
+pub const IORING_REGISTER_FILES: u32 = 2;
+
+pub const IORING_OP_OPENAT: u8 = 18;
+pub const IORING_OP_CLOSE: u8 = 19;
+pub const IORING_OP_READ: u8 = 22;
+pub const IORING_OP_WRITE: u8 = 23;
+
+pub const IOSQE_FIXED_FILE: u8 = 1 << 0;
+pub const IOSQE_IO_LINK: u8 = 1 << 2;
+pub const IOSQE_IO_HARDLINK: u8 = 1 << 3;
+
+pub const IOPRIO_WHO_PROCESS: i32 = 1;
 
 pub const IFA_ADDRESS: u16 = 1;
 pub const IFA_LOCAL: u16 = 2;
@@ -30,17 +108,44 @@ pub const IFF_UP: i32 = 0x1;
 pub const LINUX_REBOOT_MAGIC1: i32 = 0xfee1deadu32 as i32;
 pub const LINUX_REBOOT_MAGIC2: i32 = 672274793;
 
+/// Lists the mounts of the whole mount namespace with `listmount`.
+pub const LSMT_ROOT: u64 = u64::MAX;
+
+pub const MAP_SHARED: u32 = 0x1;
+pub const MAP_PRIVATE: u32 = 0x2;
+pub const MAP_ANONYMOUS: u32 = 0x20;
+pub const MAP_POPULATE: u32 = 0x8000;
+pub const MAP_STACK: u32 = 0x20000;
+
+pub const PROT_NONE: u32 = 0x0;
+pub const PROT_READ: u32 = 0x1;
+pub const PROT_WRITE: u32 = 0x2;
+
+pub const PR_SET_TIMERSLACK: i32 = 29;
+
+pub const MNT_DETACH: i32 = 2;
+
+pub const MS_RDONLY: u64 = 1;
 pub const MS_NOSUID: u64 = 2;
 pub const MS_NODEV: u64 = 4;
 pub const MS_NOEXEC: u64 = 8;
+pub const MS_REMOUNT: u64 = 32;
 pub const MS_NOATIME: u64 = 1024;
 
 pub const NETLINK_ROUTE: i32 = 0;
+pub const NETLINK_KOBJECT_UEVENT: i32 = 15;
+
+pub const NETLINK_CAP_ACK: i32 = 10;
+pub const NETLINK_EXT_ACK: i32 = 11;
+
+pub const NLMSGERR_ATTR_MSG: u16 = 1;
 
 pub const NLMSG_ERROR: i32 = 0x2;
 
 pub const NLM_F_REQUEST: i32 = 1;
 pub const NLM_F_ACK: i32 = 4;
+pub const NLM_F_CAPPED: i32 = 0x100;
+pub const NLM_F_ACK_TLVS: i32 = 0x200;
 pub const NLM_F_EXCL: i32 = 0x200;
 pub const NLM_F_CREATE: i32 = 0x400;
 
@@ -50,12 +155,15 @@ pub const O_RDWR: u32 = 0o2;
 pub const O_CREAT: u32 = 0o100;
 pub const O_NOCTTY: u32 = 0o400;
 pub const O_TRUNC: u32 = 0o1000;
+pub const O_DIRECTORY: u32 = 0o200000;
 pub const O_NOFOLLOW: u32 = 0o400000;
 pub const O_CLOEXEC: u32 = 0o2000000;
+pub const O_PATH: u32 = 0o10000000;
 pub const O_NONBLOCK: u32 = 0o4000;
 
 pub const F_GETFD: u32 = 1;
 pub const F_SETFD: u32 = 2;
+pub const F_DUPFD_CLOEXEC: u32 = 1030;
 
 pub const FD_CLOEXEC: i32 = 1;
 
@@ -76,30 +184,76 @@ pub const RT_SCOPE_UNIVERSE: u8 = 0;
 
 pub const RT_TABLE_MAIN: u8 = 254;
 
+pub const SCHED_OTHER: u32 = 0;
+pub const SCHED_FIFO: u32 = 1;
+pub const SCHED_RR: u32 = 2;
+pub const SCHED_BATCH: u32 = 3;
+pub const SCHED_IDLE: u32 = 5;
+pub const SCHED_DEADLINE: u32 = 6;
+
+/// Children of the process get the default policy and priority back.
+pub const SCHED_FLAG_RESET_ON_FORK: u64 = 1;
+
+/// Size of the first version of `sched_attr`, which is the one defined here.
+pub const SCHED_ATTR_SIZE_VER0: u32 = 48;
+
+pub const SIGKILL: i32 = 9;
 pub const SIGTERM: i32 = 15;
 pub const SIGCHLD: i32 = 17;
 
 pub const SOL_SOCKET: i32 = 1;
+pub const SOL_NETLINK: i32 = 270;
+
+pub const SO_REUSEADDR: i32 = 2;
+pub const SO_PASSCRED: i32 = 16;
+pub const SO_ATTACH_FILTER: i32 = 26;
 
 pub const SCM_RIGHTS: i32 = 1;
+pub const SCM_CREDENTIALS: i32 = 2;
+
+/// Maximum number of FDs in a `SCM_RIGHTS` control message.
+pub const SCM_MAX_FD: usize = 253;
 
+pub const SOCK_STREAM: i32 = 1;
 pub const SOCK_DGRAM: i32 = 2;
 pub const SOCK_RAW: i32 = 3;
+pub const SOCK_NONBLOCK: i32 = 0o4000;
 pub const SOCK_CLOEXEC: i32 = 0o2000000;
 
 pub const MSG_DONTWAIT: u32 = 0x40;
 
+pub const SWAP_FLAG_PREFER: i32 = 0x8000;
+pub const SWAP_FLAG_PRIO_MASK: i32 = 0x7fff;
+pub const SWAP_FLAG_DISCARD: i32 = 0x10000;
+
 pub const SFD_NONBLOCK: i32 = 0o4000;
 pub const SFD_CLOEXEC: i32 = 0o2000000;
 
+pub const TFD_NONBLOCK: i32 = 0o4000;
+pub const TFD_CLOEXEC: i32 = 0o2000000;
+pub const TFD_TIMER_ABSTIME: i32 = 1;
+
+pub const STATMOUNT_SB_BASIC: u64 = 0x1;
+pub const STATMOUNT_MNT_BASIC: u64 = 0x2;
+pub const STATMOUNT_MNT_POINT: u64 = 0x10;
+pub const STATMOUNT_FS_TYPE: u64 = 0x20;
+
 pub const POLLIN: i16 = 0x1;
 pub const POLLERR: i16 = 0x8;
 pub const POLLNVAL: i16 = 0x20;
 
 pub const WNOHANG: i32 = 1;
+pub const WEXITED: i32 = 4;
+/// Waits for all children, whatever signal they send to their parent when they exit.
+pub const __WALL: i32 = 0x40000000;
 
 pub const SIG_BLOCK: i32 = 0;
 
+pub const P_PIDFD: i32 = 3;
+
+/// Value of `siginfo.si_code` for a child that exited normally.
+pub const CLD_EXITED: i32 = 1;
+
 #[repr(C)]
 #[allow(non_camel_case_types)]
 pub struct iovec {
@@ -127,6 +281,45 @@ pub struct cmsghdr {
     pub cmsg_type: i32,
 }
 
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct sched_attr {
+    pub size: u32,
+    pub sched_policy: u32,
+    pub sched_flags: u64,
+    pub sched_nice: i32,
+    pub sched_priority: u32,
+    pub sched_runtime: u64,
+    pub sched_deadline: u64,
+    pub sched_period: u64,
+}
+
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct ucred {
+    pub pid: i32,
+    pub uid: u32,
+    pub gid: u32,
+}
+
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct sockaddr_in {
+    pub sin_family: u16,
+    /// Port in network byte order.
+    pub sin_port: u16,
+    /// Address in network byte order.
+    pub sin_addr: u32,
+    pub sin_zero: [u8; 8],
+}
+
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct sockaddr_un {
+    pub sun_family: u16,
+    pub sun_path: [u8; 108],
+}
+
 #[repr(C)]
 #[allow(non_camel_case_types)]
 pub struct nlmsgerr {
@@ -134,6 +327,74 @@ pub struct nlmsgerr {
     pub msg: nlmsghdr,
 }
 
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct sockaddr_nl {
+    pub nl_family: u16,
+    pub nl_pad: u16,
+    pub nl_pid: u32,
+    pub nl_groups: u32,
+}
+
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct sock_filter {
+    pub code: u16,
+    pub jt: u8,
+    pub jf: u8,
+    pub k: u32,
+}
+
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct sock_fprog {
+    pub len: u16,
+    pub filter: *const sock_filter,
+}
+
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct mnt_id_req {
+    pub size: u32,
+    pub spare: u32,
+    pub mnt_id: u64,
+    pub param: u64,
+}
+
+/// The fixed part of the buffer filled by `statmount`. Strings follow it, and the `fs_type` and
+/// `mnt_point` fields are offsets of NUL-terminated strings there.
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct statmount {
+    pub size: u32,
+    pub spare1: u32,
+    pub mask: u64,
+    pub sb_dev_major: u32,
+    pub sb_dev_minor: u32,
+    pub sb_magic: u64,
+    pub sb_flags: u32,
+    pub fs_type: u32,
+    pub mnt_id: u64,
+    pub mnt_parent_id: u64,
+    pub mnt_id_old: u32,
+    pub mnt_parent_id_old: u32,
+    pub mnt_attr: u64,
+    pub mnt_propagation: u64,
+    pub mnt_peer_group: u64,
+    pub mnt_master: u64,
+    pub propagate_from: u64,
+    pub mnt_root: u32,
+    pub mnt_point: u32,
+    pub spare2: [u64; 50],
+}
+
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct nlattr {
+    pub nla_len: u16,
+    pub nla_type: u16,
+}
+
 #[repr(C)]
 #[allow(non_camel_case_types)]
 pub struct nlmsghdr {
@@ -144,6 +405,14 @@ pub struct nlmsghdr {
     pub nlmsg_pid: u32,
 }
 
+#[repr(C, packed)]
+#[derive(Copy, Clone)]
+#[allow(non_camel_case_types)]
+pub struct epoll_event {
+    pub events: u32,
+    pub data: u64,
+}
+
 #[repr(C)]
 #[allow(non_camel_case_types)]
 pub struct pollfd {
@@ -152,6 +421,128 @@ pub struct pollfd {
     pub revents: i16,
 }
 
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct timespec {
+    pub tv_sec: i64,
+    pub tv_nsec: i64,
+}
+
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct itimerspec {
+    pub it_interval: timespec,
+    pub it_value: timespec,
+}
+
+/// The beginning of a `siginfo_t`, as filled by `waitid`.
+#[repr(C)]
+#[allow(non_camel_case_types)]
+pub struct siginfo {
+    pub si_signo: i32,
+    pub si_errno: i32,
+    pub si_code: i32,
+    pub pad: i32,
+    pub si_pid: i32,
+    pub si_uid: u32,
+    pub si_status: i32,
+    pub rest: [u8; 100],
+}
+
+#[repr(C)]
+#[derive(Default)]
+#[allow(non_camel_case_types)]
+pub struct clone_args {
+    pub flags: u64,
+    pub pidfd: u64,
+    pub child_tid: u64,
+    pub parent_tid: u64,
+    pub exit_signal: u64,
+    pub stack: u64,
+    pub stack_size: u64,
+    pub tls: u64,
+    pub set_tid: u64,
+    pub set_tid_size: u64,
+    pub cgroup: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+#[allow(non_camel_case_types)]
+pub struct io_sqring_offsets {
+    pub head: u32,
+    pub tail: u32,
+    pub ring_mask: u32,
+    pub ring_entries: u32,
+    pub flags: u32,
+    pub dropped: u32,
+    pub array: u32,
+    pub resv1: u32,
+    pub user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+#[allow(non_camel_case_types)]
+pub struct io_cqring_offsets {
+    pub head: u32,
+    pub tail: u32,
+    pub ring_mask: u32,
+    pub ring_entries: u32,
+    pub overflow: u32,
+    pub cqes: u32,
+    pub flags: u32,
+    pub resv1: u32,
+    pub user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+#[allow(non_camel_case_types)]
+pub struct io_uring_params {
+    pub sq_entries: u32,
+    pub cq_entries: u32,
+    pub flags: u32,
+    pub sq_thread_cpu: u32,
+    pub sq_thread_idle: u32,
+    pub features: u32,
+    pub wq_fd: u32,
+    pub resv: [u32; 3],
+    pub sq_off: io_sqring_offsets,
+    pub cq_off: io_cqring_offsets,
+}
+
+/// A submission queue entry. The kernel uses unions for most fields, so only the names of the
+/// members that this program uses are kept.
+#[repr(C)]
+#[derive(Copy, Clone, Default)]
+#[allow(non_camel_case_types)]
+pub struct io_uring_sqe {
+    pub opcode: u8,
+    pub flags: u8,
+    pub ioprio: u16,
+    pub fd: i32,
+    pub off: u64,
+    pub addr: u64,
+    pub len: u32,
+    pub op_flags: u32,
+    pub user_data: u64,
+    pub buf_index: u16,
+    pub personality: u16,
+    pub file_index: u32,
+    pub addr3: u64,
+    pub pad: u64,
+}
+
+#[repr(C)]
+#[derive(Copy, Clone)]
+#[allow(non_camel_case_types)]
+pub struct io_uring_cqe {
+    pub user_data: u64,
+    pub res: i32,
+    pub flags: u32,
+}
+
 #[allow(non_camel_case_types)]
 pub type sigset_t = usize;
 
@@ -285,6 +676,29 @@ pub fn close(fd: u32) -> i32 {
     unsafe { syscall_1(3, fd.into()) as i32 }
 }
 
+#[allow(clippy::missing_safety_doc)]
+pub unsafe fn mmap(addr: *mut u8, len: usize, prot: u32, flags: u32, fd: i32, off: u64) -> i64 {
+    syscall_6(
+        9,
+        addr as u64,
+        len as u64,
+        prot.into(),
+        flags.into(),
+        fd as u64,
+        off,
+    )
+}
+
+#[allow(clippy::missing_safety_doc)]
+pub unsafe fn mprotect(addr: *mut u8, len: usize, prot: u32) -> i32 {
+    syscall_3(10, addr as u64, len as u64, prot.into()) as i32
+}
+
+#[allow(clippy::missing_safety_doc)]
+pub unsafe fn munmap(addr: *mut u8, len: usize) -> i32 {
+    syscall_2(11, addr as u64, len as u64) as i32
+}
+
 pub fn poll(fds: &mut [pollfd], timeout_ms: i32) -> i32 {
     unsafe {
         syscall_3(
@@ -308,10 +722,18 @@ pub fn rt_sigprocmask(how: i32, new: &sigset_t, old: *mut sigset_t, size: usize)
     }
 }
 
+pub fn pwrite64(fd: u32, buf: &[u8], offset: u64) -> i64 {
+    unsafe { syscall_4(18, fd.into(), buf.as_ptr() as u64, buf.len() as u64, offset) }
+}
+
 pub fn dup2(old_fd: u32, new_fd: u32) -> i32 {
     unsafe { syscall_2(33, old_fd.into(), new_fd.into()) as i32 }
 }
 
+pub fn getpid() -> i32 {
+    unsafe { syscall_0(39) as i32 }
+}
+
 pub fn socket(family: i32, sock_type: i32, protocol: i32) -> i32 {
     unsafe { syscall_3(41, family as u64, sock_type as u64, protocol as u64) as i32 }
 }
@@ -340,6 +762,20 @@ pub unsafe fn sendmsg(fd: i32, msg: &mut msghdr, flags: u32) -> isize {
     syscall_3(46, fd as u64, msg as *mut msghdr as u64, flags as u64) as isize
 }
 
+#[allow(clippy::missing_safety_doc)]
+pub unsafe fn recvmsg(fd: i32, msg: &mut msghdr, flags: u32) -> isize {
+    syscall_3(47, fd as u64, msg as *mut msghdr as u64, flags as u64) as isize
+}
+
+#[allow(clippy::missing_safety_doc)]
+pub unsafe fn bind(fd: u32, addr: *const u8, addr_len: usize) -> i32 {
+    syscall_3(49, fd.into(), addr as u64, addr_len as u64) as i32
+}
+
+pub fn listen(fd: u32, backlog: i32) -> i32 {
+    unsafe { syscall_2(50, fd.into(), backlog as u64) as i32 }
+}
+
 pub fn socketpair(
     family: i32,
     type_: i32,
@@ -372,6 +808,31 @@ pub fn create_socket_pair(family: i32, type_: i32, protocol: i32) -> Result<(Fd,
     Ok((Fd(s0), Fd(s1)))
 }
 
+#[allow(clippy::missing_safety_doc)]
+pub unsafe fn setsockopt(fd: u32, level: i32, name: i32, val: *const u8, len: usize) -> i32 {
+    syscall_5(
+        54,
+        fd.into(),
+        level as u64,
+        name as u64,
+        val as u64,
+        len as u64,
+    ) as i32
+}
+
+/// Sets a socket option whose value is an `int`.
+pub fn setsockopt_int(fd: u32, level: i32, name: i32, val: i32) -> i32 {
+    unsafe {
+        setsockopt(
+            fd,
+            level,
+            name,
+            &val as *const i32 as *const u8,
+            mem::size_of_val(&val),
+        )
+    }
+}
+
 #[allow(clippy::missing_safety_doc)]
 pub unsafe fn clone(
     flags: u64,
@@ -387,13 +848,13 @@ pub unsafe fn clone(
         "syscall",
         // If we are the new thread...
         "test rax, rax",
-        "jnz 1f",
+        "jnz 2f",
         // Mark the new outer frame.
         "xor ebp, ebp",
         // Call `f`.
         "mov rdi, r12",
         "call r9",
-        "1:",
+        "2:",
         // Registers we use in the new thread.
         in("r9") f,
         in("r12") arg,
@@ -444,11 +905,21 @@ pub unsafe fn mkdir(pathname: *const u8, mode: u32) -> i32 {
     syscall_2(83, pathname as u64, mode.into()) as i32
 }
 
+#[allow(clippy::missing_safety_doc)]
+pub unsafe fn unlink(pathname: *const u8) -> i32 {
+    syscall_1(87, pathname as u64) as i32
+}
+
 #[allow(clippy::missing_safety_doc)]
 pub unsafe fn symlink(old_name: *const u8, new_name: *const u8) -> i32 {
     syscall_2(88, old_name as u64, new_name as u64) as i32
 }
 
+#[allow(clippy::missing_safety_doc)]
+pub unsafe fn chmod(filename: *const u8, mode: u32) -> i32 {
+    syscall_2(90, filename as u64, mode.into()) as i32
+}
+
 #[allow(clippy::missing_safety_doc)]
 pub unsafe fn chown(filename: *const u8, uid: u32, gid: u32) -> i32 {
     syscall_3(92, filename as u64, uid as u64, gid as u64) as i32
@@ -466,6 +937,10 @@ pub fn setgroups(groups: &[u32]) -> i32 {
     unsafe { syscall_2(116, groups.len() as u64, groups.as_ptr() as u64) as i32 }
 }
 
+pub fn prctl(option: i32, arg2: u64, arg3: u64, arg4: u64, arg5: u64) -> i32 {
+    unsafe { syscall_5(157, option as u64, arg2, arg3, arg4, arg5) as i32 }
+}
+
 pub fn sync() {
     unsafe { syscall_0(162) };
 }
@@ -493,11 +968,186 @@ pub unsafe fn umount(name: *const u8, flags: i32) -> i32 {
     syscall_2(166, name as u64, flags as u64) as i32
 }
 
+#[allow(clippy::missing_safety_doc)]
+pub unsafe fn swapon(specialfile: *const u8, flags: i32) -> i32 {
+    syscall_2(167, specialfile as u64, flags as u64) as i32
+}
+
 #[allow(clippy::missing_safety_doc)]
 pub unsafe fn reboot(magic1: i32, magic2: i32, cmd: u32, arg: *const u8) -> i32 {
     syscall_4(169, magic1 as u64, magic2 as u64, cmd as u64, arg as u64) as i32
 }
 
+pub fn gettid() -> i32 {
+    unsafe { syscall_0(186) as i32 }
+}
+
+/// Sleeps until `word` is woken up with `futex_wake`, unless `word` does not contain `val`.
+pub fn futex_wait(word: &AtomicU32, val: u32, flags: u32) -> i32 {
+    unsafe {
+        syscall_4(
+            202,
+            word.as_ptr() as u64,
+            (FUTEX_WAIT | flags).into(),
+            val.into(),
+            0,
+        ) as i32
+    }
+}
+
+/// Like `futex_wait`, but gives up after `timeout`.
+pub fn futex_wait_timeout(word: &AtomicU32, val: u32, flags: u32, timeout: &timespec) -> i32 {
+    unsafe {
+        syscall_4(
+            202,
+            word.as_ptr() as u64,
+            (FUTEX_WAIT | flags).into(),
+            val.into(),
+            timeout as *const timespec as u64,
+        ) as i32
+    }
+}
+
+/// Wakes up at most `count` threads waiting on `word`.
+pub fn futex_wake(word: &AtomicU32, count: u32, flags: u32) -> i32 {
+    unsafe {
+        syscall_3(
+            202,
+            word.as_ptr() as u64,
+            (FUTEX_WAKE | flags).into(),
+            count.into(),
+        ) as i32
+    }
+}
+
+pub fn sched_setaffinity(pid: i32, mask: &[u64]) -> i32 {
+    unsafe {
+        syscall_3(
+            203,
+            pid as u64,
+            mem::size_of_val(mask) as u64,
+            mask.as_ptr() as u64,
+        ) as i32
+    }
+}
+
+pub fn sched_getaffinity(pid: i32, mask: &mut [u64]) -> i32 {
+    unsafe {
+        syscall_3(
+            204,
+            pid as u64,
+            mem::size_of_val(mask) as u64,
+            mask.as_mut_ptr() as u64,
+        ) as i32
+    }
+}
+
+/// Returns the number of CPUs that the calling thread may run on, or 1 if it is unknown.
+pub fn cpu_count() -> usize {
+    let mut mask = [0u64; 16];
+    let ret = sched_getaffinity(0, &mut mask);
+    if ret <= 0 {
+        return 1;
+    }
+    let n = mask
+        .iter()
+        .map(|m| usize::try_from(m.count_ones()).unwrap())
+        .sum();
+    if n == 0 {
+        1
+    } else {
+        n
+    }
+}
+
+pub fn getdents64(fd: u32, buf: &mut [u8]) -> i64 {
+    unsafe { syscall_3(217, fd.into(), buf.as_mut_ptr() as u64, buf.len() as u64) }
+}
+
+pub fn clock_gettime(clock: u32, tp: &mut timespec) -> i32 {
+    unsafe { syscall_2(228, clock.into(), tp as *mut timespec as u64) as i32 }
+}
+
+/// Returns the time of the given clock in nanoseconds, or 0 if the clock cannot be read.
+pub fn clock_ns(clock: u32) -> u64 {
+    let mut tp = timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    if clock_gettime(clock, &mut tp) < 0 {
+        return 0;
+    }
+    (tp.tv_sec as u64) * 1_000_000_000 + tp.tv_nsec as u64
+}
+
+pub fn epoll_wait(epfd: u32, events: &mut [epoll_event], timeout_ms: i32) -> i32 {
+    unsafe {
+        syscall_4(
+            232,
+            epfd.into(),
+            events.as_mut_ptr() as u64,
+            events.len() as u64,
+            timeout_ms as u64,
+        ) as i32
+    }
+}
+
+pub fn epoll_ctl(epfd: u32, op: i32, fd: u32, event: Option<&epoll_event>) -> i32 {
+    unsafe {
+        syscall_4(
+            233,
+            epfd.into(),
+            op as u64,
+            fd.into(),
+            event.map_or(ptr::null(), |e| e as *const epoll_event) as u64,
+        ) as i32
+    }
+}
+
+pub fn waitid(idtype: i32, id: u32, info: &mut siginfo, options: i32) -> i32 {
+    unsafe {
+        syscall_5(
+            247,
+            idtype as u64,
+            id.into(),
+            info as *mut siginfo as u64,
+            options as u64,
+            0,
+        ) as i32
+    }
+}
+
+#[allow(clippy::missing_safety_doc)]
+pub unsafe fn openat(dir_fd: i32, filename: *const u8, flags: u32, mode: u32) -> i32 {
+    syscall_4(
+        257,
+        dir_fd as u64,
+        filename as u64,
+        flags.into(),
+        mode.into(),
+    ) as i32
+}
+
+pub fn ioprio_set(which: i32, who: i32, ioprio: u16) -> i32 {
+    unsafe { syscall_3(251, which as u64, who as u64, ioprio.into()) as i32 }
+}
+
+pub fn timerfd_create(clock: u32, flags: i32) -> i32 {
+    unsafe { syscall_2(283, clock.into(), flags as u64) as i32 }
+}
+
+pub fn timerfd_settime(fd: u32, flags: i32, new_value: &itimerspec) -> i32 {
+    unsafe {
+        syscall_4(
+            286,
+            fd.into(),
+            flags as u64,
+            new_value as *const itimerspec as u64,
+            0,
+        ) as i32
+    }
+}
+
 pub fn signalfd4(fd: i32, mask: sigset_t, flags: i32) -> i32 {
     unsafe {
         syscall_4(
@@ -510,6 +1160,137 @@ pub fn signalfd4(fd: i32, mask: sigset_t, flags: i32) -> i32 {
     }
 }
 
+pub fn epoll_create1(flags: i32) -> i32 {
+    unsafe { syscall_1(291, flags as u64) as i32 }
+}
+
+pub fn syncfs(fd: u32) -> i32 {
+    unsafe { syscall_1(306, fd.into()) as i32 }
+}
+
+pub fn sched_setattr(pid: i32, attr: &sched_attr, flags: u32) -> i32 {
+    unsafe {
+        syscall_3(
+            314,
+            pid as u64,
+            attr as *const sched_attr as u64,
+            flags.into(),
+        ) as i32
+    }
+}
+
+#[allow(clippy::missing_safety_doc)]
+pub unsafe fn execveat(
+    dir_fd: u32,
+    filename: *const u8,
+    argv: *const *const u8,
+    envp: *const *const u8,
+    flags: i32,
+) -> i32 {
+    syscall_5(
+        322,
+        dir_fd.into(),
+        filename as u64,
+        argv as u64,
+        envp as u64,
+        flags as u64,
+    ) as i32
+}
+
+pub fn pidfd_send_signal(pidfd: u32, signal: i32) -> i32 {
+    unsafe { syscall_4(424, pidfd.into(), signal as u64, 0, 0) as i32 }
+}
+
+pub fn io_uring_setup(entries: u32, params: &mut io_uring_params) -> i32 {
+    unsafe { syscall_2(425, entries.into(), params as *mut io_uring_params as u64) as i32 }
+}
+
+pub fn io_uring_enter(fd: u32, to_submit: u32, min_complete: u32, flags: u32) -> i32 {
+    unsafe {
+        syscall_6(
+            426,
+            fd.into(),
+            to_submit.into(),
+            min_complete.into(),
+            flags.into(),
+            0,
+            0,
+        ) as i32
+    }
+}
+
+#[allow(clippy::missing_safety_doc)]
+pub unsafe fn io_uring_register(fd: u32, opcode: u32, arg: *const u8, nr_args: u32) -> i32 {
+    syscall_4(427, fd.into(), opcode.into(), arg as u64, nr_args.into()) as i32
+}
+
+pub fn pidfd_open(pid: i32, flags: u32) -> i32 {
+    unsafe { syscall_2(434, pid as u64, flags.into()) as i32 }
+}
+
+/// Like `clone`, but with the arguments of `clone3`. The stack of the child is given by
+/// `args.stack` and `args.stack_size`.
+#[allow(clippy::missing_safety_doc)]
+pub unsafe fn clone3(args: &mut clone_args, f: unsafe fn(data: usize), arg: usize) -> i32 {
+    let ret;
+    asm!(
+        "syscall",
+        // If we are the new process...
+        "test rax, rax",
+        "jnz 2f",
+        // Mark the new outer frame.
+        "xor ebp, ebp",
+        // Call `f`.
+        "mov rdi, r12",
+        "call r9",
+        "2:",
+        // Registers we use in the new process.
+        in("r9") f,
+        in("r12") arg,
+        // System call parameters.
+        in("rax") 435,
+        in("rdi") args as *mut clone_args,
+        in("rsi") mem::size_of::<clone_args>(),
+        lateout("rax") ret,
+        out("rcx") _,
+        out("r11") _,
+    );
+    ret
+}
+
+pub fn close_range(first: u32, last: u32, flags: u32) -> i32 {
+    unsafe { syscall_3(436, first.into(), last.into(), flags.into()) as i32 }
+}
+
+/// Frees the memory of a process that was killed without waiting for it to exit.
+pub fn process_mrelease(pidfd: u32, flags: u32) -> i32 {
+    unsafe { syscall_2(448, pidfd.into(), flags.into()) as i32 }
+}
+
+pub fn statmount(req: &mnt_id_req, buf: &mut [u64], flags: u32) -> i32 {
+    unsafe {
+        syscall_4(
+            457,
+            req as *const mnt_id_req as u64,
+            buf.as_mut_ptr() as u64,
+            mem::size_of_val(buf) as u64,
+            flags.into(),
+        ) as i32
+    }
+}
+
+pub fn listmount(req: &mnt_id_req, ids: &mut [u64], flags: u32) -> i32 {
+    unsafe {
+        syscall_4(
+            458,
+            req as *const mnt_id_req as u64,
+            ids.as_mut_ptr() as u64,
+            ids.len() as u64,
+            flags.into(),
+        ) as i32
+    }
+}
+
 pub struct Fd(pub u32);
 
 impl Drop for Fd {
@@ -543,121 +1324,426 @@ impl fmt::Write for Stderr {
     }
 }
 
-struct SpawnHelperData {
-    filename: *const u8,
-    argv: *const *const u8,
-    envp: *const *const u8,
-    pre_exec: unsafe fn(data: usize) -> bool,
-    pre_exec_data: usize,
+/// Size of the stack of a spawned process until it executes its program, where its `pre_exec`
+/// function runs.
+pub const DEFAULT_SPAWN_STACK_SIZE: usize = 64 * 1024;
+
+/// Opens a program so that it can be spawned with `Command`.
+///
+/// # Safety
+///
+/// `filename` must be a NUL-terminated string.
+pub unsafe fn open_executable(filename: *const u8) -> Result<Fd, i32> {
+    let fd = open(filename, O_PATH | O_CLOEXEC, 0);
+    if fd < 0 {
+        return Err(fd);
+    }
+    Ok(Fd(fd.try_into().unwrap()))
+}
+
+fn dummy_pre_exec(_data: usize) -> bool {
+    true
+}
+
+/// A program to spawn with `clone3`.
+///
+/// The program is executed from its FD with `execveat`. A script with a `#!` line is run by its
+/// interpreter with a `/dev/fd/N` path, so for scripts the FD of the program is left open in the
+/// interpreter, instead of being closed like the other FDs from `first_closed_fd` up.
+pub struct Command {
+    /// `O_PATH` FD of the program, as returned by `open_executable`.
+    pub executable: u32,
+    /// Array of NUL-terminated strings, with a null pointer at the end.
+    pub argv: *const *const u8,
+    /// Array of NUL-terminated strings, with a null pointer at the end.
+    pub envp: *const *const u8,
+    /// Called with `pre_exec_data` in the new process before the program is executed, which allows
+    /// the caller to change the environment for the new process. The program is not executed if it
+    /// returns false.
+    pub pre_exec: unsafe fn(data: usize) -> bool,
+    pub pre_exec_data: usize,
+    /// FD of a cgroup2 directory in which the process is created.
+    pub cgroup: Option<u32>,
+    /// FDs from this one up are closed when the program is executed, even if they do not have the
+    /// `CLOEXEC` flag.
+    pub first_closed_fd: u32,
+    pub stack_size: usize,
+    /// Signal sent to init when the process exits. With 0, `wait4` does not see the process unless
+    /// it is given `__WALL`, so that it can be reaped through its pidfd only.
+    pub exit_signal: i32,
+}
+
+/// A spawned process.
+pub struct Child {
+    pub pid: i32,
+    /// A pidfd, which always refers to this process, even after its PID is reused.
+    pub pidfd: Fd,
 }
 
-unsafe fn spawn_helper(arg: usize) {
-    let arg = &*(arg as *const SpawnHelperData);
-    if (arg.pre_exec)(arg.pre_exec_data) {
-        let ret = execve(arg.filename, arg.argv, arg.envp);
+unsafe fn command_helper(arg: usize) {
+    let command = &*(arg as *const Command);
+    if (command.pre_exec)(command.pre_exec_data) {
+        // The FD of the program itself must stay open until it is executed.
+        let ret = close_range(command.first_closed_fd, u32::MAX, CLOSE_RANGE_CLOEXEC);
         if ret < 0 {
             // Do not panic.
-            let _ = writeln!(Stderr, "failed to execve: {ret}");
+            let _ = writeln!(Stderr, "failed to close_range: {ret}");
+        }
+        let mut ret = execveat(
+            command.executable,
+            b"\0" as *const u8,
+            command.argv,
+            command.envp,
+            AT_EMPTY_PATH,
+        );
+        if ret == -ENOENT {
+            // The program is a script, whose interpreter cannot open `/dev/fd/N` if the FD is
+            // closed on exec.
+            ret = fcntl(command.executable, F_SETFD, 0);
+            if ret == 0 {
+                ret = execveat(
+                    command.executable,
+                    b"\0" as *const u8,
+                    command.argv,
+                    command.envp,
+                    AT_EMPTY_PATH,
+                );
+            }
+        }
+        if ret < 0 {
+            let _ = writeln!(Stderr, "failed to execveat: {ret}");
         }
     }
     exit(1);
 }
 
-/// Spawns a new process and returns its PID. The `pre_exec` function is called with the
-/// `pre_exec_data` argument before `execve` is called. This allows the caller to change the
-/// environment for the new process.
-///
-/// # Safety
-///
-/// `filename` must be a NUL-terminated string.
-/// `argv` must be an array of NUL-terminated strings, with a null pointer at the end.
-/// `envp` must be an array of NUL-terminated strings, with a null pointer at the end.
-/// `pre_exec` must not introduce UB.
-pub unsafe fn spawn_with_pre_exec(
-    filename: *const u8,
-    argv: *const *const u8,
-    envp: *const *const u8,
-    pre_exec: unsafe fn(data: usize) -> bool,
-    pre_exec_data: usize,
-) -> i32 {
-    let mut stack = [0u8; 512];
-    // The stack grows downwards.
-    let mut sp = stack.as_mut_ptr().add(stack.len());
-    // The stack must be 16-byte aligned.
-    sp = (sp as usize & !0xf) as *mut u8;
-    let data = SpawnHelperData {
-        filename,
-        argv,
-        envp,
-        pre_exec,
-        pre_exec_data,
-    };
-    clone(
-        CLONE_VM | CLONE_VFORK | SIGCHLD as u64,
-        sp,
-        ptr::null_mut(),
-        ptr::null_mut(),
-        ptr::null_mut(),
-        spawn_helper,
-        &data as *const _ as usize,
-    )
+impl Command {
+    /// Creates a command that runs `executable` as is, except that only the FDs 0, 1 and 2 are
+    /// inherited.
+    pub fn new(executable: &Fd, argv: *const *const u8, envp: *const *const u8) -> Self {
+        Self {
+            executable: executable.0,
+            argv,
+            envp,
+            pre_exec: dummy_pre_exec,
+            pre_exec_data: 0,
+            cgroup: None,
+            first_closed_fd: 3,
+            stack_size: DEFAULT_SPAWN_STACK_SIZE,
+            exit_signal: SIGCHLD,
+        }
+    }
+
+    /// Spawns the process. The calling thread is suspended until the process executes its program
+    /// or exits.
+    ///
+    /// # Safety
+    ///
+    /// `argv` and `envp` must be valid, and `pre_exec` must not introduce UB.
+    pub unsafe fn spawn(&self) -> Result<Child, i32> {
+        let stack_size = (self.stack_size + 0xfff) & !0xfff;
+        let stack = mmap(
+            ptr::null_mut(),
+            stack_size,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+            -1,
+            0,
+        );
+        if stack < 0 {
+            return Err(stack.try_into().unwrap());
+        }
+        let stack = stack as *mut u8;
+
+        // `pre_exec` could replace the program with another FD that it moves to a low number, and
+        // FDs from `first_closed_fd` up are closed anyway.
+        let mut relocated = None;
+        let mut command = Command { ..*self };
+        if self.executable < self.first_closed_fd {
+            let fd = fcntl(
+                self.executable,
+                F_DUPFD_CLOEXEC,
+                self.first_closed_fd.into(),
+            );
+            if fd < 0 {
+                munmap(stack, stack_size);
+                return Err(fd);
+            }
+            let fd = Fd(fd.try_into().unwrap());
+            command.executable = fd.0;
+            relocated = Some(fd);
+        }
+
+        let mut pidfd = -1i32;
+        let mut args = clone_args {
+            flags: CLONE_VM | CLONE_VFORK | CLONE_PIDFD,
+            pidfd: &mut pidfd as *mut i32 as u64,
+            exit_signal: self.exit_signal as u64,
+            stack: stack as u64,
+            stack_size: stack_size as u64,
+            ..Default::default()
+        };
+        if let Some(cgroup) = self.cgroup {
+            args.flags |= CLONE_INTO_CGROUP;
+            args.cgroup = cgroup.into();
+        }
+        let pid = clone3(
+            &mut args,
+            command_helper,
+            &command as *const Command as usize,
+        );
+        // The process does not use the stack anymore, since it has executed its program or exited
+        // when `clone3` returns.
+        munmap(stack, stack_size);
+        drop(relocated);
+        if pid < 0 {
+            return Err(pid);
+        }
+        Ok(Child {
+            pid,
+            pidfd: Fd(pidfd.try_into().unwrap()),
+        })
+    }
 }
 
-fn dummy_pre_exec(_data: usize) -> bool {
-    true
+impl Child {
+    /// Waits for the process to die and returns its status code.
+    pub fn wait(&self) -> Result<i32, i32> {
+        let mut status = 0;
+        let ret = unsafe { wait4(self.pid, &mut status as *mut i32, 0, ptr::null_mut()) };
+        if ret < 0 {
+            return Err(ret);
+        }
+        Ok(status)
+    }
 }
 
-/// Spawns a new process and returns its PID.
-///
-/// # Safety
-///
-/// `filename` must be a NUL-terminated string.
-/// `argv` must be an array of NUL-terminated strings, with a null pointer at the end.
-/// `envp` must be an array of NUL-terminated strings, with a null pointer at the end.
-pub unsafe fn spawn(filename: *const u8, argv: *const *const u8, envp: *const *const u8) -> i32 {
-    spawn_with_pre_exec(filename, argv, envp, dummy_pre_exec, 0)
+/// Calls `f` with the name (without the NUL byte) and the type (one of the `DT_*` constants) of
+/// each entry of the directory `fd`, including `.` and `..`. Stops early if `f` returns `false`.
+pub fn read_dir<F: FnMut(&[u8], u8) -> bool>(fd: u32, mut f: F) -> i64 {
+    let mut buf = [0u8; 4096];
+    loop {
+        let ret = getdents64(fd, &mut buf);
+        if ret <= 0 {
+            return ret;
+        }
+        let mut entries = &buf[..usize::try_from(ret).unwrap()];
+        // Each entry is a `linux_dirent64`: a `u64` inode number, an `i64` offset, a `u16` record
+        // length, a `u8` type and the NUL-terminated name.
+        while entries.len() >= 19 {
+            let reclen = usize::from(u16::from_ne_bytes(entries[16..18].try_into().unwrap()));
+            let name = &entries[19..reclen];
+            let name = &name[..name.iter().position(|&b| b == 0).unwrap_or(name.len())];
+            if !f(name, entries[18]) {
+                return 0;
+            }
+            entries = &entries[reclen..];
+        }
+    }
 }
 
-/// Spawns a new process, waits for it to die and returns its status code. The `pre_exec` function
-/// is called with the `pre_exec_data` argument before `execve` is called. This allows the caller
-/// to change the environment for the new process.
-///
-/// # Safety
-///
-/// `filename` must be a NUL-terminated string.
-/// `argv` must be an array of NUL-terminated strings, with a null pointer at the end.
-/// `envp` must be an array of NUL-terminated strings, with a null pointer at the end.
-/// `pre_exec` must not introduce UB.
-pub unsafe fn spawn_and_wait_with_pre_exec(
-    filename: *const u8,
-    argv: *const *const u8,
-    envp: *const *const u8,
-    pre_exec: unsafe fn(data: usize) -> bool,
-    pre_exec_data: usize,
-) -> Result<i32, i32> {
-    let pid = spawn_with_pre_exec(filename, argv, envp, pre_exec, pre_exec_data);
-    if pid < 0 {
-        return Err(pid);
-    }
-    let mut status = 0;
-    let ret = wait4(pid, &mut status as *mut i32, 0, ptr::null_mut());
-    if ret < 0 {
-        return Err(ret);
+/// A memory mapping that is unmapped when dropped.
+struct Mapping {
+    ptr: *mut u8,
+    len: usize,
+}
+
+impl Mapping {
+    fn new(fd: u32, len: usize, off: u64) -> Result<Self, i32> {
+        let ret = unsafe {
+            mmap(
+                ptr::null_mut(),
+                len,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE,
+                fd as i32,
+                off,
+            )
+        };
+        if ret < 0 {
+            return Err(ret as i32);
+        }
+        Ok(Self {
+            ptr: ret as *mut u8,
+            len,
+        })
+    }
+
+    /// Returns a pointer to the value at offset `off` of the mapping.
+    fn at<T>(&self, off: u32) -> *mut T {
+        unsafe { self.ptr.add(off as usize) as *mut T }
     }
-    Ok(status)
 }
 
-/// Spawns a new process, waits for it to die and returns its status code.
-///
-/// # Safety
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        unsafe { munmap(self.ptr, self.len) };
+    }
+}
+
+/// An io_uring instance with its submission and completion rings mapped in memory.
 ///
-/// `filename` must be a NUL-terminated string.
-/// `argv` must be an array of NUL-terminated strings, with a null pointer at the end.
-/// `envp` must be an array of NUL-terminated strings, with a null pointer at the end.
-pub unsafe fn spawn_and_wait(
-    filename: *const u8,
-    argv: *const *const u8,
-    envp: *const *const u8,
-) -> Result<i32, i32> {
-    spawn_and_wait_with_pre_exec(filename, argv, envp, dummy_pre_exec, 0)
+/// Entries are queued with `push` and handed to the kernel with `submit_and_wait`, so that many
+/// operations can be done with a single system call.
+pub struct IoUring {
+    sq_ring: Mapping,
+    cq_ring: Option<Mapping>,
+    sqes: Mapping,
+    params: io_uring_params,
+    /// Tail of the submission queue that is not yet visible to the kernel.
+    sq_tail: u32,
+    /// Number of entries queued since the last submission.
+    to_submit: u32,
+    /// Number of system calls made for this ring.
+    syscalls: u32,
+    fd: Fd,
+}
+
+impl IoUring {
+    /// Creates an io_uring instance with room for `entries` submission queue entries. The features
+    /// in `features` are required, and `-ENOSYS` is returned if the kernel lacks one of them.
+    pub fn new(entries: u32, features: u32) -> Result<Self, i32> {
+        let mut params = io_uring_params::default();
+        let fd = io_uring_setup(entries, &mut params);
+        if fd < 0 {
+            return Err(fd);
+        }
+        let fd = Fd(fd.try_into().unwrap());
+        if params.features & features != features {
+            return Err(-ENOSYS);
+        }
+
+        let sq_len = params.sq_off.array as usize + params.sq_entries as usize * 4;
+        let cq_len = params.cq_off.cqes as usize
+            + params.cq_entries as usize * mem::size_of::<io_uring_cqe>();
+        let (sq_ring, cq_ring) = if params.features & IORING_FEAT_SINGLE_MMAP != 0 {
+            (
+                Mapping::new(fd.0, sq_len.max(cq_len), IORING_OFF_SQ_RING)?,
+                None,
+            )
+        } else {
+            (
+                Mapping::new(fd.0, sq_len, IORING_OFF_SQ_RING)?,
+                Some(Mapping::new(fd.0, cq_len, IORING_OFF_CQ_RING)?),
+            )
+        };
+        let sqes = Mapping::new(
+            fd.0,
+            params.sq_entries as usize * mem::size_of::<io_uring_sqe>(),
+            IORING_OFF_SQES,
+        )?;
+
+        let sq_tail =
+            unsafe { (*sq_ring.at::<AtomicU32>(params.sq_off.tail)).load(Ordering::Relaxed) };
+        // `io_uring_setup` and the `mmap` calls.
+        let syscalls = 3 + u32::from(cq_ring.is_some());
+        Ok(Self {
+            sq_ring,
+            cq_ring,
+            sqes,
+            params,
+            sq_tail,
+            to_submit: 0,
+            syscalls,
+            fd,
+        })
+    }
+
+    /// Returns the number of system calls made for this ring, including the ones that will be made
+    /// when it is dropped.
+    pub fn syscalls(&self) -> u32 {
+        // One `munmap` per mapping and a `close`.
+        self.syscalls + 3 + u32::from(self.cq_ring.is_some())
+    }
+
+    fn cq_ring(&self) -> &Mapping {
+        self.cq_ring.as_ref().unwrap_or(&self.sq_ring)
+    }
+
+    /// Registers `count` empty slots for direct descriptors, which can then be filled by
+    /// `IORING_OP_OPENAT` with a `file_index` and used with `IOSQE_FIXED_FILE`.
+    pub fn register_empty_files(&mut self, count: usize) -> i32 {
+        self.syscalls += 1;
+        let fds = [-1i32; 256];
+        let count = count.min(fds.len());
+        unsafe {
+            io_uring_register(
+                self.fd.0,
+                IORING_REGISTER_FILES,
+                fds.as_ptr() as *const u8,
+                count as u32,
+            )
+        }
+    }
+
+    /// Returns the number of entries that can still be queued before a submission.
+    pub fn space(&self) -> u32 {
+        let head = unsafe {
+            (*self.sq_ring.at::<AtomicU32>(self.params.sq_off.head)).load(Ordering::Acquire)
+        };
+        self.params.sq_entries - self.sq_tail.wrapping_sub(head)
+    }
+
+    /// Queues an entry. It is not seen by the kernel until `submit_and_wait` is called. Returns
+    /// false if the submission queue is full.
+    pub fn push(&mut self, sqe: io_uring_sqe) -> bool {
+        if self.space() == 0 {
+            return false;
+        }
+        let mask = unsafe { *self.sq_ring.at::<u32>(self.params.sq_off.ring_mask) };
+        let index = self.sq_tail & mask;
+        unsafe {
+            *self.sqes.at::<io_uring_sqe>(0).add(index as usize) = sqe;
+            *self
+                .sq_ring
+                .at::<u32>(self.params.sq_off.array)
+                .add(index as usize) = index;
+        }
+        self.sq_tail = self.sq_tail.wrapping_add(1);
+        self.to_submit += 1;
+        true
+    }
+
+    /// Submits the queued entries and waits until at least `wait_nr` completions are available.
+    /// Returns the number of submitted entries.
+    pub fn submit_and_wait(&mut self, wait_nr: u32) -> i32 {
+        unsafe {
+            (*self.sq_ring.at::<AtomicU32>(self.params.sq_off.tail))
+                .store(self.sq_tail, Ordering::Release);
+        }
+        let flags = if wait_nr > 0 {
+            IORING_ENTER_GETEVENTS
+        } else {
+            0
+        };
+        loop {
+            self.syscalls += 1;
+            let ret = io_uring_enter(self.fd.0, self.to_submit, wait_nr, flags);
+            if ret == -EINTR {
+                continue;
+            }
+            if ret >= 0 {
+                self.to_submit -= ret as u32;
+            }
+            return ret;
+        }
+    }
+
+    /// Takes the next completion, if there is one.
+    pub fn pop(&mut self) -> Option<io_uring_cqe> {
+        let ring = self.cq_ring();
+        let off = &self.params.cq_off;
+        unsafe {
+            let head = &*ring.at::<AtomicU32>(off.head);
+            let tail = (*ring.at::<AtomicU32>(off.tail)).load(Ordering::Acquire);
+            let h = head.load(Ordering::Relaxed);
+            if h == tail {
+                return None;
+            }
+            let mask = *ring.at::<u32>(off.ring_mask);
+            let cqe = *ring.at::<io_uring_cqe>(off.cqes).add((h & mask) as usize);
+            head.store(h.wrapping_add(1), Ordering::Release);
+            Some(cqe)
+        }
+    }
 }
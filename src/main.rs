@@ -10,27 +10,33 @@ use core::fmt::Write;
 use core::mem;
 use core::{panic::PanicInfo, ptr};
 
+use reactor::Flow;
+
+pub mod cgroup;
 pub mod config;
+pub mod exec;
+pub mod histogram;
 pub mod linux;
+pub mod mm;
 pub mod mounts;
 pub mod net;
+pub mod oom;
+pub mod pressure;
+pub mod procfs;
+pub mod reactor;
+pub mod sched;
 pub mod seat;
+pub mod service;
 pub mod shutdown;
 pub mod sysctl;
+pub mod trace;
+pub mod uevent;
 pub mod ui;
+pub mod zram;
 
+/// Runs the steps of the boot that can wait until the user interface is started.
 fn late_init() {
-    sysctl::apply_sysctl();
-
-    let mut ret = config::mount_late();
-    if ret < 0 {
-        writeln!(linux::Stderr, "failed to mount late FS: {ret}").unwrap();
-    }
-
-    ret = net::setup_networking();
-    if ret < 0 {
-        writeln!(linux::Stderr, "failed to setup networking: {ret}").unwrap();
-    }
+    exec::run(&exec::Steps(config::LATE_STEPS));
 }
 
 fn redirect_stdout() {
@@ -57,6 +63,7 @@ fn redirect_stdout() {
 }
 
 fn dmesg_pre_exec(fd: usize) -> bool {
+    config::DMESG_SCHED.apply();
     // Output into the FD.
     let ret = linux::dup2(fd.try_into().unwrap(), 1);
     if ret < 0 {
@@ -81,15 +88,21 @@ fn write_kernel_log() {
             return;
         }
     };
-    let ret = unsafe {
-        linux::spawn_and_wait_with_pre_exec(
-            b"/bin/dmesg\0" as *const u8,
-            &[b"/bin/dmesg\0" as *const u8, ptr::null()] as *const *const u8,
-            &[ptr::null()] as *const *const u8,
-            dmesg_pre_exec,
-            fd.0.try_into().unwrap(),
-        )
+    let executable = match unsafe { linux::open_executable(b"/bin/dmesg\0" as *const u8) } {
+        Ok(e) => e,
+        Err(e) => {
+            writeln!(linux::Stderr, "failed to open /bin/dmesg: {e}").unwrap();
+            return;
+        }
     };
+    let mut command = linux::Command::new(
+        &executable,
+        &[b"/bin/dmesg\0" as *const u8, ptr::null()] as *const *const u8,
+        &[ptr::null()] as *const *const u8,
+    );
+    command.pre_exec = dmesg_pre_exec;
+    command.pre_exec_data = fd.0.try_into().unwrap();
+    let ret = unsafe { command.spawn() }.and_then(|child| child.wait());
     match ret {
         Ok(code) => {
             if code != 0 {
@@ -103,15 +116,26 @@ fn write_kernel_log() {
 /// Shuts down the system while making sure that no progress will be lost.
 fn graceful_shutdown() {
     writeln!(linux::Stdout, "shutting down...").unwrap();
+    trace::instant("shutdown", 0);
+
+    cgroup::report("at shutdown");
 
-    write_kernel_log();
+    trace::span("write_kernel_log", write_kernel_log);
 
     // Start writing data to disk so that there is less to write when the
     // processes are killed.
-    linux::sync();
+    trace::span("shutdown::sync_filesystems", shutdown::sync_filesystems);
+
+    trace::span("shutdown::end_all_processes", shutdown::end_all_processes);
+
+    // The root filesystem is never unmounted, so this is the last moment where the trace can be
+    // saved with most of the shutdown in it.
+    let ret = unsafe { trace::dump(b"/var/log/boot-trace\0" as *const u8) };
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to write /var/log/boot-trace: {ret}").unwrap();
+    }
 
-    shutdown::end_all_processes();
-    shutdown::unmount_all();
+    trace::span("shutdown::unmount_all", shutdown::unmount_all);
     shutdown::power_off();
 }
 
@@ -150,6 +174,55 @@ fn create_dev_symlinks() {
     }
 }
 
+/// Reaps zombie processes when `SIGCHLD` is received. Services are not reaped here since they do
+/// not send `SIGCHLD`, only orphan processes that were adopted by init are.
+struct ChildReaper {
+    signalfd: linux::Fd,
+}
+
+impl reactor::Source for ChildReaper {
+    fn register(&mut self, registrar: &reactor::Registrar) -> i32 {
+        registrar.add(self.signalfd.0, linux::EPOLLIN, 0)
+    }
+
+    fn dispatch(&mut self, _registrar: &reactor::Registrar, _key: u32, events: u32) -> Flow {
+        if events & linux::EPOLLERR != 0 {
+            writeln!(linux::Stderr, "epoll returned error on SIGCHLD signalfd").unwrap();
+            return Flow::Stop;
+        }
+
+        // Drain the signalfd because it is edge-triggered: the kernel will not notify us again
+        // until a new signal arrives after it is empty.
+        loop {
+            let mut buf = [0u8; 128];
+            let ret = linux::read(self.signalfd.0, &mut buf);
+            if ret == -i64::from(linux::EAGAIN) {
+                break;
+            } else if ret < 0 {
+                writeln!(linux::Stderr, "failed to read from signalfd: {ret}").unwrap();
+                break;
+            }
+        }
+
+        // Reap zombie processes.
+        let mut status: i32 = 0;
+        loop {
+            let pid = unsafe {
+                linux::wait4(-1, &mut status as *mut i32, linux::WNOHANG, ptr::null_mut())
+            };
+            if pid == -linux::ECHILD {
+                break;
+            } else if pid < 0 {
+                writeln!(linux::Stderr, "failed to wait for process: {pid}").unwrap();
+                break;
+            } else if pid == 0 {
+                break;
+            }
+        }
+        Flow::Continue
+    }
+}
+
 fn run_event_loop() {
     let mask = linux::sigset_t::try_from(1 << (linux::SIGCHLD - 1)).unwrap();
 
@@ -182,113 +255,107 @@ fn run_event_loop() {
         }
     };
 
-    let ui_child_pid = ui::start_ui_process(seat_compositor_fd.0);
-    if ui_child_pid < 0 {
-        writeln!(linux::Stderr, "failed to start UI process: {ui_child_pid}").unwrap();
-        return;
-    }
+    trace::span("seat::preopen_devices", || seat_server.preopen_devices());
 
-    late_init();
-
-    loop {
-        let mut fds = [
-            linux::pollfd {
-                fd: i32::try_from(signalfd.0).unwrap(),
-                events: linux::POLLIN,
-                revents: 0,
-            },
-            linux::pollfd {
-                fd: i32::try_from(seat_server.fd()).unwrap(),
-                events: linux::POLLIN,
-                revents: 0,
-            },
-        ];
-        let ret = linux::poll(&mut fds, 500);
-        if ret < 0 {
-            writeln!(linux::Stderr, "failed to poll: {ret}").unwrap();
-            break;
-        }
-        if fds[0].revents & (linux::POLLERR | linux::POLLNVAL) != 0 {
-            writeln!(
-                linux::Stderr,
-                "poll returned error on SIGCHLD signalfd: {}",
-                fds[0].revents
-            )
-            .unwrap();
-            break;
-        }
-        if fds[1].revents & (linux::POLLERR | linux::POLLNVAL) != 0 {
-            writeln!(
-                linux::Stderr,
-                "poll returned error on seat server socket: {}",
-                fds[1].revents
-            )
-            .unwrap();
-            break;
+    let seat = ui::Seat::new(seat_compositor_fd.0, &seat_server);
+    let mut supervisor = match service::Supervisor::new(config::SERVICES, &seat) {
+        Ok(s) => s,
+        Err(err) => {
+            writeln!(linux::Stderr, "failed to create service supervisor: {err}").unwrap();
+            return;
         }
+    };
+    trace::span("service::start_all", || supervisor.start_all(false));
 
-        if fds[0].revents & linux::POLLIN != 0 {
-            // Drain the signalfd before we reap processes to mark the signals as handled by the
-            // kernel so that it doesn't wake up until a new one arrives. If poll was
-            // edge-triggered, we would not need to do that, but here we need to do it because it
-            // is level-triggered.
-            loop {
-                let mut buf = [0u8; 128];
-                let ret = linux::read(signalfd.0, &mut buf);
-                if ret == -i64::from(linux::EAGAIN) {
-                    break;
-                } else if ret < 0 {
-                    writeln!(linux::Stderr, "failed to read from signalfd: {ret}").unwrap();
-                    break;
-                }
-            }
+    trace::span("late_init", late_init);
 
-            // Reap zombie processes.
-            let mut status: i32 = 0;
-            loop {
-                let pid = unsafe {
-                    linux::wait4(-1, &mut status as *mut i32, linux::WNOHANG, ptr::null_mut())
-                };
-                if pid < 0 {
-                    writeln!(linux::Stderr, "failed to wait for process: {pid}").unwrap();
-                    break;
-                } else if pid == 0 {
-                    break;
-                } else if pid == ui_child_pid {
-                    writeln!(linux::Stdout, "UI process died: {status}").unwrap();
-                    // Consider the system stopped when the UI process dies.
-                    return;
-                }
-            }
+    trace::span("service::start_all", || supervisor.start_all(true));
+
+    cgroup::report("at boot");
+
+    let ret = unsafe { trace::dump(b"/run/boot-trace\0" as *const u8) };
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to write /run/boot-trace: {ret}").unwrap();
+    }
+
+    let mut pressure_monitor = match pressure::Monitor::new() {
+        Ok(m) => m,
+        Err(err) => {
+            writeln!(linux::Stderr, "failed to create pressure monitor: {err}").unwrap();
+            return;
         }
+    };
 
-        if fds[1].revents & linux::POLLIN != 0 {
-            if let Err(err) = seat_server.process_incoming() {
-                writeln!(
-                    linux::Stderr,
-                    "failed to process seat server request: {err}"
-                )
-                .unwrap();
-                return;
-            }
+    let mut oom_killer = match oom::Killer::new() {
+        Ok(k) => k,
+        Err(err) => {
+            writeln!(linux::Stderr, "failed to create OOM killer: {err}").unwrap();
+            return;
+        }
+    };
+
+    let mut reactor = match reactor::Reactor::new() {
+        Ok(r) => r,
+        Err(err) => {
+            writeln!(linux::Stderr, "failed to create event loop: {err}").unwrap();
+            return;
         }
+    };
+    let mut reaper = ChildReaper { signalfd };
+    let mut ret = reactor.add(&mut reaper);
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to watch SIGCHLD signalfd: {ret}").unwrap();
+        return;
     }
+    ret = reactor.add(&mut seat_server);
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to watch seat server socket: {ret}").unwrap();
+        return;
+    }
+    ret = reactor.add(&mut supervisor);
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to watch services: {ret}").unwrap();
+        return;
+    }
+    ret = reactor.add(&mut pressure_monitor);
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to watch pressure: {ret}").unwrap();
+        return;
+    }
+    ret = reactor.add(&mut oom_killer);
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to watch available memory: {ret}").unwrap();
+        return;
+    }
+
+    ret = reactor.run();
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to wait for events: {ret}").unwrap();
+    }
+    reactor.report();
+    drop(reactor);
+    seat_server.report();
+    pressure_monitor.stop();
+    pressure_monitor.report();
+    oom_killer.report();
+    trace::span("service::stop_all", || {
+        supervisor.stop_all(config::SHUTDOWN_TERM_TIMEOUT_MS)
+    });
 }
 
 #[no_mangle]
 extern "C" fn _start() -> ! {
+    trace::instant("_start", 0);
+
     redirect_stdout();
 
     writeln!(linux::Stdout, "booting...").unwrap();
 
-    let ret = config::mount_early();
-    if ret < 0 {
-        writeln!(linux::Stderr, "failed to mount early FS: {ret}").unwrap();
-    }
-
-    create_dev_symlinks();
-    ui::add_dri_render_permissions();
-    ui::set_backlight_brightness();
+    // Mounts filesystems and prepares devices. The steps are generated from the `config.toml`
+    // file by the `build.rs` script.
+    trace::span("early_init", || {
+        exec::run(&exec::Steps(config::EARLY_STEPS))
+    });
 
     run_event_loop();
 
@@ -0,0 +1,65 @@
+//! Memory management settings, from the `[mm]` and `[zswap]` sections of `config.toml`:
+//! transparent huge pages, hugetlb reservations, multi-gen LRU, KSM and zswap.
+//!
+//! They are applied by an early step of the boot, since huge pages can only be reserved reliably
+//! before memory is fragmented, and so that they are in effect before the compositor allocates its
+//! buffers. The `build.rs` script groups them by directory like sysctl options. Unlike sysctl
+//! options, what these files read back differs from what is written: the transparent huge page
+//! files show all the choices with the selected one in brackets, and `nr_hugepages` shows how many
+//! pages could actually be reserved. So each file is read back after it is written, and both
+//! values are logged.
+
+use core::convert::{TryFrom, TryInto};
+use core::fmt::Write;
+use core::str;
+
+use crate::config;
+use crate::linux::{self, Fd};
+use crate::procfs;
+
+/// Maximum size of a value that is read back.
+const MAX_VALUE_LEN: usize = 256;
+
+/// Applies the settings and logs the result of each one. Like for sysctl options, errors are logged
+/// instead of being returned, so that the other settings are still applied.
+pub fn apply_mm() -> i32 {
+    for dir in config::MM {
+        let path = str::from_utf8(&dir.path[..dir.path.len() - 1]).unwrap();
+        let dir_fd = unsafe {
+            linux::open(
+                dir.path.as_ptr(),
+                linux::O_RDONLY | linux::O_DIRECTORY | linux::O_CLOEXEC,
+                0,
+            )
+        };
+        if dir_fd < 0 {
+            // The kernel lacks the feature, or the size of huge pages does not exist.
+            writeln!(linux::Stderr, "failed to open {path}: {dir_fd}").unwrap();
+            continue;
+        }
+        let dir_fd = Fd(dir_fd.try_into().unwrap());
+        for (name, value) in dir.options {
+            let name_str = str::from_utf8(&name[..name.len() - 1]).unwrap();
+            let value_str = str::from_utf8(value).unwrap();
+            let ret = procfs::write_file_at(i32::try_from(dir_fd.0).unwrap(), name, value);
+            if ret < 0 {
+                writeln!(
+                    linux::Stderr,
+                    "failed to set {path}/{name_str} to {value_str}: {ret}"
+                )
+                .unwrap();
+                continue;
+            }
+            let mut buf = [0u8; MAX_VALUE_LEN];
+            let current = procfs::read_file_at(i32::try_from(dir_fd.0).unwrap(), name, &mut buf)
+                .unwrap_or(&b"?"[..]);
+            let current = str::from_utf8(current).unwrap_or("?").trim_end();
+            writeln!(
+                linux::Stdout,
+                "mm: set {path}/{name_str} to {value_str}, now {current}"
+            )
+            .unwrap();
+        }
+    }
+    0
+}
@@ -1,102 +1,432 @@
+//! Enumeration of the mounts of the mount namespace of the init process.
+//!
+//! The `listmount` and `statmount` system calls (Linux 6.8) are used when they are available,
+//! since they give mount IDs and paths without any text to parse. Otherwise,
+//! `/proc/self/mountinfo` is parsed, reading it in large chunks and looking for delimiters a word
+//! at a time.
+//!
+//! A table that is full keeps the mounts that fit and counts the other ones, so that callers can
+//! still act on most mounts and report how many were left out.
+
+use core::convert::{TryFrom, TryInto};
+use core::mem;
+
 use crate::linux;
-use core::convert::TryInto;
 
-#[derive(Copy, Clone, Debug)]
-enum MountParserState {
-    BeforeDirectory,
-    Directory,
-    AfterDirectory,
+/// Maximum number of mounts in a table.
+pub const MAX_MOUNTS: usize = 4096;
+
+/// Size of the storage for the paths and filesystem types of a table.
+const STRINGS_SIZE: usize = 256 * 1024;
+
+/// Size of the buffer used to read `/proc/self/mountinfo`.
+const READ_BUFFER_SIZE: usize = 64 * 1024;
+
+#[derive(Copy, Clone)]
+struct Entry {
+    id: u64,
+    parent_id: u64,
+    dev: (u32, u32),
+    /// Offset of the NUL-terminated path in `strings`.
+    path: u32,
+    /// Offset of the NUL-terminated filesystem type in `strings`.
+    fs_type: u32,
 }
 
-fn read_mounts_from_fd<const N: usize>(fd: u32, out: &mut [u8; N]) -> i32 {
-    let mut state = MountParserState::BeforeDirectory;
-    let mut cursor = 0;
-    loop {
-        let mut buf = [0u8; 256];
-        let ret = linux::read(fd, &mut buf);
-        let n: usize = match ret {
-            // EOF
-            0 => break,
-            // Error
-            n if n < 0 => return n.try_into().unwrap(),
-            // Success
-            n => n.try_into().unwrap(),
-        };
+/// A mount in a `MountTable`.
+#[derive(Copy, Clone)]
+pub struct Mount<'a> {
+    /// ID of the mount. IDs from `statmount` and from `mountinfo` are different, but the ones in a
+    /// table always come from the same source.
+    pub id: u64,
+    /// ID of the mount that this one is mounted on.
+    pub parent_id: u64,
+    /// Major and minor numbers of the device of the filesystem. Mounts of the same filesystem have
+    /// the same numbers.
+    pub dev: (u32, u32),
+    path: &'a [u8],
+    fs_type: &'a [u8],
+}
 
-        let mut done = 0;
-        loop {
-            let remaining = &buf[done..n];
-            match state {
-                MountParserState::BeforeDirectory => {
-                    match remaining.iter().position(|b| *b == b' ') {
-                        Some(p) => {
-                            state = MountParserState::Directory;
-
-                            done += p + 1;
-                            if done >= buf.len() {
-                                break;
-                            }
-                        }
-                        None => break,
-                    }
+impl<'a> Mount<'a> {
+    /// Returns the NUL-terminated mount point.
+    pub fn c_path(&self) -> &'a [u8] {
+        self.path
+    }
+
+    /// Returns the mount point, without the NUL byte.
+    pub fn path(&self) -> &'a [u8] {
+        &self.path[..self.path.len() - 1]
+    }
+
+    /// Returns the type of the filesystem, without the NUL byte.
+    pub fn fs_type(&self) -> &'a [u8] {
+        &self.fs_type[..self.fs_type.len() - 1]
+    }
+}
+
+/// The mounts of the mount namespace, in the order in which they were mounted. It has a fixed
+/// capacity and does not allocate.
+pub struct MountTable {
+    entries: [Entry; MAX_MOUNTS],
+    count: usize,
+    strings: [u8; STRINGS_SIZE],
+    strings_len: usize,
+    /// Number of mounts that did not fit in the table.
+    dropped: usize,
+}
+
+/// Returns a word where the high bit of each byte is set if the corresponding byte of `word` is
+/// zero. Other bits are garbage only above a zero byte, which does not matter when looking for the
+/// first one.
+fn zero_bytes(word: u64) -> u64 {
+    const LOW: u64 = 0x0101_0101_0101_0101;
+    const HIGH: u64 = 0x8080_8080_8080_8080;
+    word.wrapping_sub(LOW) & !word & HIGH
+}
+
+/// Returns the index of the first occurrence of `needle` in `haystack`, comparing 8 bytes at a
+/// time.
+fn find_byte(haystack: &[u8], needle: u8) -> Option<usize> {
+    let pattern = u64::from_ne_bytes([needle; 8]);
+    let mut chunks = haystack.chunks_exact(8);
+    let mut offset = 0;
+    for chunk in &mut chunks {
+        let word = u64::from_le_bytes(chunk.try_into().unwrap());
+        let found = zero_bytes(word ^ pattern);
+        if found != 0 {
+            return Some(offset + usize::try_from(found.trailing_zeros() / 8).unwrap());
+        }
+        offset += 8;
+    }
+    chunks
+        .remainder()
+        .iter()
+        .position(|&b| b == needle)
+        .map(|p| offset + p)
+}
+
+/// Splits the next field separated by a space off `line`.
+fn next_field<'a>(line: &mut &'a [u8]) -> Option<&'a [u8]> {
+    let (field, rest) = match find_byte(line, b' ') {
+        Some(p) => (&line[..p], &line[p + 1..]),
+        None if !line.is_empty() => (*line, &line[line.len()..]),
+        None => return None,
+    };
+    *line = rest;
+    Some(field)
+}
+
+fn parse_u64(s: &[u8]) -> Option<u64> {
+    if s.is_empty() {
+        return None;
+    }
+    s.iter().try_fold(0u64, |acc, &c| {
+        if !c.is_ascii_digit() {
+            return None;
+        }
+        acc.checked_mul(10)?.checked_add(u64::from(c - b'0'))
+    })
+}
+
+impl MountTable {
+    pub fn new() -> Self {
+        Self {
+            entries: [Entry {
+                id: 0,
+                parent_id: 0,
+                dev: (0, 0),
+                path: 0,
+                fs_type: 0,
+            }; MAX_MOUNTS],
+            count: 0,
+            strings: [0; STRINGS_SIZE],
+            strings_len: 0,
+            dropped: 0,
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.count
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.count == 0
+    }
+
+    /// Returns the number of mounts that were left out of the table by `read` because it was full.
+    pub fn dropped(&self) -> usize {
+        self.dropped
+    }
+
+    /// Returns the mount at `index`, where mounts are in the order in which they were mounted.
+    pub fn get(&self, index: usize) -> Mount<'_> {
+        let e = &self.entries[index];
+        Mount {
+            id: e.id,
+            parent_id: e.parent_id,
+            dev: e.dev,
+            path: self.c_str(e.path),
+            fs_type: self.c_str(e.fs_type),
+        }
+    }
+
+    pub fn iter(&self) -> impl DoubleEndedIterator<Item = Mount<'_>> {
+        (0..self.count).map(move |i| self.get(i))
+    }
+
+    fn c_str(&self, offset: u32) -> &[u8] {
+        let s = &self.strings[usize::try_from(offset).unwrap()..self.strings_len];
+        &s[..find_byte(s, 0).map_or(s.len(), |p| p + 1)]
+    }
+
+    /// Copies `s` and a NUL byte to the strings of the table, decoding octal escapes like `\040`
+    /// if `unescape` is true. Returns the offset of the string.
+    fn push_str(&mut self, s: &[u8], unescape: bool) -> Result<u32, i32> {
+        let start = self.strings_len;
+        if start + s.len() + 1 > self.strings.len() {
+            return Err(-linux::ENOMEM);
+        }
+        let mut len = 0;
+        let mut rest = s;
+        while !rest.is_empty() {
+            let copy = if unescape {
+                find_byte(rest, b'\\').unwrap_or(rest.len())
+            } else {
+                rest.len()
+            };
+            self.strings[start + len..start + len + copy].copy_from_slice(&rest[..copy]);
+            len += copy;
+            rest = &rest[copy..];
+            if rest.is_empty() {
+                break;
+            }
+            // `rest` starts with a backslash.
+            let digits = rest
+                .get(1..4)
+                .filter(|d| d.iter().all(|c| (b'0'..=b'7').contains(c)));
+            match digits {
+                Some(d) => {
+                    self.strings[start + len] =
+                        (d[0] - b'0') << 6 | (d[1] - b'0') << 3 | (d[2] - b'0');
+                    rest = &rest[4..];
                 }
-                MountParserState::Directory => match remaining.iter().position(|b| *b == b' ') {
-                    Some(p) => {
-                        if cursor + p + 1 >= out.len() {
-                            return -linux::ENOMEM;
-                        }
+                None => {
+                    self.strings[start + len] = b'\\';
+                    rest = &rest[1..];
+                }
+            }
+            len += 1;
+        }
+        self.strings[start + len] = 0;
+        self.strings_len = start + len + 1;
+        Ok(u32::try_from(start).unwrap())
+    }
 
-                        out[cursor..(cursor + p)].copy_from_slice(&remaining[..p]);
-                        cursor += p;
+    /// Adds a mount to the table, or counts it as dropped if it does not fit.
+    fn push(
+        &mut self,
+        id: u64,
+        parent_id: u64,
+        dev: (u32, u32),
+        path: &[u8],
+        fs_type: &[u8],
+        unescape: bool,
+    ) {
+        let strings_len = self.strings_len;
+        let strings = self
+            .push_str(path, unescape)
+            .and_then(|path| Ok((path, self.push_str(fs_type, unescape)?)));
+        let (path, fs_type) = match strings {
+            Ok(s) if self.count < MAX_MOUNTS => s,
+            _ => {
+                self.strings_len = strings_len;
+                self.dropped += 1;
+                return;
+            }
+        };
+        self.entries[self.count] = Entry {
+            id,
+            parent_id,
+            dev,
+            path,
+            fs_type,
+        };
+        self.count += 1;
+    }
 
-                        out[cursor] = b'\0';
-                        cursor += 1;
+    fn clear(&mut self) {
+        self.count = 0;
+        self.strings_len = 0;
+        self.dropped = 0;
+    }
 
-                        state = MountParserState::AfterDirectory;
+    /// Reads the mounts with `listmount` and `statmount`.
+    fn read_with_statmount(&mut self) -> i32 {
+        let mut ids = [0u64; 512];
+        // The buffer is made of `u64` for alignment.
+        let mut buf = [0u64; 1024];
+        let mut last = 0;
+        loop {
+            let req = linux::mnt_id_req {
+                size: u32::try_from(mem::size_of::<linux::mnt_id_req>()).unwrap(),
+                spare: 0,
+                mnt_id: linux::LSMT_ROOT,
+                param: last,
+            };
+            let n = linux::listmount(&req, &mut ids, 0);
+            if n < 0 {
+                return n;
+            }
+            if n == 0 {
+                return 0;
+            }
+            for &id in &ids[..usize::try_from(n).unwrap()] {
+                last = id;
+                let req = linux::mnt_id_req {
+                    size: u32::try_from(mem::size_of::<linux::mnt_id_req>()).unwrap(),
+                    spare: 0,
+                    mnt_id: id,
+                    param: linux::STATMOUNT_SB_BASIC
+                        | linux::STATMOUNT_MNT_BASIC
+                        | linux::STATMOUNT_MNT_POINT
+                        | linux::STATMOUNT_FS_TYPE,
+                };
+                let ret = linux::statmount(&req, &mut buf, 0);
+                if ret == -linux::EOVERFLOW {
+                    // Its strings do not fit in `buf`.
+                    self.dropped += 1;
+                    continue;
+                } else if ret < 0 {
+                    // The mount might have been unmounted since it was listed.
+                    continue;
+                }
+                let sm = unsafe { &*(buf.as_ptr() as *const linux::statmount) };
+                let bytes = unsafe {
+                    core::slice::from_raw_parts(buf.as_ptr() as *const u8, mem::size_of_val(&buf))
+                };
+                let strings = &bytes[mem::size_of::<linux::statmount>()..];
+                let str_at = |offset: u32| {
+                    let s = &strings[usize::try_from(offset).unwrap()..];
+                    &s[..find_byte(s, 0).unwrap_or(s.len())]
+                };
+                self.push(
+                    sm.mnt_id,
+                    sm.mnt_parent_id,
+                    (sm.sb_dev_major, sm.sb_dev_minor),
+                    str_at(sm.mnt_point),
+                    str_at(sm.fs_type),
+                    false,
+                );
+            }
+        }
+    }
 
-                        done += p + 1;
-                        if done >= buf.len() {
-                            break;
-                        }
-                    }
-                    None => {
-                        if cursor + remaining.len() + 1 >= out.len() {
-                            return -linux::ENOMEM;
-                        }
-                        out[cursor..(cursor + remaining.len())].copy_from_slice(remaining);
-                        cursor += remaining.len();
+    /// Parses a line of `/proc/self/mountinfo`, without the newline.
+    fn push_mountinfo_line(&mut self, mut line: &[u8]) -> i32 {
+        // The line looks like `36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw`,
+        // with a variable number of optional fields before the dash.
+        let id = next_field(&mut line).and_then(parse_u64);
+        let parent_id = next_field(&mut line).and_then(parse_u64);
+        let dev = next_field(&mut line).and_then(|d| {
+            let colon = find_byte(d, b':')?;
+            let major = u32::try_from(parse_u64(&d[..colon])?).ok()?;
+            let minor = u32::try_from(parse_u64(&d[colon + 1..])?).ok()?;
+            Some((major, minor))
+        });
+        let _root = next_field(&mut line);
+        let path = next_field(&mut line);
+        let mut fs_type = None;
+        while let Some(field) = next_field(&mut line) {
+            if field == b"-" {
+                fs_type = next_field(&mut line);
+                break;
+            }
+        }
+        match (id, parent_id, dev, path, fs_type) {
+            (Some(id), Some(parent_id), Some(dev), Some(path), Some(fs_type)) => {
+                self.push(id, parent_id, dev, path, fs_type, true);
+                0
+            }
+            _ => -linux::EINVAL,
+        }
+    }
 
-                        out[cursor] = b'\0';
-                        cursor += 1;
+    /// Reads the mounts from `/proc/self/mountinfo`.
+    fn read_mountinfo(&mut self) -> i32 {
+        let fd = unsafe {
+            linux::open(
+                b"/proc/self/mountinfo\0" as *const u8,
+                linux::O_RDONLY | linux::O_CLOEXEC,
+                0,
+            )
+        };
+        if fd < 0 {
+            return fd;
+        }
+        let fd = linux::Fd(fd.try_into().unwrap());
 
-                        break;
-                    }
-                },
-                MountParserState::AfterDirectory => {
-                    match remaining.iter().position(|b| *b == b'\n') {
-                        Some(p) => {
-                            state = MountParserState::BeforeDirectory;
-
-                            done += p + 1;
-                            if done >= buf.len() {
-                                break;
-                            }
-                        }
-                        None => break,
+        let mut buf = [0u8; READ_BUFFER_SIZE];
+        // Number of bytes at the start of `buf` that belong to an incomplete line.
+        let mut pending = 0;
+        // Whether the rest of a line that does not fit in the buffer is being skipped.
+        let mut skipping = false;
+        loop {
+            let n = linux::read(fd.0, &mut buf[pending..]);
+            if n < 0 {
+                return n.try_into().unwrap();
+            }
+            if n == 0 {
+                break;
+            }
+            let end = pending + usize::try_from(n).unwrap();
+            let mut start = 0;
+            if skipping {
+                match find_byte(&buf[..end], b'\n') {
+                    Some(p) => {
+                        skipping = false;
+                        start = p + 1;
                     }
+                    None => continue,
+                }
+            }
+            while let Some(p) = find_byte(&buf[start..end], b'\n') {
+                let ret = self.push_mountinfo_line(&buf[start..start + p]);
+                if ret < 0 {
+                    return ret;
                 }
+                start += p + 1;
+            }
+            if start == 0 && end == buf.len() {
+                // The line does not fit in the buffer, so the mount is dropped.
+                self.dropped += 1;
+                skipping = true;
+                pending = 0;
+                continue;
             }
+            buf.copy_within(start..end, 0);
+            pending = end - start;
+        }
+        if pending > 0 && !skipping {
+            return self.push_mountinfo_line(&buf[..pending]);
         }
+        0
     }
 
-    cursor.try_into().unwrap()
+    /// Fills the table with the current mounts, replacing its content.
+    pub fn read(&mut self) -> i32 {
+        self.clear();
+        let ret = self.read_with_statmount();
+        if ret != -linux::ENOSYS {
+            return ret;
+        }
+        self.clear();
+        self.read_mountinfo()
+    }
 }
 
-pub fn read_mounts<const N: usize>(out: &mut [u8; N]) -> i32 {
-    let fd = unsafe { linux::open(b"/proc/mounts\0" as *const u8, linux::O_RDONLY, 0) };
-    if fd < 0 {
-        return fd;
+impl Default for MountTable {
+    fn default() -> Self {
+        Self::new()
     }
-    let fd = linux::Fd(fd.try_into().unwrap());
-    read_mounts_from_fd(fd.0, out)
 }
@@ -4,8 +4,9 @@
 
 use core::convert::TryFrom;
 use core::convert::TryInto;
+use core::fmt::Write;
 use core::slice;
-use core::{mem, ptr};
+use core::{mem, ptr, str};
 
 use crate::config;
 use crate::linux;
@@ -44,48 +45,201 @@ impl NetlinkSocket {
         seq
     }
 
-    /// Sends a message through the socket.
-    fn send(&self, msg: &[u8]) -> i64 {
-        linux::write(self.fd.0, msg)
-    }
-
     /// Receives a message from the socket.
     fn recv(&self, msg: &mut [u8]) -> i64 {
         linux::read(self.fd.0, msg)
     }
+}
+
+/// Maximum number of requests in a batch.
+const MAX_REQUESTS: usize = 32;
+
+/// A request that was added to a batch.
+struct Request {
+    seq: u32,
+    /// What the request does, for error messages.
+    what: &'static str,
+    interface_index: u32,
+    acked: bool,
+}
+
+/// A batch of netlink requests that are all sent with a single `sendmsg` call. Their
+/// acknowledgements are then collected and matched with the requests using the sequence numbers,
+/// which turns one round trip per request into a single one for the whole batch.
+struct Batch {
+    buf: [u8; 4096],
+    len: usize,
+    iovs: [linux::iovec; MAX_REQUESTS],
+    requests: [Request; MAX_REQUESTS],
+    count: usize,
+}
+
+impl Batch {
+    fn new() -> Self {
+        const EMPTY_IOV: linux::iovec = linux::iovec {
+            iov_base: ptr::null_mut(),
+            iov_len: 0,
+        };
+        const EMPTY_REQUEST: Request = Request {
+            seq: 0,
+            what: "",
+            interface_index: 0,
+            acked: false,
+        };
+        Self {
+            buf: [0; 4096],
+            len: 0,
+            iovs: [EMPTY_IOV; MAX_REQUESTS],
+            requests: [EMPTY_REQUEST; MAX_REQUESTS],
+            count: 0,
+        }
+    }
+
+    /// Adds a request to the batch. `req` must start with a `nlmsghdr` and its size must be a
+    /// multiple of 4 bytes, as netlink messages are aligned on 4 bytes.
+    fn push<T>(&mut self, req: &T, what: &'static str, interface_index: u32) -> i32 {
+        let size = mem::size_of::<T>();
+        if self.count == MAX_REQUESTS || self.len + size > self.buf.len() {
+            return -linux::ENOMEM;
+        }
+        let bytes = unsafe { slice::from_raw_parts((req as *const T) as *const u8, size) };
+        let hdr = unsafe { ptr::read_unaligned(bytes.as_ptr() as *const linux::nlmsghdr) };
+        self.buf[self.len..self.len + size].copy_from_slice(bytes);
+        self.requests[self.count] = Request {
+            seq: hdr.nlmsg_seq,
+            what,
+            interface_index,
+            acked: false,
+        };
+        self.iovs[self.count].iov_len = size;
+        self.len += size;
+        self.count += 1;
+        0
+    }
 
-    /// Drains the socket until a `nmsgerr` message is available. That message
-    /// is then read and depending on the error code inside of it, either a
-    /// Ok or Err is returned.
-    fn ack_error(&self) -> i32 {
-        loop {
-            let mut buf = [0u8; 8192];
-            let len = self.recv(&mut buf);
+    /// Sends all the requests of the batch at once.
+    fn send(&mut self, socket: &NetlinkSocket) -> i32 {
+        if self.count == 0 {
+            return 0;
+        }
+        // Pointers into the buffer are only taken now because the batch might have moved since
+        // the requests were pushed.
+        let mut off = 0;
+        for iov in &mut self.iovs[..self.count] {
+            iov.iov_base = self.buf[off..].as_mut_ptr();
+            off += iov.iov_len;
+        }
+        let mut msg = linux::msghdr {
+            msg_name: ptr::null_mut(),
+            msg_namelen: 0,
+            msg_iov: self.iovs.as_mut_ptr(),
+            msg_iovlen: self.count,
+            msg_control: ptr::null_mut(),
+            msg_controllen: 0,
+            msg_flags: 0,
+        };
+        let ret = unsafe { linux::sendmsg(i32::try_from(socket.fd.0).unwrap(), &mut msg, 0) };
+        if ret < 0 {
+            return ret.try_into().unwrap();
+        }
+        0
+    }
+
+    /// Reads acknowledgements until every request of the batch has one. An error is printed for
+    /// every request that failed, and the error of the first one that failed is returned.
+    fn collect_acks(&mut self, socket: &NetlinkSocket) -> i32 {
+        let mut first_error = 0;
+        let mut pending = self.count;
+        let mut buf = [0u8; 8192];
+        while pending > 0 {
+            let len = socket.recv(&mut buf);
             if len < 0 {
                 return len.try_into().unwrap();
             }
             let len = usize::try_from(len).unwrap();
 
             let mut i = 0;
-            loop {
-                if i + mem::size_of::<linux::nlmsghdr>() > len {
-                    break;
-                }
+            while i + mem::size_of::<linux::nlmsghdr>() <= len {
                 let hdr =
                     unsafe { ptr::read_unaligned(buf[i..].as_ptr() as *const linux::nlmsghdr) };
+                let msg_len = usize::try_from(hdr.nlmsg_len).unwrap();
+                if msg_len < mem::size_of::<linux::nlmsghdr>() || i + msg_len > len {
+                    break;
+                }
                 if i32::from(hdr.nlmsg_type) == linux::NLMSG_ERROR {
-                    let payload = unsafe {
-                        ptr::read(buf[i + mem::size_of::<linux::nlmsghdr>()..].as_ptr()
-                            as *const linux::nlmsgerr)
-                    };
-                    return payload.error;
+                    let msg = &buf[i..i + msg_len];
+                    let req = self.requests[..self.count]
+                        .iter_mut()
+                        .find(|r| r.seq == hdr.nlmsg_seq && !r.acked);
+                    if let Some(req) = req {
+                        req.acked = true;
+                        pending -= 1;
+                        let error = report_ack(msg, req);
+                        if error < 0 && first_error == 0 {
+                            first_error = error;
+                        }
+                    }
                 }
-                i += usize::try_from(hdr.nlmsg_len).unwrap();
+                // Messages are aligned on 4 bytes.
+                i += (msg_len + 3) & !3;
             }
         }
+        first_error
     }
 }
 
+/// Reads the `nlmsgerr` message `msg` that acknowledges `req`, prints an error if the request
+/// failed and returns the error code.
+fn report_ack(msg: &[u8], req: &Request) -> i32 {
+    let hdr_len = mem::size_of::<linux::nlmsghdr>();
+    if msg.len() < hdr_len + mem::size_of::<linux::nlmsgerr>() {
+        return -linux::EINVAL;
+    }
+    let hdr = unsafe { ptr::read_unaligned(msg.as_ptr() as *const linux::nlmsghdr) };
+    let payload = unsafe { ptr::read_unaligned(msg[hdr_len..].as_ptr() as *const linux::nlmsgerr) };
+    if payload.error >= 0 {
+        return 0;
+    }
+
+    // With `NETLINK_EXT_ACK`, the kernel appends attributes that can contain a readable error
+    // message. They come after the original request, which is left out with `NETLINK_CAP_ACK`.
+    let flags = i32::from(hdr.nlmsg_flags);
+    let mut reason: &[u8] = b"";
+    if flags & linux::NLM_F_ACK_TLVS != 0 {
+        let mut off = hdr_len + mem::size_of::<i32>();
+        off += if flags & linux::NLM_F_CAPPED != 0 {
+            hdr_len
+        } else {
+            usize::try_from(payload.msg.nlmsg_len).unwrap()
+        };
+        while off + mem::size_of::<linux::nlattr>() <= msg.len() {
+            let attr = unsafe { ptr::read_unaligned(msg[off..].as_ptr() as *const linux::nlattr) };
+            let attr_len = usize::from(attr.nla_len);
+            if attr_len < mem::size_of::<linux::nlattr>() || off + attr_len > msg.len() {
+                break;
+            }
+            if attr.nla_type == linux::NLMSGERR_ATTR_MSG {
+                reason = &msg[off + mem::size_of::<linux::nlattr>()..off + attr_len];
+                // Remove the NUL terminator.
+                if let Some(p) = reason.iter().position(|b| *b == 0) {
+                    reason = &reason[..p];
+                }
+            }
+            off += (attr_len + 3) & !3;
+        }
+    }
+    writeln!(
+        linux::Stderr,
+        "failed to {} on interface {}: {} {}",
+        req.what,
+        req.interface_index,
+        payload.error,
+        str::from_utf8(reason).unwrap_or("")
+    )
+    .unwrap();
+    payload.error
+}
+
 #[repr(C)]
 struct ifaddrmsg {
     ifa_family: u8,
@@ -131,6 +285,7 @@ struct AddAddrRequest {
 
 fn add_addr_to_interface(
     socket: &mut NetlinkSocket,
+    batch: &mut Batch,
     interface_index: u32,
     addr: Ipv4Addr,
     broadcast: Ipv4Addr,
@@ -157,17 +312,7 @@ fn add_addr_to_interface(
         addr: RtAttr::new(linux::IFA_ADDRESS, addr.to_be()),
         broadcast: RtAttr::new(linux::IFA_BROADCAST, broadcast.to_be()),
     };
-    let req_bytes = unsafe {
-        slice::from_raw_parts(
-            (&req as *const AddAddrRequest) as *const u8,
-            mem::size_of::<AddAddrRequest>(),
-        )
-    };
-    let ret = socket.send(req_bytes);
-    if ret < 0 {
-        return ret.try_into().unwrap();
-    }
-    socket.ack_error()
+    batch.push(&req, "add address", interface_index)
 }
 
 #[repr(C)]
@@ -193,6 +338,7 @@ struct AddRouteRequest {
 
 fn add_route_to_interface(
     socket: &mut NetlinkSocket,
+    batch: &mut Batch,
     interface_index: u32,
     gateway: Ipv4Addr,
 ) -> i32 {
@@ -221,17 +367,7 @@ fn add_route_to_interface(
         gateway: RtAttr::new(linux::RTA_GATEWAY, gateway.to_be()),
         interface: RtAttr::new(linux::RTA_OIF, interface_index),
     };
-    let req_bytes = unsafe {
-        slice::from_raw_parts(
-            (&req as *const AddRouteRequest) as *const u8,
-            mem::size_of::<AddRouteRequest>(),
-        )
-    };
-    let ret = socket.send(req_bytes);
-    if ret < 0 {
-        return ret.try_into().unwrap();
-    }
-    socket.ack_error()
+    batch.push(&req, "add route", interface_index)
 }
 
 #[repr(C)]
@@ -250,7 +386,11 @@ struct ChangeInterfaceRequest {
 }
 
 /// Sets a network interface's status to "admin up".
-fn bring_interface_admin_up(socket: &mut NetlinkSocket, interface_index: i32) -> i32 {
+fn bring_interface_admin_up(
+    socket: &mut NetlinkSocket,
+    batch: &mut Batch,
+    interface_index: i32,
+) -> i32 {
     let req = ChangeInterfaceRequest {
         hdr: linux::nlmsghdr {
             nlmsg_len: u32::try_from(mem::size_of::<ChangeInterfaceRequest>()).unwrap(),
@@ -267,34 +407,26 @@ fn bring_interface_admin_up(socket: &mut NetlinkSocket, interface_index: i32) ->
             ifi_change: u32::try_from(linux::IFF_UP).unwrap(),
         },
     };
-    let req_bytes = unsafe {
-        slice::from_raw_parts(
-            (&req as *const ChangeInterfaceRequest) as *const u8,
-            mem::size_of::<ChangeInterfaceRequest>(),
-        )
-    };
-    let ret = socket.send(req_bytes);
-    if ret < 0 {
-        return ret.try_into().unwrap();
-    }
-    socket.ack_error()
-}
-
-fn start_iwd() -> i32 {
-    unsafe {
-        linux::spawn(
-            b"/usr/libexec/iwd\0" as *const u8,
-            &[b"/usr/libexec/iwd\0" as *const u8, ptr::null()] as *const *const u8,
-            &[ptr::null()] as *const *const u8,
-        )
-    }
+    batch.push(
+        &req,
+        "bring interface up",
+        u32::try_from(interface_index).unwrap(),
+    )
 }
 
+/// Configures the network interfaces. All the requests are sent to the kernel at once, which
+/// processes them in order, and their acknowledgements are collected afterwards.
 pub fn setup_networking() -> i32 {
     let mut socket = match NetlinkSocket::new(linux::NETLINK_ROUTE) {
         Ok(s) => s,
         Err(e) => return e,
     };
+    // Ask for small acknowledgements that do not repeat the request, but that contain a readable
+    // error message. Failing to enable these options is not a problem.
+    linux::setsockopt_int(socket.fd.0, linux::SOL_NETLINK, linux::NETLINK_CAP_ACK, 1);
+    linux::setsockopt_int(socket.fd.0, linux::SOL_NETLINK, linux::NETLINK_EXT_ACK, 1);
+
+    let mut batch = Batch::new();
     for interface in config::NET_INTERFACES.iter() {
         let addr = match interface.addr {
             Some(val) => val,
@@ -303,13 +435,17 @@ pub fn setup_networking() -> i32 {
         let broadcast = interface
             .broadcast
             .unwrap_or_else(|| u32::from_be_bytes([255, 255, 255, 0]));
-        let ret = add_addr_to_interface(&mut socket, interface.index, addr, broadcast);
+        let ret = add_addr_to_interface(&mut socket, &mut batch, interface.index, addr, broadcast);
         if ret < 0 {
             return ret;
         }
     }
     for interface in config::NET_INTERFACES.iter() {
-        let ret = bring_interface_admin_up(&mut socket, i32::try_from(interface.index).unwrap());
+        let ret = bring_interface_admin_up(
+            &mut socket,
+            &mut batch,
+            i32::try_from(interface.index).unwrap(),
+        );
         if ret < 0 {
             return ret;
         }
@@ -319,10 +455,15 @@ pub fn setup_networking() -> i32 {
             Some(val) => val,
             None => continue,
         };
-        let ret = add_route_to_interface(&mut socket, interface.index, gateway);
+        let ret = add_route_to_interface(&mut socket, &mut batch, interface.index, gateway);
         if ret < 0 {
             return ret;
         }
     }
-    start_iwd()
+
+    let ret = batch.send(&socket);
+    if ret < 0 {
+        return ret;
+    }
+    batch.collect_acks(&socket)
 }
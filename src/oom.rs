@@ -0,0 +1,547 @@
+//! Killing of processes before the system runs out of memory, from the `[oom]` section of
+//! `config.toml`.
+//!
+//! With strict overcommit and no swap, the kernel OOM killer only acts once allocations fail, and
+//! the system is unresponsive for a long time before that. Instead, init reads `MemAvailable` in
+//! `/proc/meminfo` and kills a process as soon as it falls below a share of `MemTotal`.
+//!
+//! The event loop is not woken up for that while memory is plentiful: a PSI trigger on
+//! `/proc/pressure/memory` starts the periodic checks, which stop once the available memory is
+//! above the threshold that applies under pressure. Without a trigger, the checks are always
+//! periodic.
+//!
+//! A cgroup can be watched instead of the whole system, which also makes the killer testable in a
+//! memory-limited cgroup: its `memory.max` is then the total, `memory.max` minus `memory.current`
+//! is the available memory, the trigger is on its `memory.pressure`, and only its processes are
+//! killed. The memory of the system is used while the cgroup has no limit.
+//!
+//! The victim is the process with the highest score: its resident memory, multiplied by the
+//! weight of its top-level cgroup and scaled by its `oom_score_adj` like the kernel does.
+//! Protected processes, like the compositor, are never killed. The victim is killed through a
+//! pidfd, so that a PID that was reused in the meantime is never hit, and its memory is freed
+//! with `process_mrelease` without waiting for it to exit. Every decision is logged with the
+//! numbers behind it.
+
+use core::convert::{TryFrom, TryInto};
+use core::fmt::Write;
+use core::str;
+
+use crate::config;
+use crate::linux::{self, Fd};
+use crate::procfs::{self, meminfo_kb, parse_stat, PF_KTHREAD};
+use crate::reactor::{Flow, Registrar, Source};
+use crate::trace;
+
+/// `epoll` key of the check timer.
+const TIMER_KEY: u32 = 0;
+
+/// `epoll` key of the memory pressure trigger.
+const TRIGGER_KEY: u32 = 1;
+
+/// Time given to a victim to exit before another process can be killed.
+const VICTIM_TIMEOUT_NS: u64 = 1_000_000_000;
+
+/// Size of a page, which is the unit of `/proc/<pid>/statm`.
+const PAGE_KB: u64 = 4;
+
+/// Maximum length of the name of a top-level cgroup that is logged.
+const MAX_CGROUP_NAME: usize = 32;
+
+/// Policy of the OOM killer, generated by the `build.rs` script.
+pub struct Policy {
+    /// A process is killed when the available memory is below this percentage of the total.
+    pub available_percent: u64,
+    /// Threshold that applies when the pressure trigger fires.
+    pub pressure_available_percent: u64,
+    /// Interval between two checks while memory is under pressure.
+    pub interval_ms: u32,
+    /// NUL-terminated threshold of the trigger on `/proc/pressure/memory`, or on the
+    /// `memory.pressure` file of the cgroup.
+    pub trigger: Option<&'static [u8]>,
+    /// NUL-terminated path of the watched cgroup, relative to `/sys/fs/cgroup`.
+    pub cgroup: Option<&'static [u8]>,
+    /// Command names of the processes that are never killed.
+    pub protect: &'static [&'static [u8]],
+    /// Score multipliers of the processes in each top-level cgroup. It is 1 for the other ones.
+    pub cgroup_weights: &'static [(&'static [u8], u64)],
+}
+
+/// A process that could be killed.
+struct Candidate {
+    pid: i32,
+    /// Name of the directory of the process in `/proc`.
+    dir: [u8; 10],
+    dir_len: usize,
+    name: [u8; 16],
+    name_len: usize,
+    cgroup: [u8; MAX_CGROUP_NAME],
+    cgroup_len: usize,
+    rss_kb: u64,
+    score: u64,
+}
+
+impl Candidate {
+    fn name(&self) -> &str {
+        str::from_utf8(&self.name[..self.name_len]).unwrap_or("?")
+    }
+
+    fn cgroup(&self) -> &str {
+        str::from_utf8(&self.cgroup[..self.cgroup_len]).unwrap_or("?")
+    }
+}
+
+/// Returns the NUL-terminated path of `file` in the directory of the process `pid` of `/proc`.
+fn pid_path<'a>(buf: &'a mut [u8; 64], pid: &[u8], file: &[u8]) -> &'a [u8] {
+    buf[..pid.len()].copy_from_slice(pid);
+    buf[pid.len()] = b'/';
+    buf[pid.len() + 1..pid.len() + 1 + file.len()].copy_from_slice(file);
+    &buf[..pid.len() + 1 + file.len()]
+}
+
+/// Returns the number in the field `index` of `data`, where fields are separated by whitespace.
+fn field(data: &[u8], index: usize) -> Option<i64> {
+    let f = data
+        .split(|b| b.is_ascii_whitespace())
+        .filter(|f| !f.is_empty())
+        .nth(index)?;
+    str::from_utf8(f).ok()?.parse().ok()
+}
+
+/// Reads the information of the process `pid` of `/proc`, or returns `None` if it cannot be
+/// killed.
+fn read_candidate(policy: &Policy, proc_fd: i32, pid: &[u8]) -> Option<Candidate> {
+    let mut path = [0u8; 64];
+    let mut buf = [0u8; 512];
+
+    let stat = procfs::read_file_at(proc_fd, pid_path(&mut path, pid, b"stat\0"), &mut buf).ok()?;
+    let (comm, flags) = parse_stat(stat)?;
+    if flags & PF_KTHREAD != 0 || policy.protect.contains(&comm) {
+        return None;
+    }
+    let mut candidate = Candidate {
+        pid: str::from_utf8(pid).ok()?.parse().ok()?,
+        dir: [0; 10],
+        dir_len: pid.len().min(10),
+        name: [0; 16],
+        name_len: comm.len().min(16),
+        cgroup: [0; MAX_CGROUP_NAME],
+        cgroup_len: 0,
+        rss_kb: 0,
+        score: 0,
+    };
+    candidate.name[..candidate.name_len].copy_from_slice(&comm[..candidate.name_len]);
+    candidate.dir[..candidate.dir_len].copy_from_slice(&pid[..candidate.dir_len]);
+
+    let statm =
+        procfs::read_file_at(proc_fd, pid_path(&mut path, pid, b"statm\0"), &mut buf).ok()?;
+    candidate.rss_kb = u64::try_from(field(statm, 1)?).ok()? * PAGE_KB;
+
+    let adj = procfs::read_file_at(
+        proc_fd,
+        pid_path(&mut path, pid, b"oom_score_adj\0"),
+        &mut buf,
+    )
+    .ok()?;
+    let adj = field(adj, 0)?;
+    if adj <= -1000 {
+        // The process must never be killed, like for the kernel OOM killer.
+        return None;
+    }
+
+    // The cgroup v2 line is `0::/<path>`.
+    let cgroup =
+        procfs::read_file_at(proc_fd, pid_path(&mut path, pid, b"cgroup\0"), &mut buf).ok()?;
+    let cgroup = cgroup
+        .split(|&b| b == b'\n')
+        .find_map(|line| line.strip_prefix(b"0::/"))
+        .unwrap_or(b"");
+    if let Some(watched) = policy.cgroup {
+        // Killing a process outside of the watched cgroup would not free its memory.
+        let inside = cgroup
+            .strip_prefix(&watched[..watched.len() - 1])
+            .is_some_and(|rest| rest.is_empty() || rest[0] == b'/');
+        if !inside {
+            return None;
+        }
+    }
+    let name = cgroup.split(|&b| b == b'/').next().unwrap_or(b"");
+    candidate.cgroup_len = name.len().min(MAX_CGROUP_NAME);
+    candidate.cgroup[..candidate.cgroup_len].copy_from_slice(&name[..candidate.cgroup_len]);
+    let weight = policy
+        .cgroup_weights
+        .iter()
+        .find(|(c, _)| *c == name)
+        .map_or(1, |(_, w)| *w);
+
+    // `oom_score_adj` goes from -1000 to 1000 and is relative to the total memory for the kernel,
+    // but it is used as a factor here so that it keeps an effect with any amount of memory.
+    candidate.score = candidate.rss_kb * weight * u64::try_from(1000 + adj.min(1000)).ok()? / 1000;
+    Some(candidate)
+}
+
+/// Returns the process with the highest score among the ones of the `/proc` directory `proc_fd`.
+fn find_victim(policy: &Policy, proc_fd: &Fd) -> Option<Candidate> {
+    let mut victim: Option<Candidate> = None;
+    let ret = linux::read_dir(proc_fd.0, |name, _| {
+        // Skip the entries that are not processes, and init itself.
+        if name.is_empty() || !name.iter().all(u8::is_ascii_digit) || name == b"1" {
+            return true;
+        }
+        if let Some(c) = read_candidate(policy, i32::try_from(proc_fd.0).unwrap(), name) {
+            if victim.as_ref().is_none_or(|v| c.score > v.score) {
+                victim = Some(c);
+            }
+        }
+        true
+    });
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to list processes: {ret}").unwrap();
+    }
+    victim
+}
+
+/// Opens the cgroup at `path`, which is NUL-terminated and relative to `/sys/fs/cgroup`.
+fn open_cgroup(path: &[u8]) -> Result<Fd, i32> {
+    let flags = linux::O_RDONLY | linux::O_DIRECTORY | linux::O_CLOEXEC;
+    let root = unsafe { linux::open(b"/sys/fs/cgroup\0" as *const u8, flags, 0) };
+    if root < 0 {
+        return Err(root);
+    }
+    let root = Fd(root.try_into().unwrap());
+    let fd = unsafe { linux::openat(i32::try_from(root.0).unwrap(), path.as_ptr(), flags, 0) };
+    if fd < 0 {
+        return Err(fd);
+    }
+    Ok(Fd(fd.try_into().unwrap()))
+}
+
+/// A process that was killed and that has not exited yet.
+struct Victim {
+    pid: i32,
+    pidfd: Fd,
+    killed_ns: u64,
+}
+
+/// Watches the available memory and kills a process when there is too little of it.
+pub struct Killer {
+    policy: Option<&'static Policy>,
+    /// Directory of the watched cgroup.
+    cgroup: Option<Fd>,
+    timer: Fd,
+    trigger: Option<Fd>,
+    /// Whether the timer is armed.
+    checking: bool,
+    victim: Option<Victim>,
+    kills: u32,
+}
+
+impl Killer {
+    pub fn new() -> Result<Self, i32> {
+        let timer = linux::timerfd_create(
+            linux::CLOCK_MONOTONIC,
+            linux::TFD_CLOEXEC | linux::TFD_NONBLOCK,
+        );
+        if timer < 0 {
+            return Err(timer);
+        }
+        let mut killer = Self {
+            policy: config::OOM.as_ref(),
+            cgroup: None,
+            timer: Fd(timer.try_into().unwrap()),
+            trigger: None,
+            checking: false,
+            victim: None,
+            kills: 0,
+        };
+        if let Some(path) = killer.policy.and_then(|p| p.cgroup) {
+            match open_cgroup(path) {
+                Ok(fd) => killer.cgroup = Some(fd),
+                Err(err) => {
+                    // There is no process to kill in a cgroup that does not exist.
+                    writeln!(linux::Stderr, "failed to open OOM cgroup: {err}").unwrap();
+                    killer.policy = None;
+                    return Ok(killer);
+                }
+            }
+        }
+        let threshold = match killer.policy.and_then(|p| p.trigger) {
+            Some(t) => t,
+            None => return Ok(killer),
+        };
+        let (dir, path): (i32, &[u8]) = match &killer.cgroup {
+            Some(fd) => (i32::try_from(fd.0).unwrap(), b"memory.pressure\0"),
+            None => (linux::AT_FDCWD, b"/proc/pressure/memory\0"),
+        };
+        let fd = unsafe {
+            linux::openat(
+                dir,
+                path.as_ptr(),
+                linux::O_RDWR | linux::O_NONBLOCK | linux::O_CLOEXEC,
+                0,
+            )
+        };
+        if fd < 0 {
+            // Check periodically instead.
+            writeln!(linux::Stderr, "failed to open memory pressure file: {fd}").unwrap();
+            return Ok(killer);
+        }
+        let fd = Fd(fd.try_into().unwrap());
+        let ret = linux::write(fd.0, threshold);
+        if ret < 0 {
+            writeln!(
+                linux::Stderr,
+                "failed to set memory pressure trigger: {ret}"
+            )
+            .unwrap();
+            return Ok(killer);
+        }
+        killer.trigger = Some(fd);
+        Ok(killer)
+    }
+
+    /// Starts or stops the periodic checks.
+    fn set_checking(&mut self, checking: bool) {
+        if checking == self.checking {
+            return;
+        }
+        let ns = if checking {
+            i64::from(self.policy.unwrap().interval_ms) * 1_000_000
+        } else {
+            0
+        };
+        let value = linux::itimerspec {
+            it_interval: linux::timespec {
+                tv_sec: ns / 1_000_000_000,
+                tv_nsec: ns % 1_000_000_000,
+            },
+            it_value: linux::timespec {
+                tv_sec: ns / 1_000_000_000,
+                tv_nsec: ns % 1_000_000_000,
+            },
+        };
+        let ret = linux::timerfd_settime(self.timer.0, 0, &value);
+        if ret < 0 {
+            writeln!(linux::Stderr, "failed to arm OOM check timer: {ret}").unwrap();
+            return;
+        }
+        self.checking = checking;
+    }
+
+    /// Returns the PID of the process that was killed last if it is still exiting, and if it was
+    /// killed recently enough that it should be waited for.
+    fn pending_victim(&mut self) -> Option<i32> {
+        let victim = self.victim.as_ref()?;
+        let mut fds = [linux::pollfd {
+            fd: i32::try_from(victim.pidfd.0).unwrap(),
+            events: linux::POLLIN,
+            revents: 0,
+        }];
+        let exited = linux::poll(&mut fds, 0) != 0;
+        let elapsed_ns = linux::clock_ns(linux::CLOCK_MONOTONIC) - victim.killed_ns;
+        if !exited && elapsed_ns < VICTIM_TIMEOUT_NS {
+            return Some(victim.pid);
+        }
+        if !exited {
+            writeln!(
+                linux::Stdout,
+                "oom: {} did not exit after {} ms",
+                victim.pid,
+                elapsed_ns / 1_000_000
+            )
+            .unwrap();
+        }
+        self.victim = None;
+        None
+    }
+
+    /// Returns the total and the available memory in kB, of the watched cgroup if it has a limit
+    /// or of the system otherwise.
+    fn memory_kb(&self) -> Result<(u64, u64), i32> {
+        if let Some(cgroup) = &self.cgroup {
+            let dir = i32::try_from(cgroup.0).unwrap();
+            let mut buf = [0u8; 32];
+            // The limit is `max` if there is none.
+            let max = field(procfs::read_file_at(dir, b"memory.max\0", &mut buf)?, 0);
+            if let Some(max) = max.and_then(|m| u64::try_from(m).ok()) {
+                let current = field(procfs::read_file_at(dir, b"memory.current\0", &mut buf)?, 0)
+                    .and_then(|c| u64::try_from(c).ok())
+                    .unwrap_or(0);
+                return Ok((max / 1024, max.saturating_sub(current) / 1024));
+            }
+        }
+        let mut buf = [0u8; 4096];
+        let meminfo = procfs::read_proc_file(b"/proc/meminfo\0", &mut buf)?;
+        let total = meminfo_kb(meminfo, b"MemTotal").unwrap_or(0);
+        Ok((total, meminfo_kb(meminfo, b"MemAvailable").unwrap_or(total)))
+    }
+
+    /// Checks the available memory and kills a process if there is too little. `pressure` is
+    /// true if the check was caused by the pressure trigger.
+    fn check(&mut self, pressure: bool) {
+        let policy = match self.policy {
+            Some(p) => p,
+            None => return,
+        };
+        let (total, available) = match self.memory_kb() {
+            Ok(m) => m,
+            Err(err) => {
+                writeln!(linux::Stderr, "failed to read memory usage: {err}").unwrap();
+                return;
+            }
+        };
+        let percent = if total == 0 {
+            100
+        } else {
+            available * 100 / total
+        };
+        if pressure {
+            writeln!(
+                linux::Stdout,
+                "oom: memory pressure with {available} kB of {total} kB available ({percent}%)"
+            )
+            .unwrap();
+        }
+        // The periodic checks only run under pressure when there is a trigger.
+        let threshold = if pressure || (self.trigger.is_some() && self.checking) {
+            policy.pressure_available_percent
+        } else {
+            policy.available_percent
+        };
+        if self.trigger.is_some() {
+            self.set_checking(percent < policy.pressure_available_percent);
+        }
+        if percent >= threshold {
+            return;
+        }
+
+        if let Some(victim) = self.pending_victim() {
+            writeln!(
+                linux::Stdout,
+                "oom: {available} kB of {total} kB available ({percent}% < {threshold}%), waiting for {victim} to exit"
+            )
+            .unwrap();
+            return;
+        }
+        let proc_fd = unsafe {
+            linux::open(
+                b"/proc\0" as *const u8,
+                linux::O_RDONLY | linux::O_DIRECTORY | linux::O_CLOEXEC,
+                0,
+            )
+        };
+        if proc_fd < 0 {
+            writeln!(linux::Stderr, "failed to open /proc: {proc_fd}").unwrap();
+            return;
+        }
+        let proc_fd = Fd(proc_fd.try_into().unwrap());
+        let victim = match find_victim(policy, &proc_fd) {
+            Some(v) => v,
+            None => {
+                writeln!(
+                    linux::Stdout,
+                    "oom: {available} kB of {total} kB available ({percent}% < {threshold}%), but no process can be killed"
+                )
+                .unwrap();
+                return;
+            }
+        };
+        writeln!(
+            linux::Stdout,
+            "oom: {available} kB of {total} kB available ({percent}% < {threshold}%), killing {} ({}) in cgroup {} with {} kB resident, score {}",
+            victim.pid,
+            victim.name(),
+            victim.cgroup(),
+            victim.rss_kb,
+            victim.score
+        )
+        .unwrap();
+        self.kill(&victim, &proc_fd);
+    }
+
+    fn kill(&mut self, victim: &Candidate, proc_fd: &Fd) {
+        let pidfd = linux::pidfd_open(victim.pid, 0);
+        if pidfd < 0 {
+            if pidfd == -linux::ESRCH {
+                writeln!(linux::Stdout, "oom: {} exited in the meantime", victim.pid).unwrap();
+            } else {
+                writeln!(
+                    linux::Stderr,
+                    "failed to open pidfd of {}: {pidfd}",
+                    victim.pid
+                )
+                .unwrap();
+            }
+            return;
+        }
+        let pidfd = Fd(pidfd.try_into().unwrap());
+        // The PID could have been reused between the scan and `pidfd_open`, but not since.
+        let mut path = [0u8; 64];
+        let mut buf = [0u8; 512];
+        let path = pid_path(&mut path, &victim.dir[..victim.dir_len], b"stat\0");
+        let same = procfs::read_file_at(i32::try_from(proc_fd.0).unwrap(), path, &mut buf)
+            .ok()
+            .and_then(parse_stat)
+            .is_some_and(|(comm, _)| comm == &victim.name[..victim.name_len]);
+        if !same {
+            writeln!(linux::Stdout, "oom: {} exited in the meantime", victim.pid).unwrap();
+            return;
+        }
+        let ret = linux::pidfd_send_signal(pidfd.0, linux::SIGKILL);
+        if ret < 0 {
+            writeln!(linux::Stderr, "failed to kill {}: {ret}", victim.pid).unwrap();
+            return;
+        }
+        // Frees the memory of the process right away, instead of when all its threads exited.
+        let ret = linux::process_mrelease(pidfd.0, 0);
+        if ret < 0 && ret != -linux::ENOSYS && ret != -linux::ESRCH {
+            writeln!(
+                linux::Stderr,
+                "failed to release memory of {}: {ret}",
+                victim.pid
+            )
+            .unwrap();
+        }
+        self.kills += 1;
+        trace::instant("oom kill", i64::from(victim.pid));
+        self.victim = Some(Victim {
+            pid: victim.pid,
+            pidfd,
+            killed_ns: linux::clock_ns(linux::CLOCK_MONOTONIC),
+        });
+    }
+
+    pub fn report(&self) {
+        if self.policy.is_some() {
+            writeln!(linux::Stdout, "oom: killed {} processes", self.kills).unwrap();
+            trace::counter("oom kills", self.kills.into());
+        }
+    }
+}
+
+impl Source for Killer {
+    fn register(&mut self, registrar: &Registrar) -> i32 {
+        if self.policy.is_none() {
+            return 0;
+        }
+        let ret = registrar.add(self.timer.0, linux::EPOLLIN, TIMER_KEY);
+        if ret < 0 {
+            return ret;
+        }
+        match &self.trigger {
+            Some(fd) => registrar.add(fd.0, linux::EPOLLPRI, TRIGGER_KEY),
+            None => {
+                self.set_checking(true);
+                0
+            }
+        }
+    }
+
+    fn dispatch(&mut self, _registrar: &Registrar, key: u32, _events: u32) -> Flow {
+        if key == TIMER_KEY {
+            let mut expirations = [0u8; 8];
+            linux::read(self.timer.0, &mut expirations);
+        }
+        self.check(key == TRIGGER_KEY);
+        Flow::Continue
+    }
+}
@@ -0,0 +1,237 @@
+//! Monitoring of the pressure stall information (PSI) of the system and of cgroups, from the
+//! `[pressure]` section of `config.toml`.
+//!
+//! Each trigger is a pressure file, like `/proc/pressure/memory` or the `memory.pressure` file of
+//! a cgroup, to which a threshold such as `some 150000 1000000` was written: the kernel then
+//! reports `EPOLLPRI` on the file whenever tasks stalled for more than 150 ms within a 1 s window,
+//! so init never has to poll it. When a trigger fires, the cgroup named by `freeze` is frozen so
+//! that the user interface gets the resources back, and it is thawed once no trigger has fired for
+//! `thaw_after_ms`. The events are logged as they happen, and summed up when the system stops.
+
+use core::convert::{TryFrom, TryInto};
+use core::fmt::Write;
+
+use crate::cgroup;
+use crate::config;
+use crate::linux::{self, Fd};
+use crate::reactor::{Flow, Registrar, Source};
+use crate::trace;
+
+/// Maximum number of triggers.
+const MAX_TRIGGERS: usize = 16;
+
+/// `epoll` key of the thaw timer. Other keys are indices of triggers.
+const TIMER_KEY: u32 = u32::MAX;
+
+/// A pressure threshold, generated by the `build.rs` script.
+pub struct Trigger {
+    /// Name of the trigger in the log, like `memory some`.
+    pub name: &'static str,
+    /// NUL-terminated path of the pressure file.
+    pub path: &'static [u8],
+    /// NUL-terminated threshold, as written to the pressure file.
+    pub threshold: &'static [u8],
+}
+
+/// Opens a pressure file and sets a trigger on it.
+fn open_trigger(trigger: &Trigger) -> Result<Fd, i32> {
+    let fd = unsafe {
+        linux::open(
+            trigger.path.as_ptr(),
+            linux::O_RDWR | linux::O_NONBLOCK | linux::O_CLOEXEC,
+            0,
+        )
+    };
+    if fd < 0 {
+        return Err(fd);
+    }
+    let fd = Fd(fd.try_into().unwrap());
+    // The trigger stays active as long as the file is open.
+    let ret = linux::write(fd.0, trigger.threshold);
+    if ret < 0 {
+        return Err(ret.try_into().unwrap());
+    }
+    Ok(fd)
+}
+
+/// Watches the pressure triggers and freezes the background cgroup while they fire.
+pub struct Monitor {
+    triggers: [Option<Fd>; MAX_TRIGGERS],
+    /// Number of times each trigger fired.
+    events: [u32; MAX_TRIGGERS],
+    timer: Fd,
+    /// Time at which the cgroup was frozen, on the `CLOCK_MONOTONIC` clock, if it is frozen.
+    frozen_since_ns: Option<u64>,
+    freezes: u32,
+    frozen_ns: u64,
+}
+
+impl Monitor {
+    pub fn new() -> Result<Self, i32> {
+        let timer = linux::timerfd_create(
+            linux::CLOCK_MONOTONIC,
+            linux::TFD_CLOEXEC | linux::TFD_NONBLOCK,
+        );
+        if timer < 0 {
+            return Err(timer);
+        }
+        let mut monitor = Self {
+            triggers: [const { None }; MAX_TRIGGERS],
+            events: [0; MAX_TRIGGERS],
+            timer: Fd(timer.try_into().unwrap()),
+            frozen_since_ns: None,
+            freezes: 0,
+            frozen_ns: 0,
+        };
+        for (trigger, fd) in config::PRESSURE_TRIGGERS
+            .iter()
+            .zip(monitor.triggers.iter_mut())
+        {
+            match open_trigger(trigger) {
+                Ok(f) => *fd = Some(f),
+                Err(err) => writeln!(
+                    linux::Stderr,
+                    "failed to set pressure trigger {}: {err}",
+                    trigger.name
+                )
+                .unwrap(),
+            }
+        }
+        Ok(monitor)
+    }
+
+    /// Arms the timer to thaw the cgroup in `config::PRESSURE_THAW_AFTER_MS`, which postpones the
+    /// thaw if it was armed already.
+    fn arm_timer(&self) {
+        let ms = u64::from(config::PRESSURE_THAW_AFTER_MS);
+        let value = linux::itimerspec {
+            it_interval: linux::timespec {
+                tv_sec: 0,
+                tv_nsec: 0,
+            },
+            it_value: linux::timespec {
+                tv_sec: i64::try_from(ms / 1000).unwrap(),
+                tv_nsec: i64::try_from(ms % 1000 * 1_000_000).unwrap(),
+            },
+        };
+        let ret = linux::timerfd_settime(self.timer.0, 0, &value);
+        if ret < 0 {
+            writeln!(linux::Stderr, "failed to arm thaw timer: {ret}").unwrap();
+        }
+    }
+
+    fn handle_trigger(&mut self, index: usize, events: u32) {
+        let trigger = &config::PRESSURE_TRIGGERS[index];
+        if events & linux::EPOLLERR != 0 {
+            // The cgroup of the pressure file was removed.
+            writeln!(linux::Stderr, "pressure trigger {} failed", trigger.name).unwrap();
+            self.triggers[index] = None;
+            return;
+        }
+        self.events[index] += 1;
+        trace::instant(trigger.name, i64::from(self.events[index]));
+        let cgroup = match config::PRESSURE_FREEZE {
+            Some(c) => c,
+            None => {
+                writeln!(linux::Stdout, "pressure: {}", trigger.name).unwrap();
+                return;
+            }
+        };
+        let name = config::CGROUPS[cgroup].name;
+        if self.frozen_since_ns.is_none() {
+            let ret = cgroup::set_frozen(cgroup, true);
+            if ret < 0 {
+                writeln!(linux::Stderr, "failed to freeze cgroup {name}: {ret}").unwrap();
+                return;
+            }
+            self.frozen_since_ns = Some(linux::clock_ns(linux::CLOCK_MONOTONIC));
+            self.freezes += 1;
+            writeln!(linux::Stdout, "pressure: {}, froze {name}", trigger.name).unwrap();
+        } else {
+            writeln!(
+                linux::Stdout,
+                "pressure: {}, {name} stays frozen",
+                trigger.name
+            )
+            .unwrap();
+        }
+        self.arm_timer();
+    }
+
+    /// Thaws the frozen cgroup, if there is one.
+    fn thaw(&mut self) {
+        let (cgroup, since) = match (config::PRESSURE_FREEZE, self.frozen_since_ns.take()) {
+            (Some(c), Some(s)) => (c, s),
+            _ => return,
+        };
+        let name = config::CGROUPS[cgroup].name;
+        let ret = cgroup::set_frozen(cgroup, false);
+        if ret < 0 {
+            writeln!(linux::Stderr, "failed to thaw cgroup {name}: {ret}").unwrap();
+        }
+        let ns = linux::clock_ns(linux::CLOCK_MONOTONIC) - since;
+        self.frozen_ns += ns;
+        writeln!(
+            linux::Stdout,
+            "pressure: thawed {name} after {} ms",
+            ns / 1_000_000
+        )
+        .unwrap();
+    }
+
+    /// Thaws the frozen cgroup so that its processes can handle the signals that stop them.
+    pub fn stop(&mut self) {
+        self.thaw();
+    }
+
+    pub fn report(&self) {
+        for (trigger, events) in config::PRESSURE_TRIGGERS.iter().zip(&self.events) {
+            writeln!(
+                linux::Stdout,
+                "pressure trigger {} fired {events} times",
+                trigger.name
+            )
+            .unwrap();
+        }
+        if let Some(cgroup) = config::PRESSURE_FREEZE {
+            writeln!(
+                linux::Stdout,
+                "cgroup {} was frozen {} times for {} ms",
+                config::CGROUPS[cgroup].name,
+                self.freezes,
+                self.frozen_ns / 1_000_000
+            )
+            .unwrap();
+        }
+        trace::counter("pressure freezes", self.freezes.into());
+    }
+}
+
+impl Source for Monitor {
+    fn register(&mut self, registrar: &Registrar) -> i32 {
+        let ret = registrar.add(self.timer.0, linux::EPOLLIN, TIMER_KEY);
+        if ret < 0 {
+            return ret;
+        }
+        for (index, fd) in self.triggers.iter().enumerate() {
+            if let Some(fd) = fd {
+                let ret = registrar.add(fd.0, linux::EPOLLPRI, u32::try_from(index).unwrap());
+                if ret < 0 {
+                    return ret;
+                }
+            }
+        }
+        0
+    }
+
+    fn dispatch(&mut self, _registrar: &Registrar, key: u32, events: u32) -> Flow {
+        if key == TIMER_KEY {
+            let mut expirations = [0u8; 8];
+            linux::read(self.timer.0, &mut expirations);
+            self.thaw();
+            return Flow::Continue;
+        }
+        self.handle_trigger(usize::try_from(key).unwrap(), events);
+        Flow::Continue
+    }
+}
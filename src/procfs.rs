@@ -0,0 +1,75 @@
+//! Helpers to read the files of `/proc`, and to write the files of similar filesystems.
+
+use core::convert::{TryFrom, TryInto};
+use core::str;
+
+use crate::linux;
+
+/// Flag of kernel threads in `/proc/<pid>/stat`.
+pub const PF_KTHREAD: u64 = 0x0020_0000;
+
+/// Reads a whole file into `buf`, with `path` relative to the directory `dir_fd`. The content is
+/// truncated if it does not fit.
+pub fn read_file_at<'a>(dir_fd: i32, path: &[u8], buf: &'a mut [u8]) -> Result<&'a [u8], i32> {
+    let fd = unsafe { linux::openat(dir_fd, path.as_ptr(), linux::O_RDONLY | linux::O_CLOEXEC, 0) };
+    if fd < 0 {
+        return Err(fd);
+    }
+    let fd = linux::Fd(fd.try_into().unwrap());
+    let mut len = 0;
+    while len < buf.len() {
+        let n = linux::read(fd.0, &mut buf[len..]);
+        if n < 0 {
+            return Err(n.try_into().unwrap());
+        } else if n == 0 {
+            break;
+        }
+        len += usize::try_from(n).unwrap();
+    }
+    Ok(&buf[..len])
+}
+
+/// Writes `value` to the file at `path`, relative to the directory `dir_fd`. Used for the files of
+/// sysfs and cgroupfs, which take a value in a single write.
+pub fn write_file_at(dir_fd: i32, path: &[u8], value: &[u8]) -> i32 {
+    let fd = unsafe { linux::openat(dir_fd, path.as_ptr(), linux::O_WRONLY | linux::O_CLOEXEC, 0) };
+    if fd < 0 {
+        return fd;
+    }
+    let fd = linux::Fd(fd.try_into().unwrap());
+    let ret = linux::write(fd.0, value);
+    if ret < 0 {
+        return ret.try_into().unwrap();
+    }
+    0
+}
+
+/// Reads a whole file of `/proc` into `buf`.
+pub fn read_proc_file<'a>(path: &[u8], buf: &'a mut [u8]) -> Result<&'a [u8], i32> {
+    read_file_at(linux::AT_FDCWD, path, buf)
+}
+
+/// Parses `/proc/<pid>/stat` and returns the command name and the flags of the process.
+pub fn parse_stat(stat: &[u8]) -> Option<(&[u8], u64)> {
+    // The name is between parentheses and can contain anything, including parentheses.
+    let open = stat.iter().position(|&b| b == b'(')?;
+    let close = stat.iter().rposition(|&b| b == b')')?;
+    let name = stat.get(open + 1..close)?;
+    // The fields after the name are the state, the parent PID, the process group, the session,
+    // the terminal, the foreground process group and the flags.
+    let flags = stat[close + 1..]
+        .split(|&b| b == b' ')
+        .filter(|f| !f.is_empty())
+        .nth(6)?;
+    let flags = str::from_utf8(flags).ok()?.parse().ok()?;
+    Some((name, flags))
+}
+
+/// Returns the value of `key` in `/proc/meminfo`, in kB.
+pub fn meminfo_kb(meminfo: &[u8], key: &[u8]) -> Option<u64> {
+    let line = meminfo
+        .split(|&b| b == b'\n')
+        .find_map(|line| line.strip_prefix(key)?.strip_prefix(b":"))?;
+    let value = line.split(|&b| b == b' ').find(|f| !f.is_empty())?;
+    str::from_utf8(value).ok()?.parse().ok()
+}
@@ -0,0 +1,155 @@
+//! An `epoll` based event loop. Modules that want to be woken up when something happens on a FD
+//! implement the `Source` trait and register their FDs themselves, so that a new kind of event
+//! can be handled without changing the loop.
+//!
+//! Registrations are edge-triggered and the loop waits without a timeout, so the init process
+//! only wakes up when there is actually something to do. Sources must therefore consume all the
+//! available data (for instance, read until `EAGAIN`) when they are dispatched.
+
+use core::convert::{TryFrom, TryInto};
+use core::fmt::Write;
+
+use crate::linux::{self, Fd};
+use crate::trace;
+
+/// Maximum number of sources in a reactor.
+const MAX_SOURCES: usize = 16;
+
+/// What the event loop should do after an event was dispatched.
+#[derive(Copy, Clone, PartialEq, Eq)]
+pub enum Flow {
+    Continue,
+    Stop,
+}
+
+/// Handle given to a source to add, modify and remove its FDs in the event loop. Each FD is
+/// registered with a key chosen by the source, which is given back when an event happens on it.
+pub struct Registrar {
+    epoll: u32,
+    source: u32,
+}
+
+impl Registrar {
+    fn ctl(&self, op: i32, fd: u32, events: u32, key: u32) -> i32 {
+        let event = linux::epoll_event {
+            events,
+            data: (u64::from(self.source) << 32) | u64::from(key),
+        };
+        linux::epoll_ctl(self.epoll, op, fd, Some(&event))
+    }
+
+    /// Starts watching `fd` for `events`. `linux::EPOLLET` is implied.
+    pub fn add(&self, fd: u32, events: u32, key: u32) -> i32 {
+        self.ctl(linux::EPOLL_CTL_ADD, fd, events | linux::EPOLLET, key)
+    }
+
+    /// Changes the events and the key of an FD that was added before.
+    pub fn modify(&self, fd: u32, events: u32, key: u32) -> i32 {
+        self.ctl(linux::EPOLL_CTL_MOD, fd, events | linux::EPOLLET, key)
+    }
+
+    /// Stops watching `fd`.
+    pub fn remove(&self, fd: u32) -> i32 {
+        linux::epoll_ctl(self.epoll, linux::EPOLL_CTL_DEL, fd, None)
+    }
+}
+
+/// Something that reacts to events on FDs.
+pub trait Source {
+    /// Adds the FDs of the source to the event loop.
+    fn register(&mut self, registrar: &Registrar) -> i32;
+
+    /// Handles `events` that happened on the FD that was registered with `key`.
+    fn dispatch(&mut self, registrar: &Registrar, key: u32, events: u32) -> Flow;
+}
+
+pub struct Reactor<'a> {
+    epoll: Fd,
+    sources: [Option<&'a mut dyn Source>; MAX_SOURCES],
+    count: usize,
+    /// Number of times `epoll_wait` returned.
+    pub wakeups: u64,
+    /// Number of times `epoll_wait` returned without any event to dispatch.
+    pub spurious_wakeups: u64,
+}
+
+impl<'a> Reactor<'a> {
+    pub fn new() -> Result<Self, i32> {
+        let fd = linux::epoll_create1(linux::EPOLL_CLOEXEC);
+        if fd < 0 {
+            return Err(fd);
+        }
+        Ok(Self {
+            epoll: Fd(fd.try_into().unwrap()),
+            sources: Default::default(),
+            count: 0,
+            wakeups: 0,
+            spurious_wakeups: 0,
+        })
+    }
+
+    /// Adds a source to the event loop and lets it register its FDs.
+    pub fn add(&mut self, source: &'a mut dyn Source) -> i32 {
+        if self.count == MAX_SOURCES {
+            return -linux::ENOMEM;
+        }
+        let registrar = Registrar {
+            epoll: self.epoll.0,
+            source: u32::try_from(self.count).unwrap(),
+        };
+        let ret = source.register(&registrar);
+        if ret < 0 {
+            return ret;
+        }
+        self.sources[self.count] = Some(source);
+        self.count += 1;
+        0
+    }
+
+    /// Waits for events and dispatches them until a source asks to stop or an error happens.
+    pub fn run(&mut self) -> i32 {
+        let mut events = [linux::epoll_event { events: 0, data: 0 }; 16];
+        loop {
+            let ret = linux::epoll_wait(self.epoll.0, &mut events, -1);
+            self.wakeups += 1;
+            if ret == -linux::EINTR {
+                self.spurious_wakeups += 1;
+                continue;
+            } else if ret < 0 {
+                return ret;
+            } else if ret == 0 {
+                self.spurious_wakeups += 1;
+                continue;
+            }
+
+            for event in &events[..usize::try_from(ret).unwrap()] {
+                let data = event.data;
+                let source = usize::try_from(data >> 32).unwrap();
+                let registrar = Registrar {
+                    epoll: self.epoll.0,
+                    source: u32::try_from(source).unwrap(),
+                };
+                let source = match self.sources.get_mut(source) {
+                    Some(Some(s)) => s,
+                    _ => continue,
+                };
+                if source.dispatch(&registrar, data as u32, event.events) == Flow::Stop {
+                    return 0;
+                }
+            }
+        }
+    }
+
+    /// Prints and traces the wakeup counters.
+    pub fn report(&self) {
+        writeln!(
+            linux::Stdout,
+            "event loop woke up {} times, {} of which were spurious",
+            self.wakeups,
+            self.spurious_wakeups
+        )
+        .unwrap();
+        trace::counter("event loop wakeups", self.wakeups as i64);
+        trace::counter("event loop spurious wakeups", self.spurious_wakeups as i64);
+    }
+}
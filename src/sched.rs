@@ -0,0 +1,63 @@
+//! Scheduling policy of the programs that init starts: CPU scheduling policy and priority, nice
+//! level, I/O priority, CPU affinity and timer slack. A policy comes from the `sched` table of a
+//! service, or from `dmesg_sched` in the `[shutdown]` section of `config.toml`, and is applied by
+//! the new process before it executes its program, while it still has the privileges of init.
+//!
+//! Real-time and deadline policies are set with `SCHED_FLAG_RESET_ON_FORK`, so that the processes
+//! that a program starts, like the applications started by the compositor, are not real-time too.
+//! A process with the deadline policy cannot even fork without it.
+
+use core::fmt::Write;
+
+use crate::linux;
+
+/// Scheduling policy of a program, generated by the `build.rs` script. Each setting is left as it
+/// is inherited from init if it is not set.
+pub struct Policy {
+    /// Policy, priority, nice level and deadline parameters, for `sched_setattr`.
+    pub attr: Option<linux::sched_attr>,
+    /// I/O class and priority, as given to `ioprio_set`.
+    pub ioprio: Option<u16>,
+    /// CPUs that the program may run on, as a bit mask.
+    pub cpus: &'static [u64],
+    pub timer_slack_ns: Option<u64>,
+}
+
+impl Policy {
+    /// A policy that leaves everything as it is.
+    pub const DEFAULT: Policy = Policy {
+        attr: None,
+        ioprio: None,
+        cpus: &[],
+        timer_slack_ns: None,
+    };
+
+    /// Applies the policy to the calling process. Failures are logged but the program is still
+    /// executed, since it works the same with the default policy, only with a different latency.
+    pub fn apply(&self) {
+        if let Some(attr) = &self.attr {
+            let ret = linux::sched_setattr(0, attr, 0);
+            if ret < 0 {
+                writeln!(linux::Stderr, "failed to sched_setattr: {ret}").unwrap();
+            }
+        }
+        if let Some(ioprio) = self.ioprio {
+            let ret = linux::ioprio_set(linux::IOPRIO_WHO_PROCESS, 0, ioprio);
+            if ret < 0 {
+                writeln!(linux::Stderr, "failed to ioprio_set: {ret}").unwrap();
+            }
+        }
+        if !self.cpus.is_empty() {
+            let ret = linux::sched_setaffinity(0, self.cpus);
+            if ret < 0 {
+                writeln!(linux::Stderr, "failed to sched_setaffinity: {ret}").unwrap();
+            }
+        }
+        if let Some(slack) = self.timer_slack_ns {
+            let ret = linux::prctl(linux::PR_SET_TIMERSLACK, slack, 0, 0, 0);
+            if ret < 0 {
+                writeln!(linux::Stderr, "failed to set timer slack: {ret}").unwrap();
+            }
+        }
+    }
+}
@@ -3,37 +3,522 @@
 //! that, it is given a FD to a UNIX socket on which it will send a datagram with the path to a
 //! device to that socket followed by a NUL byte, and it will receive a datagram with a FD of the
 //! device if the request was allowed, or an empty datagram otherwise.
+//!
+//! As the compositor opens many devices when it starts, there is also a second version of the
+//! protocol that batches requests. A v2 datagram starts with a header of 4 bytes: a zero byte
+//! (which cannot start a v1 request since paths are not empty), the version `2`, the kind of
+//! request and the number of entries. For `Kind::Open` requests, each entry is a `u32` request ID
+//! in native endianness followed by a NUL-terminated path. The reply starts with the same header
+//! where the number of entries is the number of entries that were handled, followed by a `u32`
+//! request ID and an `i32` status for each of them, where the status is zero if the device was
+//! opened and a negative error number otherwise. The FDs of the opened devices are attached in a
+//! single `SCM_RIGHTS` control message, in the order of the entries. At most
+//! `linux::SCM_MAX_FD` entries are handled per datagram.
+//!
+//! To take these round trips off the path to the first frame, the DRM devices from the
+//! configuration and the input devices that exist when the compositor starts are opened
+//! beforehand. The compositor inherits them, and requests for their paths are answered with the
+//! FDs that are already open.
+//!
+//! Input and DRM devices that are added or removed later are reported to clients that have sent
+//! at least one v2 request, with unsolicited v2 datagrams of the `Kind::Added` and `Kind::Removed`
+//! kinds. Such a datagram has one entry: an `i32` status and the NUL-terminated path of the
+//! device. For added devices, the status is zero and the FD of the device is attached if it could
+//! be opened, or it is a negative error number otherwise.
+//!
+//! A `Kind::Enumerate` request, without entries, returns the devices that currently exist so that
+//! the compositor does not have to walk `/dev` and sysfs itself. Each entry of the reply is a `u8`
+//! subsystem (`SUBSYSTEM_INPUT` or `SUBSYSTEM_DRM`), a `u8` set of `DEVICE_*` flags, a `u32` in
+//! native endianness and the NUL-terminated path of the device. For input devices, the `u32` is
+//! the bitmask of supported event types (`capabilities/ev` in sysfs), and it is zero for DRM
+//! devices. The list is cached until a uevent reports that an input or DRM device was added or
+//! removed.
+//!
+//! The time spent opening devices and sending their FDs is recorded, to find out whether it slows
+//! down the start of the compositor. A `Kind::Stats` request, without entries, returns these
+//! statistics, which are also printed when the event loop ends. The reply contains `u64` values
+//! in native endianness: the number of open requests, the number of failed ones, then the count,
+//! 50th, 90th and 99th percentiles and maximum of the open latencies and of the `sendmsg`
+//! latencies, in nanoseconds. It is followed by the recent requests, from the oldest to the
+//! newest, each as a `u64` open latency, a `u64` `sendmsg` latency, an `i32` status and the
+//! NUL-terminated path, which may be truncated. The entry count of the header is the number of
+//! recent requests.
 
 use core::convert::{TryFrom, TryInto};
 use core::fmt::Write;
 use core::mem;
 use core::ptr;
 
+use crate::config;
+use crate::histogram::Histogram;
 use crate::linux::{self, Fd};
+use crate::reactor::{Flow, Registrar, Source};
+use crate::trace;
+use crate::uevent::{self, UeventSocket};
+
+/// Size of the header of a v2 datagram.
+const V2_HEADER_SIZE: usize = 4;
+const V2_MARKER: u8 = 0;
+const V2: u8 = 2;
+
+/// Size of the status of an entry in a v2 reply.
+const V2_STATUS_SIZE: usize = 8;
+
+/// Maximum size of a request datagram.
+const MAX_REQUEST_SIZE: usize = 8192;
+
+/// Maximum number of devices opened before the compositor starts.
+pub const MAX_PREOPENED: usize = 64;
+
+/// Maximum length of the path of a pre-opened device, including the NUL byte.
+const MAX_PATH_LEN: usize = 64;
+
+/// FDs of pre-opened devices are moved to numbers above this one so that they do not clash with
+/// the numbers that they get in the compositor.
+const PREOPENED_MIN_FD: u64 = 128;
+
+/// Reactor keys of the FDs of the seat server.
+const SOCKET_KEY: u32 = 0;
+const UEVENT_KEY: u32 = 1;
+
+/// Subsystems of the devices of an enumeration.
+pub const SUBSYSTEM_INPUT: u8 = 1;
+pub const SUBSYSTEM_DRM: u8 = 2;
+
+/// The DRM device is the one the firmware used to boot.
+pub const DEVICE_PRIMARY: u8 = 1;
+/// The DRM device is a render node.
+pub const DEVICE_RENDER: u8 = 2;
+
+/// Maximum size of an enumeration reply.
+const MAX_ENUMERATION_SIZE: usize = 4096;
+
+/// Number of recent requests kept in the statistics.
+const RECENT_REQUESTS: usize = 32;
+
+/// Maximum size of a statistics reply.
+const MAX_STATS_SIZE: usize = 4096;
+
+/// Kinds of v2 datagrams.
+#[derive(Copy, Clone, PartialEq, Eq)]
+#[repr(u8)]
+enum Kind {
+    /// Open devices.
+    Open = 1,
+    /// Notification of a device that was added.
+    Added = 2,
+    /// Notification of a device that was removed.
+    Removed = 3,
+    /// List the devices.
+    Enumerate = 4,
+    /// Get the latency statistics.
+    Stats = 5,
+}
+
+impl Kind {
+    fn from_u8(kind: u8) -> Option<Self> {
+        match kind {
+            1 => Some(Self::Open),
+            2 => Some(Self::Added),
+            3 => Some(Self::Removed),
+            4 => Some(Self::Enumerate),
+            5 => Some(Self::Stats),
+            _ => None,
+        }
+    }
+}
 
 #[repr(C)]
 struct RightsCtrlMsg {
     hdr: linux::cmsghdr,
-    fd: i32,
+    fds: [i32; linux::SCM_MAX_FD],
 }
 
 impl RightsCtrlMsg {
-    fn new(fd: i32) -> Self {
-        Self {
+    fn new(fds: &[i32]) -> Self {
+        let mut msg = Self {
             hdr: linux::cmsghdr {
                 cmsg_level: linux::SOL_SOCKET,
                 cmsg_type: linux::SCM_RIGHTS,
-                cmsg_len: mem::size_of::<RightsCtrlMsg>(),
+                cmsg_len: mem::size_of::<linux::cmsghdr>() + mem::size_of_val(fds),
             },
-            fd,
+            fds: [0; linux::SCM_MAX_FD],
+        };
+        msg.fds[..fds.len()].copy_from_slice(fds);
+        msg
+    }
+
+    /// Returns the size of the control message, including the padding that the kernel expects at
+    /// the end.
+    fn space(&self) -> usize {
+        let align = mem::align_of::<linux::cmsghdr>();
+        (self.hdr.cmsg_len + align - 1) & !(align - 1)
+    }
+}
+
+/// Opens a device for the compositor.
+///
+/// # Safety
+///
+/// `path` must be a NUL-terminated string.
+unsafe fn open_device(path: *const u8) -> Result<Fd, i32> {
+    let fd = linux::open(
+        path,
+        linux::O_RDWR | linux::O_NOCTTY | linux::O_NOFOLLOW | linux::O_CLOEXEC | linux::O_NONBLOCK,
+        0,
+    );
+    if fd < 0 {
+        return Err(fd);
+    }
+    Ok(Fd(u32::try_from(fd).unwrap()))
+}
+
+/// Writes the concatenation of `parts` followed by a NUL byte to `buf` and returns it, or `None` if
+/// it does not fit.
+fn join<'a>(buf: &'a mut [u8], parts: &[&[u8]]) -> Option<&'a [u8]> {
+    let mut len = 0;
+    for part in parts {
+        buf.get_mut(len..len + part.len())?.copy_from_slice(part);
+        len += part.len();
+    }
+    *buf.get_mut(len)? = 0;
+    Some(&buf[..=len])
+}
+
+/// Reads a small sysfs attribute at `path`, which must be NUL-terminated, into `buf`, and returns
+/// its content without the trailing newline.
+fn read_attribute<'a>(path: &[u8], buf: &'a mut [u8]) -> Result<&'a [u8], i32> {
+    let fd = unsafe { linux::open(path.as_ptr(), linux::O_RDONLY | linux::O_CLOEXEC, 0) };
+    if fd < 0 {
+        return Err(fd);
+    }
+    let fd = Fd(u32::try_from(fd).unwrap());
+    let n = linux::read(fd.0, buf);
+    if n < 0 {
+        return Err(n.try_into().unwrap());
+    }
+    let data = &buf[..usize::try_from(n).unwrap()];
+    Ok(data.strip_suffix(b"\n").unwrap_or(data))
+}
+
+/// Parses the last 8 digits of a hexadecimal bitmask.
+fn parse_hex_mask(s: &[u8]) -> u32 {
+    let digits = &s[s.len().saturating_sub(8)..];
+    digits.iter().fold(0, |acc, &c| {
+        let d = match c {
+            b'0'..=b'9' => c - b'0',
+            b'a'..=b'f' => c - b'a' + 10,
+            b'A'..=b'F' => c - b'A' + 10,
+            _ => 0,
+        };
+        (acc << 4) | u32::from(d)
+    })
+}
+
+/// The cached reply to a `Kind::Enumerate` request.
+struct Enumeration {
+    reply: [u8; MAX_ENUMERATION_SIZE],
+    len: usize,
+    valid: bool,
+}
+
+impl Enumeration {
+    /// Adds an entry to the reply, unless it is full.
+    fn push(&mut self, subsystem: u8, flags: u8, capabilities: u32, path: &[u8]) {
+        let entry_len = 6 + path.len();
+        if self.reply[3] == u8::MAX || self.len + entry_len > self.reply.len() {
+            return;
+        }
+        let out = &mut self.reply[self.len..self.len + entry_len];
+        out[0] = subsystem;
+        out[1] = flags;
+        out[2..6].copy_from_slice(&capabilities.to_ne_bytes());
+        out[6..].copy_from_slice(path);
+        self.len += entry_len;
+        self.reply[3] += 1;
+    }
+
+    /// Calls `f` with the names of the entries of the directory at `path` that start with
+    /// `prefix`.
+    fn for_each_device<F: FnMut(&mut Self, &[u8])>(
+        &mut self,
+        path: &[u8],
+        prefix: &[u8],
+        mut f: F,
+    ) {
+        let dir = unsafe {
+            linux::open(
+                path.as_ptr(),
+                linux::O_RDONLY | linux::O_DIRECTORY | linux::O_CLOEXEC,
+                0,
+            )
+        };
+        if dir < 0 {
+            writeln!(linux::Stderr, "failed to open device directory: {dir}").unwrap();
+            return;
+        }
+        let dir = Fd(u32::try_from(dir).unwrap());
+        let ret = linux::read_dir(dir.0, |name, kind| {
+            if kind == linux::DT_CHR && name.starts_with(prefix) {
+                f(self, name);
+            }
+            true
+        });
+        if ret < 0 {
+            writeln!(linux::Stderr, "failed to read device directory: {ret}").unwrap();
+        }
+    }
+
+    /// Builds the list of devices again.
+    fn refresh(&mut self) {
+        self.reply[..V2_HEADER_SIZE].copy_from_slice(&[V2_MARKER, V2, Kind::Enumerate as u8, 0]);
+        self.len = V2_HEADER_SIZE;
+
+        self.for_each_device(b"/dev/dri\0", b"", |e, name| {
+            let mut path = [0u8; MAX_PATH_LEN];
+            let path = match join(&mut path, &[b"/dev/dri/", name]) {
+                Some(p) => p,
+                None => return,
+            };
+            let mut flags = 0;
+            if name.starts_with(b"renderD") {
+                flags |= DEVICE_RENDER;
+            } else if name.starts_with(b"card") {
+                let mut attr_path = [0u8; 128];
+                let mut value = [0u8; 8];
+                if let Some(attr_path) = join(
+                    &mut attr_path,
+                    &[b"/sys/class/drm/", name, b"/device/boot_vga"],
+                ) {
+                    if read_attribute(attr_path, &mut value) == Ok(b"1") {
+                        flags |= DEVICE_PRIMARY;
+                    }
+                }
+            } else {
+                return;
+            }
+            e.push(SUBSYSTEM_DRM, flags, 0, path);
+        });
+
+        self.for_each_device(b"/dev/input\0", b"event", |e, name| {
+            let mut path = [0u8; MAX_PATH_LEN];
+            let path = match join(&mut path, &[b"/dev/input/", name]) {
+                Some(p) => p,
+                None => return,
+            };
+            let mut attr_path = [0u8; 128];
+            let mut value = [0u8; 64];
+            let capabilities = match join(
+                &mut attr_path,
+                &[b"/sys/class/input/", name, b"/device/capabilities/ev"],
+            ) {
+                Some(attr_path) => read_attribute(attr_path, &mut value)
+                    .map(parse_hex_mask)
+                    .unwrap_or(0),
+                None => 0,
+            };
+            e.push(SUBSYSTEM_INPUT, 0, capabilities, path);
+        });
+
+        self.valid = true;
+    }
+}
+
+/// An open request, as recorded in the statistics.
+#[derive(Copy, Clone)]
+struct RequestRecord {
+    /// NUL-terminated path, truncated if it is too long.
+    path: [u8; MAX_PATH_LEN],
+    open_ns: u64,
+    send_ns: u64,
+    status: i32,
+}
+
+impl RequestRecord {
+    fn path(&self) -> &[u8] {
+        &self.path[..self.path.iter().position(|&b| b == 0).unwrap_or(0)]
+    }
+}
+
+/// Latency statistics of the open requests.
+struct Stats {
+    open: Histogram,
+    send: Histogram,
+    requests: u64,
+    failures: u64,
+    /// Number of the requests since the last `sendmsg` whose device could not be opened.
+    batch_open_failures: u64,
+    /// Ring of the recent requests. The next one is written at `recorded % RECENT_REQUESTS`.
+    recent: [RequestRecord; RECENT_REQUESTS],
+    recorded: usize,
+}
+
+impl Stats {
+    const fn new() -> Self {
+        Self {
+            open: Histogram::new(),
+            send: Histogram::new(),
+            requests: 0,
+            failures: 0,
+            batch_open_failures: 0,
+            recent: [RequestRecord {
+                path: [0; MAX_PATH_LEN],
+                open_ns: 0,
+                send_ns: 0,
+                status: 0,
+            }; RECENT_REQUESTS],
+            recorded: 0,
+        }
+    }
+
+    /// Records the opening of the device at `path`, which must be NUL-terminated.
+    fn record_open(&mut self, path: &[u8], open_ns: u64, status: i32) {
+        self.open.record(open_ns);
+        self.requests += 1;
+        if status < 0 {
+            self.failures += 1;
+            self.batch_open_failures += 1;
+        }
+        let record = &mut self.recent[self.recorded % RECENT_REQUESTS];
+        self.recorded += 1;
+        let len = path.len().min(MAX_PATH_LEN) - 1;
+        record.path[..len].copy_from_slice(&path[..len]);
+        record.path[len] = 0;
+        record.open_ns = open_ns;
+        record.send_ns = 0;
+        record.status = status;
+    }
+
+    /// Records the `sendmsg` call that answered the last `requests` open requests, and its
+    /// result. A request fails if its device could not be opened or if the reply was not sent.
+    fn record_send(&mut self, requests: usize, send_ns: u64, ret: isize) {
+        self.send.record(send_ns);
+        // The requests whose device could not be opened were counted as failures already. A
+        // batch can be larger than the ring, so the count does not depend on it.
+        if ret < 0 {
+            self.failures += u64::try_from(requests)
+                .unwrap()
+                .saturating_sub(self.batch_open_failures);
+        }
+        self.batch_open_failures = 0;
+        let recent = requests.min(RECENT_REQUESTS).min(self.recorded);
+        for i in 0..recent {
+            let record = &mut self.recent[(self.recorded - 1 - i) % RECENT_REQUESTS];
+            record.send_ns = send_ns;
+            if record.status == 0 && ret < 0 {
+                record.status = i32::try_from(ret).unwrap();
+            }
         }
     }
+
+    fn recent(&self) -> impl Iterator<Item = &RequestRecord> {
+        let count = self.recorded.min(RECENT_REQUESTS);
+        (self.recorded - count..self.recorded).map(move |i| &self.recent[i % RECENT_REQUESTS])
+    }
+
+    /// Writes the statistics reply to `out` and returns its size.
+    fn serialize(&self, out: &mut [u8]) -> usize {
+        out[..V2_HEADER_SIZE].copy_from_slice(&[V2_MARKER, V2, Kind::Stats as u8, 0]);
+        let mut len = V2_HEADER_SIZE;
+        let mut values = [0u64; 12];
+        values[0] = self.requests;
+        values[1] = self.failures;
+        for (h, v) in [&self.open, &self.send]
+            .iter()
+            .zip(values[2..].chunks_mut(5))
+        {
+            v.copy_from_slice(&[
+                h.count(),
+                h.percentile(50),
+                h.percentile(90),
+                h.percentile(99),
+                h.max(),
+            ]);
+        }
+        for v in &values {
+            out[len..len + 8].copy_from_slice(&v.to_ne_bytes());
+            len += 8;
+        }
+        for record in self.recent() {
+            let path = record.path();
+            let entry_len = 8 + 8 + 4 + path.len() + 1;
+            if len + entry_len > out.len() {
+                break;
+            }
+            out[len..len + 8].copy_from_slice(&record.open_ns.to_ne_bytes());
+            out[len + 8..len + 16].copy_from_slice(&record.send_ns.to_ne_bytes());
+            out[len + 16..len + 20].copy_from_slice(&record.status.to_ne_bytes());
+            out[len + 20..len + entry_len - 1].copy_from_slice(path);
+            out[len + entry_len - 1] = 0;
+            len += entry_len;
+            out[3] += 1;
+        }
+        len
+    }
+
+    fn report(&self) {
+        writeln!(
+            linux::Stdout,
+            "seat server: {} open requests, {} failed",
+            self.requests,
+            self.failures
+        )
+        .unwrap();
+        for (what, h) in [("open", &self.open), ("sendmsg", &self.send)] {
+            writeln!(
+                linux::Stdout,
+                "seat server: {what} latency (us): p50 {}, p90 {}, p99 {}, max {}",
+                h.percentile(50) / 1000,
+                h.percentile(90) / 1000,
+                h.percentile(99) / 1000,
+                h.max() / 1000
+            )
+            .unwrap();
+        }
+        for record in self.recent() {
+            writeln!(
+                linux::Stdout,
+                "seat server: {}: open {} us, sendmsg {} us, status {}",
+                core::str::from_utf8(record.path()).unwrap_or("?"),
+                record.open_ns / 1000,
+                record.send_ns / 1000,
+                record.status
+            )
+            .unwrap();
+        }
+    }
+}
+
+/// A device opened before the compositor starts.
+pub struct Device {
+    /// NUL-terminated path of the device.
+    path: [u8; MAX_PATH_LEN],
+    path_len: usize,
+    fd: Fd,
+}
+
+impl Device {
+    /// Returns the path of the device, without the NUL byte.
+    pub fn path(&self) -> &[u8] {
+        &self.path[..self.path_len - 1]
+    }
+
+    pub fn fd(&self) -> u32 {
+        self.fd.0
+    }
 }
 
 /// A seat server is an object to process device open requests from the Wayland compositor. It will
 /// receive those requests on a anonymous UNIX socket.
 pub struct SeatServer {
     fd: Fd,
+    preopened: [Option<Device>; MAX_PREOPENED],
+    /// Socket receiving device hotplug events, if it could be created.
+    uevents: Option<UeventSocket>,
+    /// Whether the client has sent a v2 request, and thus understands notifications.
+    v2_client: bool,
+    enumeration: Enumeration,
+    stats: Stats,
 }
 
 impl SeatServer {
@@ -55,11 +540,299 @@ impl SeatServer {
             return Err(ret);
         }
 
-        Ok((Self { fd: pair.0 }, pair.1))
+        let uevents = match UeventSocket::new() {
+            Ok(s) => Some(s),
+            Err(err) => {
+                writeln!(linux::Stderr, "failed to create uevent socket: {err}").unwrap();
+                None
+            }
+        };
+
+        Ok((
+            Self {
+                fd: pair.0,
+                preopened: [const { None }; MAX_PREOPENED],
+                uevents,
+                v2_client: false,
+                enumeration: Enumeration {
+                    reply: [0; MAX_ENUMERATION_SIZE],
+                    len: 0,
+                    valid: false,
+                },
+                stats: Stats::new(),
+            },
+            pair.1,
+        ))
+    }
+
+    /// Opens the device at `path`, which must be NUL-terminated, and keeps it to give it to the
+    /// compositor later.
+    fn preopen(&mut self, path: &[u8]) {
+        if path.len() > MAX_PATH_LEN {
+            return;
+        }
+        let slot = match self.preopened.iter_mut().find(|d| d.is_none()) {
+            Some(slot) => slot,
+            None => return,
+        };
+        let fd = match unsafe { open_device(path.as_ptr()) } {
+            Ok(fd) => fd,
+            Err(err) => {
+                writeln!(
+                    linux::Stderr,
+                    "failed to pre-open {}: {err}",
+                    core::str::from_utf8(&path[..path.len() - 1]).unwrap_or("device")
+                )
+                .unwrap();
+                return;
+            }
+        };
+        let ret = linux::fcntl(fd.0, linux::F_DUPFD_CLOEXEC, PREOPENED_MIN_FD);
+        if ret < 0 {
+            writeln!(linux::Stderr, "failed to move pre-opened FD: {ret}").unwrap();
+            return;
+        }
+        let mut device = Device {
+            path: [0; MAX_PATH_LEN],
+            path_len: path.len(),
+            fd: Fd(u32::try_from(ret).unwrap()),
+        };
+        device.path[..path.len()].copy_from_slice(path);
+        *slot = Some(device);
+    }
+
+    /// Opens the DRM devices of the configuration and the input devices that currently exist, so
+    /// that they can be given to the compositor when it starts.
+    pub fn preopen_devices(&mut self) {
+        for path in config::DRM_DEVICES {
+            self.preopen(path);
+        }
+
+        let dir = unsafe {
+            linux::open(
+                b"/dev/input\0" as *const u8,
+                linux::O_RDONLY | linux::O_DIRECTORY | linux::O_CLOEXEC,
+                0,
+            )
+        };
+        if dir < 0 {
+            writeln!(linux::Stderr, "failed to open /dev/input: {dir}").unwrap();
+            return;
+        }
+        let dir = Fd(u32::try_from(dir).unwrap());
+        let ret = linux::read_dir(dir.0, |name, kind| {
+            if kind == linux::DT_CHR && name.starts_with(b"event") {
+                let mut path = [0u8; MAX_PATH_LEN];
+                if let Some(path) = join(&mut path, &[b"/dev/input/", name]) {
+                    self.preopen(path);
+                }
+            }
+            true
+        });
+        if ret < 0 {
+            writeln!(linux::Stderr, "failed to read /dev/input: {ret}").unwrap();
+        }
+    }
+
+    /// Returns the devices that were opened before the compositor started.
+    pub fn preopened(&self) -> impl Iterator<Item = &Device> {
+        self.preopened.iter().flatten()
+    }
+
+    /// Returns a FD for the device at `path`, which must be NUL-terminated. If the device was not
+    /// pre-opened, the FD is also returned as an owned `Fd` so that it is closed once sent.
+    fn open(&self, path: &[u8]) -> Result<(i32, Option<Fd>), i32> {
+        if let Some(device) = self.preopened().find(|d| &d.path[..d.path_len] == path) {
+            return Ok((i32::try_from(device.fd.0).unwrap(), None));
+        }
+        let fd = unsafe { open_device(path.as_ptr())? };
+        Ok((i32::try_from(fd.0).unwrap(), Some(fd)))
+    }
+
+    /// Like `open`, but records the latency in the statistics.
+    fn timed_open(&mut self, path: &[u8]) -> Result<(i32, Option<Fd>), i32> {
+        let start = linux::clock_ns(linux::CLOCK_MONOTONIC);
+        let ret = self.open(path);
+        let open_ns = linux::clock_ns(linux::CLOCK_MONOTONIC) - start;
+        self.stats
+            .record_open(path, open_ns, *ret.as_ref().err().unwrap_or(&0));
+        ret
+    }
+
+    /// Like `send`, but records the latency in the statistics as the reply to the last `requests`
+    /// open requests.
+    fn timed_send(&mut self, requests: usize, data: &[u8], fds: &[i32]) -> isize {
+        let start = linux::clock_ns(linux::CLOCK_MONOTONIC);
+        let ret = self.send(data, fds);
+        let send_ns = linux::clock_ns(linux::CLOCK_MONOTONIC) - start;
+        self.stats.record_send(requests, send_ns, ret);
+        ret
+    }
+
+    /// Sends a datagram made of `data` and `fds` to the compositor.
+    fn send(&self, data: &[u8], fds: &[i32]) -> isize {
+        // We cannot send anciliary data without actual data.
+        let byte = 0u8;
+        let iov = if data.is_empty() {
+            linux::iovec {
+                iov_base: &byte as *const u8 as *mut u8,
+                iov_len: mem::size_of_val(&byte),
+            }
+        } else {
+            linux::iovec {
+                iov_base: data.as_ptr() as *mut u8,
+                iov_len: data.len(),
+            }
+        };
+        let mut rights = RightsCtrlMsg::new(fds);
+        let mut msg = linux::msghdr {
+            msg_name: ptr::null_mut(),
+            msg_namelen: 0,
+            msg_iov: &iov as *const linux::iovec as *mut linux::iovec,
+            msg_iovlen: 1,
+            msg_control: ptr::null_mut(),
+            msg_controllen: 0,
+            msg_flags: 0,
+        };
+        if !fds.is_empty() {
+            msg.msg_control = &mut rights as *mut RightsCtrlMsg as *mut u8;
+            msg.msg_controllen = rights.space();
+        }
+        unsafe { linux::sendmsg(i32::try_from(self.fd.0).unwrap(), &mut msg, 0) }
+    }
+
+    fn process_v1(&mut self, request: &[u8]) {
+        // Datagram should be a NUL-terminated string.
+        if request.is_empty() || request[request.len() - 1] != b'\0' {
+            return;
+        }
+        match self.timed_open(request) {
+            Ok((dev_fd, _owned)) => {
+                let ret = self.timed_send(1, &[], &[dev_fd]);
+                if ret < 0 {
+                    writeln!(
+                        linux::Stderr,
+                        "failed to send device FD to Wayland compositor: {ret}"
+                    )
+                    .unwrap();
+                }
+            }
+            Err(_) => {
+                // Send a message without an FD to the client to tell it about the error.
+                let ret = self.timed_send(1, &[], &[]);
+                if ret < 0 {
+                    writeln!(
+                        linux::Stderr,
+                        "failed to send error message to Wayland compositor: {ret}"
+                    )
+                    .unwrap();
+                }
+            }
+        }
+    }
+
+    fn process_v2_open(&mut self, mut entries: &[u8], reply: &mut [u8]) {
+        let mut raw_fds = [0; linux::SCM_MAX_FD];
+        // FDs that were opened for this request, which are closed once they were sent.
+        let mut owned_fds = [const { None::<Fd> }; linux::SCM_MAX_FD];
+        let mut fd_count = 0;
+        let mut handled = 0;
+        while handled < linux::SCM_MAX_FD && entries.len() > 4 {
+            let (id, rest) = entries.split_at(4);
+            let path_len = match rest.iter().position(|&b| b == b'\0') {
+                Some(p) => p,
+                // The entry is truncated.
+                None => break,
+            };
+            let status = match self.timed_open(&rest[..=path_len]) {
+                Ok((fd, owned)) => {
+                    raw_fds[fd_count] = fd;
+                    owned_fds[fd_count] = owned;
+                    fd_count += 1;
+                    0
+                }
+                Err(err) => err,
+            };
+            let out = &mut reply[V2_HEADER_SIZE + handled * V2_STATUS_SIZE..];
+            out[..4].copy_from_slice(id);
+            out[4..8].copy_from_slice(&status.to_ne_bytes());
+            handled += 1;
+            entries = &rest[path_len + 1..];
+        }
+        reply[3] = u8::try_from(handled).unwrap();
+
+        let ret = self.timed_send(
+            handled,
+            &reply[..V2_HEADER_SIZE + handled * V2_STATUS_SIZE],
+            &raw_fds[..fd_count],
+        );
+        if ret < 0 {
+            writeln!(
+                linux::Stderr,
+                "failed to send device FDs to Wayland compositor: {ret}"
+            )
+            .unwrap();
+        }
+    }
+
+    fn process_v2_enumerate(&mut self) {
+        if !self.enumeration.valid {
+            trace::span("enumerate devices", || self.enumeration.refresh());
+        }
+        let ret = self.send(&self.enumeration.reply[..self.enumeration.len], &[]);
+        if ret < 0 {
+            writeln!(
+                linux::Stderr,
+                "failed to send device list to Wayland compositor: {ret}"
+            )
+            .unwrap();
+        }
+    }
+
+    fn process_v2_stats(&mut self) {
+        let mut reply = [0u8; MAX_STATS_SIZE];
+        let len = self.stats.serialize(&mut reply);
+        let ret = self.send(&reply[..len], &[]);
+        if ret < 0 {
+            writeln!(
+                linux::Stderr,
+                "failed to send statistics to Wayland compositor: {ret}"
+            )
+            .unwrap();
+        }
+    }
+
+    /// Prints the latency statistics of the open requests.
+    pub fn report(&self) {
+        self.stats.report();
+    }
+
+    fn process_v2(&mut self, request: &[u8]) {
+        self.v2_client = true;
+        let mut reply = [0u8; V2_HEADER_SIZE + linux::SCM_MAX_FD * V2_STATUS_SIZE];
+        reply[..3].copy_from_slice(&request[..3]);
+        let (_, entries) = request.split_at(V2_HEADER_SIZE);
+        match Kind::from_u8(reply[2]) {
+            Some(Kind::Open) => self.process_v2_open(entries, &mut reply),
+            Some(Kind::Enumerate) => self.process_v2_enumerate(),
+            Some(Kind::Stats) => self.process_v2_stats(),
+            // These are only sent by the server.
+            Some(Kind::Added) | Some(Kind::Removed) | None => {
+                // Tell the client that nothing was handled.
+                let ret = self.send(&reply[..V2_HEADER_SIZE], &[]);
+                if ret < 0 {
+                    writeln!(
+                        linux::Stderr,
+                        "failed to send error message to Wayland compositor: {ret}"
+                    )
+                    .unwrap();
+                }
+            }
+        }
     }
 
     fn process_incoming_one(&mut self) -> Result<bool, i32> {
-        let mut buf = [0u8; 48];
+        let mut buf = [0u8; MAX_REQUEST_SIZE];
         let ret = unsafe {
             linux::recvfrom(
                 i32::try_from(self.fd.0).unwrap(),
@@ -79,76 +852,144 @@ impl SeatServer {
                 return Err(ret.try_into().unwrap());
             }
         };
-        // Datagram should be a NUL-terminated string.
-        if n == 0 || buf[n - 1] != b'\0' {
-            return Ok(true);
-        }
-        let dev_fd = unsafe {
-            linux::open(
-                buf.as_ptr(),
-                linux::O_RDWR
-                    | linux::O_NOCTTY
-                    | linux::O_NOFOLLOW
-                    | linux::O_CLOEXEC
-                    | linux::O_NONBLOCK,
-                0,
-            )
-        };
-        // We cannot send anciliary data without actual data.
-        let byte = 0u8;
-        let iov = linux::iovec {
-            iov_base: &byte as *const u8 as *mut u8,
-            iov_len: mem::size_of_val(&byte),
-        };
-        if dev_fd < 0 {
-            // Send a message without an FD to the client to tell it about the error.
-            let mut msg = linux::msghdr {
-                msg_name: ptr::null_mut(),
-                msg_namelen: 0,
-                msg_iov: &iov as *const linux::iovec as *mut linux::iovec,
-                msg_iovlen: 1,
-                msg_control: ptr::null_mut(),
-                msg_controllen: 0,
-                msg_flags: 0,
-            };
-            let ret = unsafe { linux::sendmsg(i32::try_from(self.fd.0).unwrap(), &mut msg, 0) };
-            if ret < 0 {
-                writeln!(
-                    linux::Stderr,
-                    "failed to send error message to Wayland compositor: {ret}"
-                )
-                .unwrap();
-            }
-            return Ok(true);
+        let request = &buf[..n];
+        if n >= V2_HEADER_SIZE && request[0] == V2_MARKER && request[1] == V2 {
+            self.process_v2(request);
+        } else {
+            self.process_v1(request);
         }
-        let dev_fd = linux::Fd(u32::try_from(dev_fd).unwrap());
-        let mut rights = RightsCtrlMsg::new(i32::try_from(dev_fd.0).unwrap());
-        let mut msg = linux::msghdr {
-            msg_name: ptr::null_mut(),
-            msg_namelen: 0,
-            msg_iov: &iov as *const linux::iovec as *mut linux::iovec,
-            msg_iovlen: 1,
-            msg_control: &mut rights as *mut RightsCtrlMsg as *mut u8,
-            msg_controllen: mem::size_of_val(&rights),
-            msg_flags: 0,
+        Ok(true)
+    }
+
+    pub fn process_incoming(&mut self) -> Result<(), i32> {
+        while trace::span("seat request", || self.process_incoming_one())? {}
+        Ok(())
+    }
+
+    /// Sends a `Kind::Added` or `Kind::Removed` notification for the device at `path`, which must
+    /// be NUL-terminated.
+    fn notify(&self, kind: Kind, status: i32, path: &[u8], fd: Option<&Fd>) {
+        let mut msg = [0u8; V2_HEADER_SIZE + 4 + MAX_PATH_LEN];
+        msg[..V2_HEADER_SIZE].copy_from_slice(&[V2_MARKER, V2, kind as u8, 1]);
+        msg[V2_HEADER_SIZE..V2_HEADER_SIZE + 4].copy_from_slice(&status.to_ne_bytes());
+        let len = V2_HEADER_SIZE + 4 + path.len();
+        msg[V2_HEADER_SIZE + 4..len].copy_from_slice(path);
+        let ret = match fd {
+            Some(fd) => self.send(&msg[..len], &[i32::try_from(fd.0).unwrap()]),
+            None => self.send(&msg[..len], &[]),
         };
-        let ret = unsafe { linux::sendmsg(i32::try_from(self.fd.0).unwrap(), &mut msg, 0) };
         if ret < 0 {
             writeln!(
                 linux::Stderr,
-                "failed to send device FD to Wayland compositor: {ret}"
+                "failed to send device notification to Wayland compositor: {ret}"
             )
             .unwrap();
         }
-        Ok(true)
     }
 
-    pub fn process_incoming(&mut self) -> Result<(), i32> {
-        while self.process_incoming_one()? {}
-        Ok(())
+    fn handle_uevent(&mut self, event: &uevent::Uevent) {
+        let devname = match event.devname {
+            Some(d) => d,
+            None => return,
+        };
+        let wanted = match event.subsystem {
+            b"input" => devname.starts_with(b"input/event"),
+            b"drm" => true,
+            _ => false,
+        };
+        if !wanted {
+            return;
+        }
+        let mut path = [0u8; MAX_PATH_LEN];
+        let path = match join(&mut path, &[b"/dev/", devname]) {
+            Some(p) => p,
+            None => return,
+        };
+        self.enumeration.valid = false;
+
+        match event.action {
+            uevent::Action::Add => {
+                if !self.v2_client {
+                    return;
+                }
+                match unsafe { open_device(path.as_ptr()) } {
+                    Ok(fd) => self.notify(Kind::Added, 0, path, Some(&fd)),
+                    Err(err) => self.notify(Kind::Added, err, path, None),
+                }
+            }
+            uevent::Action::Remove => {
+                // A new device could get the same path later.
+                for slot in &mut self.preopened {
+                    if matches!(slot, Some(d) if &d.path[..d.path_len] == path) {
+                        *slot = None;
+                    }
+                }
+                if self.v2_client {
+                    self.notify(Kind::Removed, 0, path, None);
+                }
+            }
+        }
     }
 
-    pub fn fd(&self) -> u32 {
-        self.fd.0
+    /// Handles the pending uevents.
+    fn process_uevents(&mut self) -> Result<(), i32> {
+        // The socket is taken out of `self` while events are handled since they change `self`.
+        let uevents = match self.uevents.take() {
+            Some(u) => u,
+            None => return Ok(()),
+        };
+        let mut buf = [0u8; 4096];
+        let ret = loop {
+            match uevents.recv(&mut buf, |e| self.handle_uevent(e)) {
+                Ok(true) => (),
+                Ok(false) => break Ok(()),
+                Err(err) if err == -linux::ENOBUFS => {
+                    writeln!(linux::Stderr, "uevents were lost").unwrap();
+                    // The lost uevents might have added or removed devices.
+                    self.enumeration.valid = false;
+                }
+                Err(err) => break Err(err),
+            }
+        };
+        self.uevents = Some(uevents);
+        ret
+    }
+}
+
+impl Source for SeatServer {
+    fn register(&mut self, registrar: &Registrar) -> i32 {
+        if let Some(uevents) = &self.uevents {
+            let ret = registrar.add(uevents.fd(), linux::EPOLLIN, UEVENT_KEY);
+            if ret < 0 {
+                writeln!(linux::Stderr, "failed to watch uevent socket: {ret}").unwrap();
+                self.uevents = None;
+            }
+        }
+        registrar.add(self.fd.0, linux::EPOLLIN, SOCKET_KEY)
+    }
+
+    fn dispatch(&mut self, _registrar: &Registrar, key: u32, events: u32) -> Flow {
+        if key == UEVENT_KEY {
+            if let Err(err) = trace::span("uevents", || self.process_uevents()) {
+                writeln!(linux::Stderr, "failed to receive uevents: {err}").unwrap();
+            }
+            return Flow::Continue;
+        }
+
+        if events & linux::EPOLLERR != 0 {
+            writeln!(linux::Stderr, "epoll returned error on seat server socket").unwrap();
+            return Flow::Stop;
+        }
+        // `process_incoming` reads until there are no datagrams left, as required by the
+        // edge-triggered registration.
+        if let Err(err) = self.process_incoming() {
+            writeln!(
+                linux::Stderr,
+                "failed to process seat server request: {err}"
+            )
+            .unwrap();
+            return Flow::Stop;
+        }
+        Flow::Continue
     }
 }
@@ -0,0 +1,874 @@
+//! Supervision of the long-running processes listed in the `[[services]]` section of
+//! `config.toml`.
+//!
+//! Services are started with `exit_signal` set to 0, so the SIGCHLD reaper of the event loop never
+//! collects them: each one is watched through its pidfd, whose `epoll` key is the index of the
+//! service, and reaped with `waitid(P_PIDFD)`. Services that exit are restarted according to
+//! their policy, after a delay that doubles each time they fail without having run for a while.
+//! All pending restarts share a single timerfd that is armed for the earliest one.
+//!
+//! The `build.rs` script sorts the table so that services come after the ones they depend on. They
+//! are started in this order and stopped in the reverse order. A service is only started once the
+//! services listed in its `after` field are ready. Services with `notify` set are ready when they
+//! send `READY=1` to the datagram socket named by `NOTIFY_SOCKET` in their environment, like with
+//! `sd_notify`, and the other ones are ready as soon as they are started. The sender of each
+//! message is identified by the credentials that the kernel attaches to it, so only the main
+//! process of a service can notify for it.
+//!
+//! Services with `sockets` are started on demand instead: init creates their listening sockets
+//! before the user interface is started and watches them, with the index of the service plus
+//! `MAX_SERVICES` as the `epoll` key. The service is started when one of them becomes readable,
+//! and it inherits them from FD 3 with `LISTEN_FDS` and `LISTEN_PID` set, like with systemd. The
+//! sockets are not watched while the service runs or waits to be restarted.
+//! Clients can connect as soon as the sockets exist, so such a service is ready for the ones that
+//! depend on it from the start.
+
+use core::convert::{TryFrom, TryInto};
+use core::fmt::Write;
+use core::mem;
+use core::ptr;
+
+use crate::cgroup;
+use crate::config;
+use crate::linux::{self, Child, Fd};
+use crate::net::Ipv4Addr;
+use crate::reactor::{Flow, Registrar, Source};
+use crate::sched;
+use crate::trace;
+use crate::ui;
+
+/// Maximum number of services.
+const MAX_SERVICES: usize = 32;
+
+/// `epoll` key of the restart timer. Other keys are indices of services, for their pidfds, or
+/// indices plus `MAX_SERVICES`, for their sockets.
+const TIMER_KEY: u32 = u32::MAX;
+
+/// `epoll` key of the notification socket.
+const NOTIFY_KEY: u32 = u32::MAX - 1;
+
+/// Maximum size of a notification. Longer ones are truncated.
+const MAX_NOTIFICATION_LEN: usize = 4096;
+
+/// Maximum number of sockets of a service.
+const MAX_SOCKETS: usize = 8;
+
+/// FD of the first socket in a service that is started on demand. The other ones follow.
+const LISTEN_FDS_START: u32 = 3;
+
+/// Maximum number of environment variables of a service.
+const MAX_ENV: usize = 256;
+
+/// Length of the backlog of stream sockets.
+const LISTEN_BACKLOG: i32 = 128;
+
+/// Address that a socket listens on.
+pub enum Address {
+    /// NUL-terminated path of a Unix socket, and the permissions of the file.
+    Unix(&'static [u8], u32),
+    /// IPv4 address and port.
+    Inet(Ipv4Addr, u16),
+}
+
+/// A socket that starts a service when it is used, generated by the `build.rs` script.
+pub struct Socket {
+    /// `SOCK_STREAM` or `SOCK_DGRAM`.
+    pub sock_type: i32,
+    pub address: Address,
+}
+
+/// When a service should be restarted after it exits.
+#[derive(Copy, Clone, PartialEq, Eq)]
+pub enum Restart {
+    Never,
+    /// When it exits with a non-zero status or is killed by a signal.
+    OnFailure,
+    Always,
+}
+
+/// A user that a service runs as, resolved by the `build.rs` script.
+pub struct User {
+    pub uid: u32,
+    pub gid: u32,
+    pub groups: &'static [u32],
+    /// NUL-terminated home directory, which is the working directory of the service.
+    pub home: *const u8,
+}
+
+/// A service, generated by the `build.rs` script.
+pub struct Service {
+    pub name: &'static str,
+    /// NUL-terminated path of the program.
+    pub path: *const u8,
+    pub argv: *const *const u8,
+    pub envp: *const *const u8,
+    /// The service runs as root if there is no user.
+    pub user: Option<User>,
+    pub restart: Restart,
+    /// Delay before the first restart after a failure. It doubles for each failure in a row.
+    pub backoff_ms: u32,
+    pub max_backoff_ms: u32,
+    /// Whether the service is started after the late steps of the boot instead of before.
+    pub late: bool,
+    /// Whether the service is the user interface, which is given the seat and whose end stops the
+    /// system unless it is restarted.
+    pub ui: bool,
+    /// Whether the service tells when it is ready with `READY=1`.
+    pub notify: bool,
+    /// Indices of the services that must be ready before this one is started. They come before it
+    /// in the table.
+    pub after: &'static [usize],
+    /// Sockets that start the service when they are used. The service is not started at boot if
+    /// it has some.
+    pub sockets: &'static [Socket],
+    pub sched: sched::Policy,
+    /// Index of the cgroup of the service in `config::CGROUPS`, or `None` for the root cgroup.
+    pub cgroup: Option<usize>,
+}
+
+#[derive(Default)]
+struct State {
+    /// Whether the service must be running, which is the case from the time its phase of the boot
+    /// is reached until it stops for good.
+    wanted: bool,
+    child: Option<Child>,
+    /// Whether the running instance of the service is ready.
+    ready: bool,
+    started_ns: u64,
+    /// Time at which the service must be restarted, on the `CLOCK_MONOTONIC` clock.
+    restart_ns: Option<u64>,
+    /// Delay before the next restart.
+    backoff_ms: u32,
+    /// Listening sockets of a service that is started on demand. They are all there or none of
+    /// them is, in which case the service is started at boot.
+    sockets: [Option<Fd>; MAX_SOCKETS],
+}
+
+impl State {
+    fn listening(&self) -> bool {
+        self.sockets[0].is_some()
+    }
+}
+
+struct PreExecData {
+    service: *const Service,
+    sockets: [u32; MAX_SOCKETS],
+    socket_count: usize,
+    /// Where the new process writes its PID, in the value of the `LISTEN_PID` variable.
+    listen_pid: *mut u8,
+}
+
+/// Writes `n` in decimal, followed by a NUL byte, to the 11 bytes at `buf`.
+///
+/// # Safety
+///
+/// `buf` must be valid for writes of 11 bytes.
+unsafe fn write_decimal(buf: *mut u8, n: u32) {
+    let mut digits = [0u8; 10];
+    let mut start = digits.len();
+    let mut n = n;
+    loop {
+        start -= 1;
+        digits[start] = b'0' + (n % 10) as u8;
+        n /= 10;
+        if n == 0 {
+            break;
+        }
+    }
+    let len = digits.len() - start;
+    ptr::copy_nonoverlapping(digits[start..].as_ptr(), buf, len);
+    *buf.add(len) = 0;
+}
+
+/// Moves the sockets of a service to their FDs and sets up its scheduling policy and credentials,
+/// in the new process.
+fn service_pre_exec(data: usize) -> bool {
+    let data = unsafe { &*(data as *const PreExecData) };
+    // The sockets are all above the numbers that they are moved to, so they cannot be overwritten
+    // before they are moved. The new FDs do not have the `CLOEXEC` flag.
+    for (i, &fd) in data.sockets[..data.socket_count].iter().enumerate() {
+        let ret = linux::dup2(fd, LISTEN_FDS_START + u32::try_from(i).unwrap());
+        if ret < 0 {
+            writeln!(linux::Stderr, "failed to dup2 socket FD: {ret}").unwrap();
+            return false;
+        }
+    }
+    if data.socket_count > 0 {
+        // The parent is suspended until the program is executed, and the memory is shared.
+        let pid = u32::try_from(linux::getpid()).unwrap();
+        unsafe { write_decimal(data.listen_pid, pid) };
+    }
+    let service = unsafe { &*data.service };
+    // Real-time priorities and negative nice levels need the privileges of init.
+    service.sched.apply();
+    let user = match &service.user {
+        Some(u) => u,
+        None => return true,
+    };
+    let mut ret = linux::setgid(user.gid);
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to setgid: {ret}").unwrap();
+        return false;
+    }
+    ret = linux::setgroups(user.groups);
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to setgroups: {ret}").unwrap();
+        return false;
+    }
+    ret = linux::setuid(user.uid);
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to setuid: {ret}").unwrap();
+        return false;
+    }
+    ret = unsafe { linux::chdir(user.home) };
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to chdir: {ret}").unwrap();
+        return false;
+    }
+    true
+}
+
+/// Control message that carries the credentials of the sender of a datagram.
+#[repr(C)]
+struct CredentialsCtrlMsg {
+    hdr: linux::cmsghdr,
+    cred: linux::ucred,
+}
+
+/// Creates the socket that services send notifications to.
+fn bind_notify_socket() -> Result<Fd, i32> {
+    let fd = linux::socket(
+        linux::AF_UNIX,
+        linux::SOCK_DGRAM | linux::SOCK_CLOEXEC | linux::SOCK_NONBLOCK,
+        0,
+    );
+    if fd < 0 {
+        return Err(fd);
+    }
+    let fd = Fd(fd.try_into().unwrap());
+    let mut addr = linux::sockaddr_un {
+        sun_family: u16::try_from(linux::AF_UNIX).unwrap(),
+        sun_path: [0; 108],
+    };
+    addr.sun_path[..config::NOTIFY_SOCKET.len()].copy_from_slice(config::NOTIFY_SOCKET);
+    // A socket that is left from a previous instance cannot be bound again.
+    unsafe { linux::unlink(config::NOTIFY_SOCKET.as_ptr()) };
+    let mut ret = unsafe {
+        linux::bind(
+            fd.0,
+            &addr as *const linux::sockaddr_un as *const u8,
+            mem::size_of_val(&addr.sun_family) + config::NOTIFY_SOCKET.len(),
+        )
+    };
+    if ret < 0 {
+        return Err(ret);
+    }
+    // Services that do not run as root need to be able to write to the socket.
+    ret = unsafe { linux::chmod(config::NOTIFY_SOCKET.as_ptr(), 0o666) };
+    if ret < 0 {
+        return Err(ret);
+    }
+    ret = linux::setsockopt_int(fd.0, linux::SOL_SOCKET, linux::SO_PASSCRED, 1);
+    if ret < 0 {
+        return Err(ret);
+    }
+    Ok(fd)
+}
+
+/// Creates a listening socket. Its FD is above the ones that the sockets of a service are moved to
+/// when it is started.
+fn bind_socket(socket: &Socket) -> Result<Fd, i32> {
+    let family = match socket.address {
+        Address::Unix(..) => linux::AF_UNIX,
+        Address::Inet(..) => linux::AF_INET,
+    };
+    let fd = linux::socket(
+        family,
+        socket.sock_type | linux::SOCK_CLOEXEC | linux::SOCK_NONBLOCK,
+        0,
+    );
+    if fd < 0 {
+        return Err(fd);
+    }
+    let fd = Fd(fd.try_into().unwrap());
+    let min_fd = LISTEN_FDS_START + u32::try_from(MAX_SOCKETS).unwrap();
+    let fd = if fd.0 < min_fd {
+        let ret = linux::fcntl(fd.0, linux::F_DUPFD_CLOEXEC, min_fd.into());
+        Fd(u32::try_from(ret).map_err(|_| ret)?)
+    } else {
+        fd
+    };
+    let mut ret = match socket.address {
+        Address::Unix(path, mode) => {
+            let mut addr = linux::sockaddr_un {
+                sun_family: u16::try_from(linux::AF_UNIX).unwrap(),
+                sun_path: [0; 108],
+            };
+            addr.sun_path[..path.len()].copy_from_slice(path);
+            // A socket that is left from a previous instance cannot be bound again.
+            unsafe { linux::unlink(path.as_ptr()) };
+            let ret = unsafe {
+                linux::bind(
+                    fd.0,
+                    &addr as *const linux::sockaddr_un as *const u8,
+                    mem::size_of_val(&addr.sun_family) + path.len(),
+                )
+            };
+            if ret < 0 {
+                return Err(ret);
+            }
+            unsafe { linux::chmod(path.as_ptr(), mode) }
+        }
+        Address::Inet(ip, port) => {
+            let ret = linux::setsockopt_int(fd.0, linux::SOL_SOCKET, linux::SO_REUSEADDR, 1);
+            if ret < 0 {
+                return Err(ret);
+            }
+            let addr = linux::sockaddr_in {
+                sin_family: u16::try_from(linux::AF_INET).unwrap(),
+                sin_port: port.to_be(),
+                sin_addr: ip.to_be(),
+                sin_zero: [0; 8],
+            };
+            unsafe {
+                linux::bind(
+                    fd.0,
+                    &addr as *const linux::sockaddr_in as *const u8,
+                    mem::size_of_val(&addr),
+                )
+            }
+        }
+    };
+    if ret < 0 {
+        return Err(ret);
+    }
+    if socket.sock_type == linux::SOCK_STREAM {
+        ret = linux::listen(fd.0, LISTEN_BACKLOG);
+        if ret < 0 {
+            return Err(ret);
+        }
+    }
+    Ok(fd)
+}
+
+/// Collects the exit status of a service that exited. Returns whether it succeeded.
+fn reap(child: &Child, options: i32) -> Result<bool, i32> {
+    let mut info: linux::siginfo = unsafe { mem::zeroed() };
+    let ret = linux::waitid(
+        linux::P_PIDFD,
+        child.pidfd.0,
+        &mut info,
+        linux::WEXITED | linux::__WALL | options,
+    );
+    if ret < 0 {
+        return Err(ret);
+    }
+    Ok(info.si_code == linux::CLD_EXITED && info.si_status == 0)
+}
+
+/// Watches the services and restarts them when they exit.
+pub struct Supervisor<'a> {
+    services: &'static [Service],
+    states: [State; MAX_SERVICES],
+    timer: Fd,
+    /// Socket that services notify their readiness to, if one of them does.
+    notify: Option<Fd>,
+    seat: &'a ui::Seat,
+}
+
+impl<'a> Supervisor<'a> {
+    pub fn new(services: &'static [Service], seat: &'a ui::Seat) -> Result<Self, i32> {
+        if services.len() > MAX_SERVICES {
+            return Err(-linux::ENOMEM);
+        }
+        let timer = linux::timerfd_create(
+            linux::CLOCK_MONOTONIC,
+            linux::TFD_CLOEXEC | linux::TFD_NONBLOCK,
+        );
+        if timer < 0 {
+            return Err(timer);
+        }
+        let mut notify = None;
+        if services.iter().any(|s| s.notify) {
+            // Services that notify are considered ready when they start if there is no socket.
+            match bind_notify_socket() {
+                Ok(fd) => notify = Some(fd),
+                Err(err) => {
+                    writeln!(linux::Stderr, "failed to create notification socket: {err}").unwrap()
+                }
+            }
+        }
+        let mut supervisor = Self {
+            services,
+            states: Default::default(),
+            timer: Fd(timer.try_into().unwrap()),
+            notify,
+            seat,
+        };
+        for (service, state) in services.iter().zip(supervisor.states.iter_mut()) {
+            state.backoff_ms = service.backoff_ms;
+            if service.sockets.len() > MAX_SOCKETS {
+                writeln!(linux::Stderr, "too many sockets for {}", service.name).unwrap();
+                continue;
+            }
+            for (i, socket) in service.sockets.iter().enumerate() {
+                match bind_socket(socket) {
+                    Ok(fd) => state.sockets[i] = Some(fd),
+                    Err(err) => {
+                        writeln!(
+                            linux::Stderr,
+                            "failed to create socket for {}: {err}",
+                            service.name
+                        )
+                        .unwrap();
+                        // Start the service at boot instead.
+                        state.sockets = Default::default();
+                        break;
+                    }
+                }
+            }
+        }
+        Ok(supervisor)
+    }
+
+    fn spawn(&self, index: usize) -> Result<Child, i32> {
+        let service = &self.services[index];
+        if service.ui {
+            return self.seat.spawn(service);
+        }
+        let mut data = PreExecData {
+            service,
+            sockets: [0; MAX_SOCKETS],
+            socket_count: 0,
+            listen_pid: ptr::null_mut(),
+        };
+        for fd in self.states[index].sockets.iter().flatten() {
+            data.sockets[data.socket_count] = fd.0;
+            data.socket_count += 1;
+        }
+        let first_closed_fd = LISTEN_FDS_START + u32::try_from(data.socket_count).unwrap();
+
+        let executable = unsafe { linux::open_executable(service.path) }?;
+
+        let mut envp = [ptr::null::<u8>(); MAX_ENV];
+        let mut envc = 0;
+        unsafe {
+            while envc < MAX_ENV - 3 && !(*service.envp.add(envc)).is_null() {
+                envp[envc] = *service.envp.add(envc);
+                envc += 1;
+            }
+        }
+        let mut listen_fds = *b"LISTEN_FDS=0\0";
+        // Room for the largest PID, which the new process writes.
+        let mut listen_pid = *b"LISTEN_PID=\0\0\0\0\0\0\0\0\0\0\0";
+        if data.socket_count > 0 {
+            listen_fds[11] = b'0' + u8::try_from(data.socket_count).unwrap();
+            envp[envc] = listen_fds.as_ptr();
+            let listen_pid = listen_pid.as_mut_ptr();
+            envp[envc + 1] = listen_pid;
+            data.listen_pid = unsafe { listen_pid.add(11) };
+        }
+
+        let cgroup = cgroup::open_for(service);
+        let mut command = linux::Command::new(&executable, service.argv, envp.as_ptr());
+        command.cgroup = cgroup.as_ref().map(|fd| fd.0);
+        command.pre_exec = service_pre_exec;
+        command.pre_exec_data = &data as *const PreExecData as usize;
+        command.first_closed_fd = first_closed_fd;
+        command.exit_signal = 0;
+        unsafe { command.spawn() }
+    }
+
+    /// Starts a service. If it cannot be started, a restart is scheduled like if it had failed.
+    fn start(&mut self, index: usize, now: u64) {
+        let service = &self.services[index];
+        match self.spawn(index) {
+            Ok(child) => {
+                let ready = !service.notify || self.notify.is_none();
+                let state = &mut self.states[index];
+                state.child = Some(child);
+                state.ready = ready;
+                state.started_ns = now;
+                state.restart_ns = None;
+            }
+            Err(err) => {
+                writeln!(linux::Stderr, "failed to start {}: {err}", service.name).unwrap();
+                self.states[index].started_ns = now;
+                if !self.schedule_restart(index, false, now) {
+                    self.states[index].wanted = false;
+                }
+            }
+        }
+    }
+
+    /// Returns whether a service must be started now.
+    fn can_start(&self, index: usize, now: u64) -> bool {
+        let state = &self.states[index];
+        state.wanted
+            && state.child.is_none()
+            && state.restart_ns.is_none_or(|t| t <= now)
+            && self.services[index]
+                .after
+                .iter()
+                .all(|&dep| self.states[dep].ready || self.states[dep].listening())
+    }
+
+    /// Starts the services that are wanted and whose dependencies are ready, and watches them with
+    /// `registrar` if the event loop is already running. A single pass is enough since services
+    /// come after their dependencies in the table.
+    fn start_ready(&mut self, now: u64, registrar: Option<&Registrar>) {
+        for index in 0..self.services.len() {
+            if !self.can_start(index, now) {
+                continue;
+            }
+            self.start(index, now);
+            if let Some(registrar) = registrar {
+                self.watch(registrar, index);
+            }
+        }
+        self.arm_timer(now);
+    }
+
+    /// Starts the services that are started before the late steps of the boot, or after them if
+    /// `late` is true. Services that wait for a dependency to be ready are started from the event
+    /// loop, and the ones that listen on sockets when they are used.
+    pub fn start_all(&mut self, late: bool) {
+        let now = linux::clock_ns(linux::CLOCK_MONOTONIC);
+        for (service, state) in self.services.iter().zip(self.states.iter_mut()) {
+            if service.late == late && !state.listening() {
+                state.wanted = true;
+            }
+        }
+        self.start_ready(now, None);
+    }
+
+    /// Decides whether a service that stopped must be restarted, and when. Returns whether it will
+    /// be restarted.
+    fn schedule_restart(&mut self, index: usize, succeeded: bool, now: u64) -> bool {
+        let service = &self.services[index];
+        let state = &mut self.states[index];
+        let restart = match service.restart {
+            Restart::Never => false,
+            Restart::OnFailure => !succeeded,
+            Restart::Always => true,
+        };
+        if !restart {
+            return false;
+        }
+        // A service that ran for longer than the longest delay is not failing in a loop.
+        if now - state.started_ns > u64::from(service.max_backoff_ms) * 1_000_000 {
+            state.backoff_ms = service.backoff_ms;
+        }
+        state.restart_ns = Some(now + u64::from(state.backoff_ms) * 1_000_000);
+        writeln!(
+            linux::Stdout,
+            "restarting {} in {} ms",
+            service.name,
+            state.backoff_ms
+        )
+        .unwrap();
+        state.backoff_ms = state
+            .backoff_ms
+            .saturating_mul(2)
+            .min(service.max_backoff_ms);
+        true
+    }
+
+    /// Arms the timer for the earliest restart, or disarms it if there is none. Restarts that are
+    /// due already only wait for a dependency, so they do not need the timer.
+    fn arm_timer(&self, now: u64) {
+        let next = self
+            .states
+            .iter()
+            .filter_map(|s| s.restart_ns)
+            .filter(|&t| t > now)
+            .min();
+        let next = next.unwrap_or(0);
+        let value = linux::itimerspec {
+            it_interval: linux::timespec {
+                tv_sec: 0,
+                tv_nsec: 0,
+            },
+            it_value: linux::timespec {
+                tv_sec: i64::try_from(next / 1_000_000_000).unwrap(),
+                // A zero value disarms the timer, but `next` is never exactly zero otherwise.
+                tv_nsec: i64::try_from(next % 1_000_000_000).unwrap(),
+            },
+        };
+        let ret = linux::timerfd_settime(self.timer.0, linux::TFD_TIMER_ABSTIME, &value);
+        if ret < 0 {
+            writeln!(linux::Stderr, "failed to arm restart timer: {ret}").unwrap();
+        }
+    }
+
+    fn watch(&self, registrar: &Registrar, index: usize) {
+        if let Some(child) = &self.states[index].child {
+            let ret = registrar.add(child.pidfd.0, linux::EPOLLIN, u32::try_from(index).unwrap());
+            if ret < 0 {
+                writeln!(
+                    linux::Stderr,
+                    "failed to watch {}: {ret}",
+                    self.services[index].name
+                )
+                .unwrap();
+            }
+        }
+    }
+
+    fn handle_exit(&mut self, registrar: &Registrar, index: usize) -> Flow {
+        let service = &self.services[index];
+        // Closing the pidfd removes it from the event loop.
+        let child = match self.states[index].child.take() {
+            Some(c) => c,
+            None => return Flow::Continue,
+        };
+        let succeeded = match reap(&child, 0) {
+            Ok(s) => s,
+            Err(err) => {
+                writeln!(linux::Stderr, "failed to reap {}: {err}", service.name).unwrap();
+                false
+            }
+        };
+        writeln!(
+            linux::Stdout,
+            "{} ({}) {}",
+            service.name,
+            child.pid,
+            if succeeded { "exited" } else { "failed" }
+        )
+        .unwrap();
+        self.states[index].ready = false;
+        let now = linux::clock_ns(linux::CLOCK_MONOTONIC);
+        if self.schedule_restart(index, succeeded, now) {
+            self.arm_timer(now);
+        } else {
+            self.states[index].wanted = false;
+            if service.ui {
+                // Consider the system stopped when the user interface stops for good.
+                return Flow::Stop;
+            }
+            // Changing the events of a socket reports it again if a client came while the service
+            // was exiting, which starts the service again.
+            if self.states[index].listening() {
+                self.watch_sockets(registrar, index, linux::EPOLLIN);
+            }
+        }
+        Flow::Continue
+    }
+
+    /// Changes the events that are watched on the sockets of the service at `index`.
+    fn watch_sockets(&self, registrar: &Registrar, index: usize, events: u32) {
+        let key = u32::try_from(MAX_SERVICES + index).unwrap();
+        for fd in self.states[index].sockets.iter().flatten() {
+            let ret = registrar.modify(fd.0, events, key);
+            if ret < 0 {
+                writeln!(
+                    linux::Stderr,
+                    "failed to watch sockets of {}: {ret}",
+                    self.services[index].name
+                )
+                .unwrap();
+            }
+        }
+    }
+
+    /// Starts a service that listens on sockets because one of them is used, unless it is already
+    /// running or about to be restarted.
+    fn activate(&mut self, registrar: &Registrar, index: usize) {
+        if self.states[index].wanted {
+            return;
+        }
+        writeln!(linux::Stdout, "activating {}", self.services[index].name).unwrap();
+        self.states[index].wanted = true;
+        // The service accepts the clients itself while it runs, so the sockets would only wake up
+        // the event loop for nothing.
+        self.watch_sockets(registrar, index, 0);
+        let now = linux::clock_ns(linux::CLOCK_MONOTONIC);
+        self.start_ready(now, Some(registrar));
+    }
+
+    fn handle_timer(&mut self, registrar: &Registrar) {
+        let mut expirations = [0u8; 8];
+        linux::read(self.timer.0, &mut expirations);
+        let now = linux::clock_ns(linux::CLOCK_MONOTONIC);
+        self.start_ready(now, Some(registrar));
+    }
+
+    /// Handles the fields of a notification from the service at `index`. Returns whether the
+    /// service became ready.
+    fn handle_notification(&mut self, index: usize, message: &[u8]) -> bool {
+        let service = &self.services[index];
+        let state = &mut self.states[index];
+        let mut became_ready = false;
+        for field in message.split(|&b| b == b'\n') {
+            if field == b"READY=1" && !state.ready {
+                state.ready = true;
+                became_ready = true;
+                let now = linux::clock_ns(linux::CLOCK_MONOTONIC);
+                let latency_us = (now - state.started_ns) / 1000;
+                writeln!(
+                    linux::Stdout,
+                    "{} is ready after {} ms",
+                    service.name,
+                    latency_us / 1000
+                )
+                .unwrap();
+                trace::instant(service.name, i64::try_from(latency_us).unwrap());
+            } else if let Some(status) = field.strip_prefix(b"STATUS=") {
+                if let Ok(status) = core::str::from_utf8(status) {
+                    writeln!(linux::Stdout, "{}: {status}", service.name).unwrap();
+                }
+            }
+        }
+        became_ready
+    }
+
+    /// Reads the pending notifications, and starts the services that were waiting for the ones
+    /// that became ready.
+    fn handle_notify(&mut self, registrar: &Registrar) {
+        let fd = match &self.notify {
+            Some(fd) => i32::try_from(fd.0).unwrap(),
+            None => return,
+        };
+        let mut became_ready = false;
+        // Drain the socket because it is edge-triggered.
+        loop {
+            let mut buf = [0u8; MAX_NOTIFICATION_LEN];
+            let mut iov = linux::iovec {
+                iov_base: buf.as_mut_ptr(),
+                iov_len: buf.len(),
+            };
+            let mut creds: CredentialsCtrlMsg = unsafe { mem::zeroed() };
+            let mut msg = linux::msghdr {
+                msg_name: ptr::null_mut(),
+                msg_namelen: 0,
+                msg_iov: &mut iov,
+                msg_iovlen: 1,
+                msg_control: &mut creds as *mut CredentialsCtrlMsg as *mut u8,
+                msg_controllen: mem::size_of_val(&creds),
+                msg_flags: 0,
+            };
+            let n = unsafe { linux::recvmsg(fd, &mut msg, 0) };
+            let n = match usize::try_from(n) {
+                Ok(n) => n,
+                Err(_) => {
+                    if n != -isize::try_from(linux::EAGAIN).unwrap() {
+                        writeln!(linux::Stderr, "failed to receive notification: {n}").unwrap();
+                    }
+                    break;
+                }
+            };
+            if msg.msg_controllen < mem::size_of::<linux::cmsghdr>()
+                || creds.hdr.cmsg_level != linux::SOL_SOCKET
+                || creds.hdr.cmsg_type != linux::SCM_CREDENTIALS
+            {
+                continue;
+            }
+            let pid = creds.cred.pid;
+            let index = self
+                .states
+                .iter()
+                .position(|s| matches!(&s.child, Some(c) if c.pid == pid));
+            match index {
+                Some(index) => became_ready |= self.handle_notification(index, &buf[..n]),
+                None => {
+                    writeln!(linux::Stderr, "ignoring notification from process {pid}").unwrap()
+                }
+            }
+        }
+        if became_ready {
+            let now = linux::clock_ns(linux::CLOCK_MONOTONIC);
+            self.start_ready(now, Some(registrar));
+        }
+    }
+
+    /// Stops the services in the reverse order of the table, so that services are stopped before
+    /// the ones they depend on. Each service gets `timeout_ms` to exit after `SIGTERM` before it is
+    /// killed.
+    pub fn stop_all(&mut self, timeout_ms: u32) {
+        for index in (0..self.services.len()).rev() {
+            let service = &self.services[index];
+            let state = &mut self.states[index];
+            state.wanted = false;
+            state.restart_ns = None;
+            state.ready = false;
+            let child = match state.child.take() {
+                Some(c) => c,
+                None => continue,
+            };
+            let start = linux::clock_ns(linux::CLOCK_MONOTONIC);
+            let mut killed = false;
+            for signal in [linux::SIGTERM, linux::SIGKILL] {
+                let ret = linux::pidfd_send_signal(child.pidfd.0, signal);
+                if ret < 0 && ret != -linux::ESRCH {
+                    writeln!(linux::Stderr, "failed to signal {}: {ret}", service.name).unwrap();
+                }
+                let mut fds = [linux::pollfd {
+                    fd: i32::try_from(child.pidfd.0).unwrap(),
+                    events: linux::POLLIN,
+                    revents: 0,
+                }];
+                let ret = linux::poll(&mut fds, i32::try_from(timeout_ms).unwrap_or(i32::MAX));
+                if ret != 0 {
+                    break;
+                }
+                killed = true;
+            }
+            // A process that is stuck in the kernel is left to `shutdown::end_all_processes`.
+            if let Err(err) = reap(&child, linux::WNOHANG) {
+                writeln!(linux::Stderr, "failed to reap {}: {err}", service.name).unwrap();
+            }
+            let ms = (linux::clock_ns(linux::CLOCK_MONOTONIC) - start) / 1_000_000;
+            writeln!(
+                linux::Stdout,
+                "stopped {} in {ms} ms{}",
+                service.name,
+                if killed { " with SIGKILL" } else { "" }
+            )
+            .unwrap();
+        }
+    }
+}
+
+impl Source for Supervisor<'_> {
+    fn register(&mut self, registrar: &Registrar) -> i32 {
+        let ret = registrar.add(self.timer.0, linux::EPOLLIN, TIMER_KEY);
+        if ret < 0 {
+            return ret;
+        }
+        if let Some(fd) = &self.notify {
+            let ret = registrar.add(fd.0, linux::EPOLLIN, NOTIFY_KEY);
+            if ret < 0 {
+                return ret;
+            }
+        }
+        for index in 0..self.services.len() {
+            self.watch(registrar, index);
+            let key = u32::try_from(MAX_SERVICES + index).unwrap();
+            for fd in self.states[index].sockets.iter().flatten() {
+                let ret = registrar.add(fd.0, linux::EPOLLIN, key);
+                if ret < 0 {
+                    return ret;
+                }
+            }
+        }
+        0
+    }
+
+    fn dispatch(&mut self, registrar: &Registrar, key: u32, _events: u32) -> Flow {
+        if key == TIMER_KEY {
+            self.handle_timer(registrar);
+            return Flow::Continue;
+        }
+        if key == NOTIFY_KEY {
+            self.handle_notify(registrar);
+            return Flow::Continue;
+        }
+        let index = usize::try_from(key).unwrap();
+        if index >= MAX_SERVICES {
+            self.activate(registrar, index - MAX_SERVICES);
+            return Flow::Continue;
+        }
+        self.handle_exit(registrar, index)
+    }
+}
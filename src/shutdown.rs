@@ -1,16 +1,323 @@
 //! Powering off the system gracefully is not an easy task. This module provides
 //! routines to help.
+use core::convert::{TryFrom, TryInto};
 use core::fmt::Write;
 use core::ptr;
+use core::str;
+use core::sync::atomic::{AtomicU32, AtomicU64, Ordering};
 
-use crate::{linux, mounts};
+use crate::procfs::{meminfo_kb, parse_stat, read_proc_file, PF_KTHREAD};
+use crate::{config, exec, linux, mounts, trace};
+
+/// Maximum number of processes whose exit is tracked at shutdown. Other processes are still
+/// signaled, but the shutdown does not wait for them.
+const MAX_PROCESSES: usize = 1024;
+
+/// Processes that take longer than this to exit are listed in the shutdown log.
+const SLOW_EXIT_NS: u64 = 100_000_000;
+
+/// `epoll` key of the deadline timer. Other keys are indices in the process array.
+const TIMER_KEY: u64 = u64::MAX;
+
+/// A process that is waited for at shutdown.
+struct Process {
+    pid: i32,
+    pidfd: Option<linux::Fd>,
+    /// Command name, as found in `/proc/<pid>/stat`.
+    name: [u8; 16],
+    name_len: usize,
+    /// Time it took to exit, in nanoseconds since `SIGTERM` was sent.
+    exit_ns: Option<u64>,
+    killed: bool,
+}
+
+impl Process {
+    fn name(&self) -> &str {
+        core::str::from_utf8(&self.name[..self.name_len]).unwrap_or("?")
+    }
+}
+
+/// Opens a pidfd for each user space process other than init, and returns the number of processes
+/// that could not be tracked because there are too many of them.
+fn track_processes(processes: &mut [Option<Process>]) -> usize {
+    let proc_fd = unsafe {
+        linux::open(
+            b"/proc\0" as *const u8,
+            linux::O_RDONLY | linux::O_DIRECTORY | linux::O_CLOEXEC,
+            0,
+        )
+    };
+    if proc_fd < 0 {
+        writeln!(linux::Stderr, "failed to open /proc: {proc_fd}").unwrap();
+        return 0;
+    }
+    let proc_fd = linux::Fd(proc_fd.try_into().unwrap());
+
+    let mut count = 0;
+    let mut untracked = 0;
+    let ret = linux::read_dir(proc_fd.0, |name, _| {
+        let pid = match str::from_utf8(name)
+            .ok()
+            .and_then(|n| n.parse::<i32>().ok())
+        {
+            Some(pid) if pid > 1 => pid,
+            _ => return true,
+        };
+        let mut path = [0u8; 32];
+        path[..name.len()].copy_from_slice(name);
+        path[name.len()..name.len() + 6].copy_from_slice(b"/stat\0");
+        let fd = unsafe {
+            linux::openat(
+                i32::try_from(proc_fd.0).unwrap(),
+                path.as_ptr(),
+                linux::O_RDONLY | linux::O_CLOEXEC,
+                0,
+            )
+        };
+        if fd < 0 {
+            // The process exited in the meantime.
+            return true;
+        }
+        let fd = linux::Fd(fd.try_into().unwrap());
+        let mut stat = [0u8; 512];
+        let n = match usize::try_from(linux::read(fd.0, &mut stat)) {
+            Ok(n) => n,
+            Err(_) => return true,
+        };
+        let (comm, flags) = match parse_stat(&stat[..n]) {
+            Some(s) => s,
+            None => return true,
+        };
+        if flags & PF_KTHREAD != 0 {
+            // Kernel threads ignore signals and never exit.
+            return true;
+        }
+        if count == processes.len() {
+            untracked += 1;
+            return true;
+        }
+
+        let pidfd = linux::pidfd_open(pid, 0);
+        if pidfd < 0 {
+            if pidfd != -linux::ESRCH {
+                writeln!(linux::Stderr, "failed to open pidfd of {pid}: {pidfd}").unwrap();
+            }
+            return true;
+        }
+        let mut process = Process {
+            pid,
+            pidfd: Some(linux::Fd(pidfd.try_into().unwrap())),
+            name: [0; 16],
+            name_len: comm.len().min(16),
+            exit_ns: None,
+            killed: false,
+        };
+        process.name[..process.name_len].copy_from_slice(&comm[..process.name_len]);
+        processes[count] = Some(process);
+        count += 1;
+        true
+    });
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to list processes: {ret}").unwrap();
+    }
+    untracked
+}
+
+/// Collects the exit status of the children of init that have exited, whatever they are.
+fn reap_children() {
+    loop {
+        let ret = unsafe {
+            linux::wait4(
+                -1,
+                ptr::null_mut(),
+                linux::WNOHANG | linux::__WALL,
+                ptr::null_mut(),
+            )
+        };
+        if ret == -linux::EINTR {
+            continue;
+        } else if ret <= 0 {
+            break;
+        }
+    }
+}
+
+/// Arms `timer` to expire once after `timeout_ms`.
+fn arm_timer(timer: &linux::Fd, timeout_ms: u32) -> i32 {
+    let value = linux::itimerspec {
+        it_interval: linux::timespec {
+            tv_sec: 0,
+            tv_nsec: 0,
+        },
+        it_value: linux::timespec {
+            tv_sec: i64::from(timeout_ms / 1000),
+            // A zero value would disarm the timer.
+            tv_nsec: i64::from(timeout_ms % 1000) * 1_000_000 + 1,
+        },
+    };
+    linux::timerfd_settime(timer.0, 0, &value)
+}
+
+/// Sends `SIGKILL` to the processes that are still alive.
+fn kill_remaining(processes: &mut [Option<Process>]) {
+    for process in processes.iter_mut().flatten() {
+        if let Some(pidfd) = &process.pidfd {
+            let ret = linux::pidfd_send_signal(pidfd.0, linux::SIGKILL);
+            if ret < 0 && ret != -linux::ESRCH {
+                writeln!(linux::Stderr, "failed to kill {}: {ret}", process.pid).unwrap();
+            }
+            process.killed = true;
+        }
+    }
+    // Processes that were not tracked or that were created after they were listed.
+    let ret = linux::kill(-1, linux::SIGKILL);
+    if ret < 0 && ret != -linux::ESRCH {
+        writeln!(linux::Stderr, "failed to broadcast SIGKILL: {ret}").unwrap();
+    }
+}
+
+/// Waits for the tracked processes to exit, sending them `SIGKILL` if they are still alive after
+/// the `SIGTERM` deadline. Returns early if the `SIGKILL` deadline passes too.
+fn wait_for_processes(processes: &mut [Option<Process>], start: u64) -> i32 {
+    let epoll = linux::epoll_create1(linux::EPOLL_CLOEXEC);
+    if epoll < 0 {
+        return epoll;
+    }
+    let epoll = linux::Fd(epoll.try_into().unwrap());
+    let timer = linux::timerfd_create(linux::CLOCK_MONOTONIC, linux::TFD_CLOEXEC);
+    if timer < 0 {
+        return timer;
+    }
+    let timer = linux::Fd(timer.try_into().unwrap());
+    let event = linux::epoll_event {
+        events: linux::EPOLLIN,
+        data: TIMER_KEY,
+    };
+    let ret = linux::epoll_ctl(epoll.0, linux::EPOLL_CTL_ADD, timer.0, Some(&event));
+    if ret < 0 {
+        return ret;
+    }
+
+    let mut alive = 0;
+    for (i, process) in processes.iter().enumerate() {
+        if let Some(Process {
+            pidfd: Some(pidfd), ..
+        }) = process
+        {
+            let event = linux::epoll_event {
+                events: linux::EPOLLIN,
+                data: u64::try_from(i).unwrap(),
+            };
+            let ret = linux::epoll_ctl(epoll.0, linux::EPOLL_CTL_ADD, pidfd.0, Some(&event));
+            if ret < 0 {
+                return ret;
+            }
+            alive += 1;
+        }
+    }
+
+    let ret = arm_timer(&timer, config::SHUTDOWN_TERM_TIMEOUT_MS);
+    if ret < 0 {
+        return ret;
+    }
+    let mut killed = false;
+    let mut events = [linux::epoll_event { events: 0, data: 0 }; 16];
+    while alive > 0 {
+        let ret = linux::epoll_wait(epoll.0, &mut events, -1);
+        if ret == -linux::EINTR {
+            continue;
+        } else if ret < 0 {
+            return ret;
+        }
+        let now = linux::clock_ns(linux::CLOCK_MONOTONIC);
+        reap_children();
+
+        for event in &events[..usize::try_from(ret).unwrap()] {
+            let key = event.data;
+            if key != TIMER_KEY {
+                let process = processes[usize::try_from(key).unwrap()].as_mut().unwrap();
+                // Closing the pidfd also removes it from the epoll set.
+                if process.pidfd.take().is_some() {
+                    process.exit_ns = Some(now - start);
+                    alive -= 1;
+                }
+            } else if !killed {
+                writeln!(
+                    linux::Stdout,
+                    "{alive} processes did not exit after SIGTERM, killing them"
+                )
+                .unwrap();
+                kill_remaining(processes);
+                killed = true;
+                let ret = arm_timer(&timer, config::SHUTDOWN_KILL_TIMEOUT_MS);
+                if ret < 0 {
+                    return ret;
+                }
+            } else {
+                writeln!(linux::Stderr, "{alive} processes did not die after SIGKILL").unwrap();
+                return 0;
+            }
+        }
+    }
+    0
+}
+
+/// Prints the processes that were slow to exit and the ones that did not exit.
+fn report(processes: &[Option<Process>]) {
+    let mut tracked = 0;
+    let mut killed = 0;
+    for process in processes.iter().flatten() {
+        tracked += 1;
+        let name = process.name();
+        let pid = process.pid;
+        let signal = if process.killed { "SIGKILL" } else { "SIGTERM" };
+        match process.exit_ns {
+            Some(ns) if process.killed || ns >= SLOW_EXIT_NS => {
+                let ms = ns / 1_000_000;
+                writeln!(
+                    linux::Stdout,
+                    "{name} ({pid}) took {ms} ms to exit after {signal}"
+                )
+                .unwrap();
+            }
+            Some(_) => {}
+            None => writeln!(linux::Stdout, "{name} ({pid}) did not exit").unwrap(),
+        }
+        if process.killed {
+            killed += 1;
+        }
+    }
+    writeln!(
+        linux::Stdout,
+        "{tracked} processes stopped, {killed} of which were killed"
+    )
+    .unwrap();
+    trace::counter("processes killed", killed);
+}
 
 /// Tell processes to exit and wait for them to do so.
 ///
+/// Processes are sent `SIGTERM` and are tracked with pidfds, which need Linux 5.3. The ones that
+/// are still alive after `config::SHUTDOWN_TERM_TIMEOUT_MS` are sent `SIGKILL`, and the shutdown
+/// goes on after `config::SHUTDOWN_KILL_TIMEOUT_MS` even if some of them are still there.
+///
 /// Errors are ignored unlike most other functions. This is because there can
 /// be multiple non critical errors that happen and will still want to
 /// continue.
 pub fn end_all_processes() {
+    // The processes are listed before they are signaled, so that a PID that is reused after a
+    // process exits is not mistaken for it.
+    let mut processes = [const { None::<Process> }; MAX_PROCESSES];
+    let untracked = track_processes(&mut processes);
+    if untracked > 0 {
+        writeln!(
+            linux::Stderr,
+            "too many processes, {untracked} will not be waited for"
+        )
+        .unwrap();
+    }
+
+    let start = linux::clock_ns(linux::CLOCK_MONOTONIC);
     // A pid of -1 is used to broadcast the SIGTERM signal to all processes.
     let ret = linux::kill(-1, linux::SIGTERM);
     if ret < 0 {
@@ -22,63 +329,367 @@ pub fn end_all_processes() {
         return;
     }
 
-    loop {
-        // `wait4` will collect the exit status of any process.
-        let ret = unsafe { linux::wait4(-1, ptr::null_mut(), 0, ptr::null_mut()) };
-        if ret == -linux::ECHILD {
-            // There are no processes left.
-            break;
-        } else if ret == -linux::EINTR {
-            // The function was interrupted by a signal.
-            continue;
-        } else if ret < 0 {
-            writeln!(linux::Stderr, "failed to kill processes: {ret}").unwrap();
-            // This should not happen. If it does, then we better break now
-            // because if we don't we might be stuck in the loop with the
-            // same error over and over again.
-            break;
+    let ret = wait_for_processes(&mut processes, start);
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to wait for processes: {ret}").unwrap();
+        kill_remaining(&mut processes);
+    }
+    reap_children();
+    report(&processes);
+}
+
+/// Maximum number of filesystems that are synced in parallel.
+const MAX_FILESYSTEMS: usize = 64;
+
+/// Interval between two reports of the writeback progress.
+const SYNC_PROGRESS_NS: i64 = 250_000_000;
+
+/// Returns whether filesystems of type `fs_type` store their data on a block device, according
+/// to the content of `/proc/filesystems`, where the other types are marked with `nodev`.
+fn requires_device(filesystems: &[u8], fs_type: &[u8]) -> bool {
+    filesystems.split(|&b| b == b'\n').any(|line| {
+        let mut fields = line.split(|&b| b == b'\t');
+        fields.next() == Some(b"") && fields.next() == Some(fs_type)
+    })
+}
+
+/// The filesystems to sync, as a graph for `exec::run` without dependencies so that each
+/// filesystem is synced by its own worker thread. The last step reports the amount of data that
+/// is left to write until the other steps are finished.
+struct Syncs<'a> {
+    table: &'a mounts::MountTable,
+    /// Index in `table` of a mount of each filesystem.
+    mounts: [usize; MAX_FILESYSTEMS],
+    count: usize,
+    /// Number of filesystems that are not synced yet. The progress step sleeps on this futex.
+    remaining: AtomicU32,
+    /// Time that each filesystem took to sync, in nanoseconds.
+    durations: [AtomicU64; MAX_FILESYSTEMS],
+}
+
+impl<'a> Syncs<'a> {
+    fn new(table: &'a mounts::MountTable, filesystems: &[u8]) -> Self {
+        let mut syncs = Self {
+            table,
+            mounts: [0; MAX_FILESYSTEMS],
+            count: 0,
+            remaining: AtomicU32::new(0),
+            durations: [const { AtomicU64::new(0) }; MAX_FILESYSTEMS],
+        };
+        for (i, mount) in table.iter().enumerate() {
+            if !requires_device(filesystems, mount.fs_type()) {
+                continue;
+            }
+            // Bind mounts and subvolumes share the filesystem of another mount. A mount whose
+            // device number is unknown is always synced.
+            let seen = mount.dev != (0, 0)
+                && syncs.mounts[..syncs.count]
+                    .iter()
+                    .any(|&m| table.get(m).dev == mount.dev);
+            if seen {
+                continue;
+            }
+            if syncs.count == MAX_FILESYSTEMS {
+                writeln!(
+                    linux::Stderr,
+                    "more than {MAX_FILESYSTEMS} filesystems, the others are left to the final sync"
+                )
+                .unwrap();
+                break;
+            }
+            syncs.mounts[syncs.count] = i;
+            syncs.count += 1;
+        }
+        syncs.remaining = AtomicU32::new(u32::try_from(syncs.count).unwrap());
+        syncs
+    }
+
+    fn sync(&self, step: usize) -> i32 {
+        let path = self.table.get(self.mounts[step]).c_path();
+        let fd = unsafe { linux::open(path.as_ptr(), linux::O_RDONLY | linux::O_CLOEXEC, 0) };
+        if fd < 0 {
+            return fd;
+        }
+        let fd = linux::Fd(fd.try_into().unwrap());
+        linux::syncfs(fd.0)
+    }
+
+    /// Prints the amount of data that is left to write until all the filesystems are synced.
+    fn report_progress(&self) {
+        let timeout = linux::timespec {
+            tv_sec: 0,
+            tv_nsec: SYNC_PROGRESS_NS,
+        };
+        let mut buf = [0u8; 4096];
+        loop {
+            let remaining = self.remaining.load(Ordering::Acquire);
+            if remaining == 0 {
+                break;
+            }
+            let ret = linux::futex_wait_timeout(
+                &self.remaining,
+                remaining,
+                linux::FUTEX_PRIVATE_FLAG,
+                &timeout,
+            );
+            if ret != -linux::ETIMEDOUT {
+                continue;
+            }
+            let meminfo = match read_proc_file(b"/proc/meminfo\0", &mut buf) {
+                Ok(m) => m,
+                Err(_) => continue,
+            };
+            let dirty = meminfo_kb(meminfo, b"Dirty").unwrap_or(0);
+            let writeback = meminfo_kb(meminfo, b"Writeback").unwrap_or(0);
+            writeln!(
+                linux::Stdout,
+                "syncing {remaining} filesystems: {dirty} kB dirty, {writeback} kB under writeback"
+            )
+            .unwrap();
+            trace::counter("dirty kB", i64::try_from(dirty).unwrap_or(i64::MAX));
         }
     }
 }
 
-/// Unmounts all filesystems known to the init process.
+impl exec::Graph for Syncs<'_> {
+    fn step_count(&self) -> usize {
+        // The progress step is the last one, so that it never takes the worker that a filesystem
+        // needs when there are few of them.
+        self.count + 1
+    }
+
+    fn prerequisites(&self, _step: usize) -> usize {
+        0
+    }
+
+    fn successors(&self, _step: usize) -> &[usize] {
+        &[]
+    }
+
+    fn run(&self, step: usize) -> i32 {
+        if step == self.count {
+            self.report_progress();
+            return 0;
+        }
+        let start = linux::clock_ns(linux::CLOCK_MONOTONIC);
+        let ret = self.sync(step);
+        self.durations[step].store(
+            linux::clock_ns(linux::CLOCK_MONOTONIC) - start,
+            Ordering::Relaxed,
+        );
+        self.remaining.fetch_sub(1, Ordering::AcqRel);
+        linux::futex_wake(&self.remaining, 1, linux::FUTEX_PRIVATE_FLAG);
+        ret
+    }
+
+    fn finished(&self, step: usize, ret: i32) {
+        if step == self.count {
+            return;
+        }
+        let mount = self.table.get(self.mounts[step]);
+        let path = str::from_utf8(mount.path()).unwrap_or("?");
+        let fs_type = str::from_utf8(mount.fs_type()).unwrap_or("?");
+        let ms = self.durations[step].load(Ordering::Relaxed) / 1_000_000;
+        if ret < 0 {
+            writeln!(
+                linux::Stderr,
+                "failed to sync {path} ({fs_type}) in {ms} ms: {ret}"
+            )
+            .unwrap();
+        } else {
+            writeln!(linux::Stdout, "synced {path} ({fs_type}) in {ms} ms").unwrap();
+        }
+    }
+}
+
+/// Reports the mounts that did not fit in `table`, which are left out of the parallel work.
+fn report_dropped(table: &mounts::MountTable) {
+    let dropped = table.dropped();
+    if dropped > 0 {
+        writeln!(
+            linux::Stderr,
+            "{dropped} mounts did not fit in the table and are left out"
+        )
+        .unwrap();
+    }
+}
+
+/// Writes the data of every filesystem that is backed by a block device to disk, syncing the
+/// filesystems in parallel instead of one after the other like `linux::sync` does, and reports
+/// the progress of the writeback while it happens.
 ///
-/// Errors are printed to stderr unlike most other functions. This is because
-/// there can be multiple non critical errors that happen and will still want
-/// to continue.
-pub fn unmount_all() {
-    let mut mounts = [0u8; 256];
-    let n = mounts::read_mounts(&mut mounts);
-    if n < 0 {
-        writeln!(linux::Stderr, "failed to read mounts: {n}").unwrap();
+/// `linux::sync` is called afterwards anyway, which is quick once the block device filesystems are
+/// synced: it takes care of the filesystems that have no block device, like NFS, CIFS and FUSE,
+/// and of the ones beyond `MAX_FILESYSTEMS`.
+///
+/// Errors are printed to stderr unlike most other functions, and only `linux::sync` is used if the
+/// filesystems cannot be listed.
+pub fn sync_filesystems() {
+    let mut table = mounts::MountTable::new();
+    let ret = table.read();
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to read mounts: {ret}").unwrap();
+        linux::sync();
         return;
     }
+    report_dropped(&table);
+    let mut buf = [0u8; 4096];
+    let filesystems = match read_proc_file(b"/proc/filesystems\0", &mut buf) {
+        Ok(f) => f,
+        Err(err) => {
+            writeln!(linux::Stderr, "failed to read /proc/filesystems: {err}").unwrap();
+            linux::sync();
+            return;
+        }
+    };
+    exec::run(&Syncs::new(&table, filesystems));
+    linux::sync();
+}
 
-    // We cannot unmount a tree in which there is another mount (for instance,
-    // we cannot unmount /dev before /dev/pts). As the mounts file is ordered
-    // by mount order, we have to iterate it in reverse order.
-    let mut end = n as usize;
-    while end >= 2 {
-        // Find string start.
-        let mut start = end - 2;
-        loop {
-            if mounts[start] == b'\0' {
-                start += 1;
-                break;
-            } else if start == 0 {
-                break;
+/// How a mount was taken care of, as returned by `Unmounts::run`.
+const UNMOUNTED: i32 = 0;
+/// The mount was busy and was remounted read-only. It is still mounted.
+const REMOUNTED: i32 = 1;
+/// The mount was busy, was remounted read-only and was then detached.
+const DETACHED: i32 = 2;
+/// The mount was busy, could not be remounted read-only and was detached.
+const DETACHED_READ_WRITE: i32 = 3;
+
+/// The mount tree, as a graph for `exec::run` where each mount is unmounted after the mounts on
+/// top of it, and independent subtrees are unmounted at the same time. A filesystem that takes a
+/// long time to flush its data only delays the mounts below it.
+struct Unmounts<'a> {
+    table: &'a mounts::MountTable,
+    /// Index of the parent of each mount in `table`. Only valid if `has_parent` is true.
+    parents: [usize; mounts::MAX_MOUNTS],
+    has_parent: [bool; mounts::MAX_MOUNTS],
+    /// Number of mounts on top of each mount.
+    children: [usize; mounts::MAX_MOUNTS],
+    /// Time that each mount took, in nanoseconds.
+    durations: [AtomicU64; mounts::MAX_MOUNTS],
+}
+
+impl<'a> Unmounts<'a> {
+    fn new(table: &'a mounts::MountTable) -> Self {
+        let mut unmounts = Self {
+            table,
+            parents: [0; mounts::MAX_MOUNTS],
+            has_parent: [false; mounts::MAX_MOUNTS],
+            children: [0; mounts::MAX_MOUNTS],
+            durations: [const { AtomicU64::new(0) }; mounts::MAX_MOUNTS],
+        };
+        for (i, mount) in table.iter().enumerate() {
+            // Mounts are in mount order, so the parent is usually just before.
+            let parent = (0..i)
+                .rev()
+                .chain(i + 1..table.len())
+                .find(|&p| table.get(p).id == mount.parent_id);
+            if let Some(p) = parent {
+                unmounts.parents[i] = p;
+                unmounts.has_parent[i] = true;
+                unmounts.children[p] += 1;
             }
-            start -= 1;
+        }
+        unmounts
+    }
+
+    fn unmount(&self, step: usize) -> i32 {
+        let path = self.table.get(step).c_path().as_ptr();
+        let ret = unsafe { linux::umount(path, 0) };
+        if ret != -linux::EBUSY {
+            return ret;
         }
 
-        let m = &mounts[start..end];
-        let ret = unsafe { linux::umount(m.as_ptr(), 0) };
-        if ret < -1 {
-            writeln!(linux::Stderr, "failed unmount FS: {ret}").unwrap();
+        // Something still uses the filesystem. Remounting it read-only makes sure that its data
+        // is written, and detaching it lets the mount below it be unmounted.
+        let remount = unsafe {
+            linux::mount(
+                ptr::null(),
+                path,
+                ptr::null(),
+                linux::MS_REMOUNT | linux::MS_RDONLY,
+                ptr::null(),
+            )
+        };
+        if !self.has_parent[step] {
+            // The root of the mount namespace cannot be detached.
+            return if remount < 0 { remount } else { REMOUNTED };
         }
+        let ret = unsafe { linux::umount(path, linux::MNT_DETACH) };
+        if ret < 0 {
+            ret
+        } else if remount < 0 {
+            DETACHED_READ_WRITE
+        } else {
+            DETACHED
+        }
+    }
+}
+
+impl exec::Graph for Unmounts<'_> {
+    fn step_count(&self) -> usize {
+        self.table.len()
+    }
 
-        end = start;
+    fn prerequisites(&self, step: usize) -> usize {
+        self.children[step]
     }
+
+    fn successors(&self, step: usize) -> &[usize] {
+        &self.parents[step..step + usize::from(self.has_parent[step])]
+    }
+
+    fn run(&self, step: usize) -> i32 {
+        let start = linux::clock_ns(linux::CLOCK_MONOTONIC);
+        let ret = self.unmount(step);
+        self.durations[step].store(
+            linux::clock_ns(linux::CLOCK_MONOTONIC) - start,
+            Ordering::Relaxed,
+        );
+        ret
+    }
+
+    fn finished(&self, step: usize, ret: i32) {
+        let mount = self.table.get(step);
+        let path = core::str::from_utf8(mount.path()).unwrap_or("?");
+        let fs_type = core::str::from_utf8(mount.fs_type()).unwrap_or("?");
+        let us = self.durations[step].load(Ordering::Relaxed) / 1000;
+        let what = match ret {
+            UNMOUNTED => "unmounted",
+            REMOUNTED => "remounted read-only",
+            DETACHED => "remounted read-only and detached",
+            DETACHED_READ_WRITE => "detached without remounting read-only",
+            _ => {
+                writeln!(
+                    linux::Stderr,
+                    "failed to unmount {path} ({fs_type}) in {us} us: {ret}"
+                )
+                .unwrap();
+                return;
+            }
+        };
+        writeln!(linux::Stdout, "{what} {path} ({fs_type}) in {us} us").unwrap();
+    }
+}
+
+/// Unmounts all filesystems known to the init process.
+///
+/// Errors are printed to stderr unlike most other functions. This is because
+/// there can be multiple non critical errors that happen and will still want
+/// to continue.
+pub fn unmount_all() {
+    let mut table = mounts::MountTable::new();
+    let ret = table.read();
+    if ret < 0 {
+        writeln!(linux::Stderr, "failed to read mounts: {ret}").unwrap();
+        return;
+    }
+    report_dropped(&table);
+
+    // We cannot unmount a tree in which there is another mount (for instance,
+    // we cannot unmount /dev before /dev/pts), so each mount waits for the
+    // mounts on top of it.
+    exec::run(&Unmounts::new(&table));
 }
 
 /// Actually powers off the system.
@@ -1,82 +1,328 @@
 //! `sysctl` options and code to apply them. Sysctl is Linux specific and
 //! information about it can be found on the net.
-use crate::linux;
-use core::convert::TryInto;
+//!
+//! The options come from the `[sysctl]` section of `config.toml`, and the `build.rs` script groups
+//! them by directory so that each directory is opened once and the options are opened relative to
+//! it, instead of walking `/proc/sys` again for every option. The current value of each option is
+//! read first and the option is only written if its value is different.
+use crate::config;
+use crate::linux::{self, Fd};
+use crate::trace;
+use core::convert::{TryFrom, TryInto};
 use core::fmt::Write;
 
-/// Opens the file at the given `path` and writes the given `content` to it.
-///
-/// `write` is used instead of `write_all` so this should only be used for
-/// special files like sysfs configuration files.
-///
-/// Errors are printed to stderr unlike most other functions. This is because
-/// there can be multiple non critical errors that happen and will still want
-/// to continue.
-unsafe fn open_and_write(path: *const u8, content: &[u8]) {
-    let fd = linux::open(path, linux::O_WRONLY, 0);
-    if fd < 0 {
-        writeln!(linux::Stderr, "failed to open sysctl file: {fd}").unwrap();
-        return;
+/// A directory of sysctl options, generated by the `build.rs` script.
+pub struct SysctlDir {
+    /// NUL-terminated path of the directory.
+    pub path: &'static [u8],
+    /// Options in this directory, as pairs of a NUL-terminated file name and a value.
+    pub options: &'static [(&'static [u8], &'static [u8])],
+}
+
+/// Maximum size of a value that is read to be compared. Options with longer values are always
+/// written.
+const MAX_VALUE_LEN: usize = 128;
+
+/// Maximum number of directories when io_uring is used.
+const MAX_DIRS: usize = 64;
+
+/// Number of options that are handled with a single submission to the io_uring. Each option takes
+/// two entries: open and read, and then write and close.
+const URING_BATCH: usize = 42;
+
+/// Tag of an io_uring operation in the `user_data` of its entry, next to the index of the option in
+/// its batch.
+const OP_OPEN: u64 = 0;
+const OP_READ: u64 = 1;
+const OP_WRITE: u64 = 2;
+const OP_CLOSE: u64 = 3;
+
+/// What happened while options were applied.
+#[derive(Default)]
+struct Report {
+    options: usize,
+    /// Number of options that already had the right value.
+    unchanged: usize,
+    syscalls: u32,
+}
+
+fn fields(value: &[u8]) -> impl Iterator<Item = &[u8]> {
+    value
+        .split(|b| b.is_ascii_whitespace())
+        .filter(|f| !f.is_empty())
+}
+
+/// Returns whether `current`, as read from an option file, is the same value as `wanted`. Options
+/// with several fields separate them with tabs when they are read, but any whitespace can be used
+/// when they are written.
+fn same_value(current: &[u8], wanted: &[u8]) -> bool {
+    fields(current).eq(fields(wanted))
+}
+
+/// Applies the options with regular system calls.
+fn apply_with_syscalls(report: &mut Report) {
+    for dir in config::SYSCTL {
+        report.syscalls += 1;
+        let dir_fd = unsafe {
+            linux::open(
+                dir.path.as_ptr(),
+                linux::O_RDONLY | linux::O_DIRECTORY | linux::O_CLOEXEC,
+                0,
+            )
+        };
+        if dir_fd < 0 {
+            writeln!(linux::Stderr, "failed to open sysctl directory: {dir_fd}").unwrap();
+            continue;
+        }
+        let dir_fd = Fd(dir_fd.try_into().unwrap());
+        // Closing the directory.
+        report.syscalls += 1;
+
+        for (name, value) in dir.options {
+            report.options += 1;
+            report.syscalls += 1;
+            let fd = unsafe {
+                linux::openat(
+                    i32::try_from(dir_fd.0).unwrap(),
+                    name.as_ptr(),
+                    linux::O_RDWR | linux::O_CLOEXEC,
+                    0,
+                )
+            };
+            if fd < 0 {
+                writeln!(linux::Stderr, "failed to open sysctl file: {fd}").unwrap();
+                continue;
+            }
+            let fd = Fd(fd.try_into().unwrap());
+            // Reading and closing the file.
+            report.syscalls += 2;
+            let mut current = [0u8; MAX_VALUE_LEN];
+            let n = linux::read(fd.0, &mut current);
+            if let Ok(n) = usize::try_from(n) {
+                if n < current.len() && same_value(&current[..n], value) {
+                    report.unchanged += 1;
+                    continue;
+                }
+            }
+            report.syscalls += 1;
+            // The file offset moved because of the read, and sysctl files ignore writes that are
+            // not at the start of the file.
+            let ret = linux::pwrite64(fd.0, value, 0);
+            if ret < 0 {
+                writeln!(linux::Stderr, "failed to write to sysctl file: {ret}").unwrap();
+            }
+        }
     }
-    let fd = linux::Fd(fd.try_into().unwrap());
-    let ret = linux::write(fd.0, content);
+}
+
+/// Submits the queued entries and calls `f` with each of the `expected` completions.
+fn complete<F: FnMut(linux::io_uring_cqe)>(ring: &mut linux::IoUring, expected: u32, mut f: F) {
+    let ret = ring.submit_and_wait(expected);
     if ret < 0 {
-        writeln!(linux::Stderr, "failed to write to sysctl file: {ret}").unwrap();
+        writeln!(linux::Stderr, "failed to submit sysctl operations: {ret}").unwrap();
+    }
+    let mut done = 0;
+    while done < expected {
+        let cqe = match ring.pop() {
+            Some(c) => c,
+            None => {
+                if ring.submit_and_wait(expected - done) < 0 {
+                    break;
+                }
+                continue;
+            }
+        };
+        done += 1;
+        f(cqe);
     }
 }
 
+/// Applies a batch of options, given as a directory FD, a file name and a value.
+fn apply_batch(ring: &mut linux::IoUring, batch: &[(i32, &[u8], &[u8])], report: &mut Report) {
+    let mut values = [[0u8; MAX_VALUE_LEN]; URING_BATCH];
+    for (slot, ((dir_fd, name, _), value)) in batch.iter().zip(values.iter_mut()).enumerate() {
+        let index = u64::try_from(slot).unwrap();
+        let slot = u32::try_from(slot).unwrap();
+        let open = linux::io_uring_sqe {
+            opcode: linux::IORING_OP_OPENAT,
+            flags: linux::IOSQE_IO_LINK,
+            fd: *dir_fd,
+            addr: name.as_ptr() as u64,
+            op_flags: linux::O_RDWR | linux::O_CLOEXEC,
+            file_index: slot + 1,
+            user_data: index << 2 | OP_OPEN,
+            ..Default::default()
+        };
+        let read = linux::io_uring_sqe {
+            opcode: linux::IORING_OP_READ,
+            flags: linux::IOSQE_FIXED_FILE,
+            fd: i32::try_from(slot).unwrap(),
+            addr: value.as_mut_ptr() as u64,
+            len: u32::try_from(value.len()).unwrap(),
+            user_data: index << 2 | OP_READ,
+            ..Default::default()
+        };
+        // There is always room because the ring is sized for a whole batch.
+        assert!(ring.push(open) && ring.push(read));
+    }
+
+    let mut opened = [false; URING_BATCH];
+    let mut read_len = [None; URING_BATCH];
+    complete(ring, u32::try_from(batch.len() * 2).unwrap(), |cqe| {
+        let slot = usize::try_from(cqe.user_data >> 2).unwrap();
+        let res = cqe.res;
+        match cqe.user_data & 3 {
+            OP_OPEN if res < 0 => {
+                writeln!(linux::Stderr, "failed to open sysctl file: {res}").unwrap()
+            }
+            OP_OPEN => opened[slot] = true,
+            OP_READ => read_len[slot] = usize::try_from(res).ok(),
+            _ => {}
+        }
+    });
+
+    let mut expected = 0;
+    for (slot, (_, _, wanted)) in batch.iter().enumerate() {
+        if !opened[slot] {
+            continue;
+        }
+        let index = u64::try_from(slot).unwrap();
+        let slot_u32 = u32::try_from(slot).unwrap();
+        let unchanged = match read_len[slot] {
+            Some(n) => n < MAX_VALUE_LEN && same_value(&values[slot][..n], wanted),
+            None => false,
+        };
+        if unchanged {
+            report.unchanged += 1;
+        } else {
+            let write = linux::io_uring_sqe {
+                opcode: linux::IORING_OP_WRITE,
+                // The file must be closed even if the write fails.
+                flags: linux::IOSQE_IO_HARDLINK | linux::IOSQE_FIXED_FILE,
+                fd: i32::try_from(slot).unwrap(),
+                addr: wanted.as_ptr() as u64,
+                len: u32::try_from(wanted.len()).unwrap(),
+                // Sysctl files ignore writes that are not at the start of the file.
+                off: 0,
+                user_data: index << 2 | OP_WRITE,
+                ..Default::default()
+            };
+            assert!(ring.push(write));
+            expected += 1;
+        }
+        let close = linux::io_uring_sqe {
+            opcode: linux::IORING_OP_CLOSE,
+            file_index: slot_u32 + 1,
+            user_data: index << 2 | OP_CLOSE,
+            ..Default::default()
+        };
+        assert!(ring.push(close));
+        expected += 1;
+    }
+    if expected == 0 {
+        return;
+    }
+    complete(ring, expected, |cqe| {
+        let res = cqe.res;
+        if cqe.user_data & 3 == OP_WRITE && res < 0 && res != -linux::ECANCELED {
+            writeln!(linux::Stderr, "failed to write to sysctl file: {res}").unwrap();
+        }
+    });
+}
+
+/// Applies the options with io_uring: the directories are opened with one submission, then the
+/// options are opened and read with one submission per batch, and written and closed with another
+/// one. Returns false if io_uring cannot be used, in which case nothing was done.
+fn apply_with_io_uring(report: &mut Report) -> bool {
+    if config::SYSCTL.len() > MAX_DIRS {
+        return false;
+    }
+    // Direct descriptors in `IORING_OP_OPENAT` and `IORING_OP_CLOSE` need Linux 5.15, and the
+    // first feature flag that was added after them is `IORING_FEAT_CQE_SKIP`.
+    let mut ring = match linux::IoUring::new(
+        u32::try_from(URING_BATCH * 2).unwrap(),
+        linux::IORING_FEAT_CQE_SKIP,
+    ) {
+        Ok(r) => r,
+        Err(_) => return false,
+    };
+    if ring.register_empty_files(URING_BATCH) < 0 {
+        return false;
+    }
+
+    for (i, dir) in config::SYSCTL.iter().enumerate() {
+        let open = linux::io_uring_sqe {
+            opcode: linux::IORING_OP_OPENAT,
+            fd: linux::AT_FDCWD,
+            addr: dir.path.as_ptr() as u64,
+            op_flags: linux::O_RDONLY | linux::O_DIRECTORY | linux::O_CLOEXEC,
+            user_data: u64::try_from(i).unwrap(),
+            ..Default::default()
+        };
+        assert!(ring.push(open));
+    }
+    let mut dir_fds = [const { None::<Fd> }; MAX_DIRS];
+    complete(
+        &mut ring,
+        u32::try_from(config::SYSCTL.len()).unwrap(),
+        |cqe| {
+            let res = cqe.res;
+            if res < 0 {
+                writeln!(linux::Stderr, "failed to open sysctl directory: {res}").unwrap();
+            } else {
+                dir_fds[usize::try_from(cqe.user_data).unwrap()] =
+                    Some(Fd(res.try_into().unwrap()));
+            }
+        },
+    );
+
+    let mut batch: [(i32, &[u8], &[u8]); URING_BATCH] = [(0, b"", b""); URING_BATCH];
+    let mut len = 0;
+    for (dir, dir_fd) in config::SYSCTL.iter().zip(&dir_fds) {
+        let dir_fd = match dir_fd {
+            Some(fd) => i32::try_from(fd.0).unwrap(),
+            None => continue,
+        };
+        for (name, value) in dir.options {
+            report.options += 1;
+            batch[len] = (dir_fd, name, value);
+            len += 1;
+            if len == URING_BATCH {
+                apply_batch(&mut ring, &batch[..len], report);
+                len = 0;
+            }
+        }
+    }
+    if len > 0 {
+        apply_batch(&mut ring, &batch[..len], report);
+    }
+
+    // The directories are closed when `dir_fds` is dropped.
+    report.syscalls += ring.syscalls() + u32::try_from(dir_fds.iter().flatten().count()).unwrap();
+    true
+}
+
 /// Change sysctl options.
 ///
+/// io_uring is used when the kernel supports it, and the options are written one by one with
+/// regular system calls otherwise.
+///
 /// Errors are not returned unlike most other functions. This is because there
 /// can be multiple non critical errors that happen and will still want to
 /// continue.
 pub fn apply_sysctl() {
-    unsafe {
-        open_and_write(b"/proc/sys/fs/protected_fifos\0" as *const u8, b"1");
-        open_and_write(b"/proc/sys/fs/protected_hardlinks\0" as *const u8, b"1");
-        open_and_write(b"/proc/sys/fs/protected_regular\0" as *const u8, b"1");
-        open_and_write(b"/proc/sys/fs/protected_symlinks\0" as *const u8, b"1");
-        open_and_write(b"/proc/sys/kernel/kptr_restrict\0" as *const u8, b"2");
-        open_and_write(
-            b"/proc/sys/net/ipv4/conf/all/accept_redirects\0" as *const u8,
-            b"0",
-        );
-        open_and_write(
-            b"/proc/sys/net/ipv4/conf/all/send_redirects\0" as *const u8,
-            b"0",
-        );
-        open_and_write(
-            b"/proc/sys/net/ipv4/conf/all/ignore_routes_with_linkdown\0" as *const u8,
-            b"1",
-        );
-        open_and_write(
-            b"/proc/sys/net/ipv4/conf/all/rp_filter\0" as *const u8,
-            b"1",
-        );
-        open_and_write(b"/proc/sys/net/ipv4/tcp_mtu_probing\0" as *const u8, b"1");
-        open_and_write(b"/proc/sys/net/ipv4/tcp_rfc1337\0" as *const u8, b"1");
-        open_and_write(
-            b"/proc/sys/net/ipv6/conf/all/accept_redirects\0" as *const u8,
-            b"0",
-        );
-        open_and_write(
-            b"/proc/sys/net/ipv6/conf/all/use_tempaddr\0" as *const u8,
-            b"2",
-        );
-        open_and_write(b"/proc/sys/vm/admin_reserve_kbytes\0" as *const u8, b"0");
-        open_and_write(b"/proc/sys/vm/dirty_background_ratio\0" as *const u8, b"75");
-        open_and_write(
-            b"/proc/sys/vm/dirty_expire_centisecs\0" as *const u8,
-            b"90000",
-        );
-        open_and_write(b"/proc/sys/vm/dirty_ratio\0" as *const u8, b"75");
-        open_and_write(
-            b"/proc/sys/vm/dirty_writeback_centisecs\0" as *const u8,
-            b"90000",
-        );
-        open_and_write(b"/proc/sys/vm/overcommit_memory\0" as *const u8, b"2");
-        open_and_write(b"/proc/sys/vm/overcommit_ratio\0" as *const u8, b"100");
-        open_and_write(b"/proc/sys/vm/stat_interval\0" as *const u8, b"10");
-        open_and_write(b"/proc/sys/vm/user_reserve_kbytes\0" as *const u8, b"0");
+    let mut report = Report::default();
+    if !apply_with_io_uring(&mut report) {
+        report = Report::default();
+        apply_with_syscalls(&mut report);
     }
+    writeln!(
+        linux::Stdout,
+        "sysctl: {} options, {} already set, {} system calls",
+        report.options,
+        report.unchanged,
+        report.syscalls
+    )
+    .unwrap();
+    trace::counter("sysctl system calls", report.syscalls.into());
 }
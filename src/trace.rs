@@ -0,0 +1,255 @@
+//! A tiny boot tracer. Stages of the boot and of the shutdown record timestamps into a fixed
+//! in-memory buffer which is then dumped to a compact binary file. The
+//! `tools/boot-trace-to-json` script turns that file into a Chrome trace / Perfetto JSON file on
+//! the host so that the time-to-desktop critical path can be inspected.
+//!
+//! Both `CLOCK_MONOTONIC` and `CLOCK_BOOTTIME` are recorded for every event. The boot time clock
+//! starts when the kernel starts, so the boot time of the first event is the time that the kernel
+//! took before handing off to `_start`.
+//!
+//! Recording never allocates, never fails and is safe to do from multiple threads. When the
+//! buffer is full, new events are dropped and counted.
+
+use core::cell::UnsafeCell;
+use core::convert::{TryFrom, TryInto};
+use core::fmt::Write;
+use core::mem::MaybeUninit;
+use core::slice;
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+use crate::linux;
+
+/// Maximum number of events that can be recorded.
+const CAPACITY: usize = 1024;
+
+/// Maximum number of distinct event names in a dumped file.
+const MAX_NAMES: usize = 256;
+
+const MAGIC: &[u8; 8] = b"GINITTRC";
+const VERSION: u32 = 1;
+
+#[derive(Copy, Clone, PartialEq, Eq)]
+#[repr(u8)]
+pub enum Kind {
+    /// Start of a span.
+    Begin = 0,
+    /// End of a span. The argument is the result of the traced operation.
+    End = 1,
+    /// A point in time.
+    Instant = 2,
+    /// A value sampled at a point in time, such as a counter.
+    Counter = 3,
+}
+
+#[derive(Copy, Clone)]
+struct Event {
+    mono_ns: u64,
+    boot_ns: u64,
+    name: &'static str,
+    arg: i64,
+    tid: i32,
+    kind: Kind,
+}
+
+struct Buffer(UnsafeCell<MaybeUninit<[Event; CAPACITY]>>);
+
+// Every writer gets its own slot thanks to `NEXT`, and the buffer is only read when dumping.
+unsafe impl Sync for Buffer {}
+
+// The buffer is left uninitialized so that it lives in `.bss` instead of the executable.
+static EVENTS: Buffer = Buffer(UnsafeCell::new(MaybeUninit::uninit()));
+static NEXT: AtomicUsize = AtomicUsize::new(0);
+
+/// Records an event with the current time.
+pub fn record(kind: Kind, name: &'static str, arg: i64) {
+    let mono_ns = linux::clock_ns(linux::CLOCK_MONOTONIC);
+    let boot_ns = linux::clock_ns(linux::CLOCK_BOOTTIME);
+    let i = NEXT.fetch_add(1, Ordering::Relaxed);
+    if i >= CAPACITY {
+        return;
+    }
+    unsafe {
+        (EVENTS.0.get() as *mut Event).add(i).write(Event {
+            mono_ns,
+            boot_ns,
+            name,
+            arg,
+            tid: linux::gettid(),
+            kind,
+        });
+    }
+}
+
+/// Marks the start of the stage `name`.
+pub fn begin(name: &'static str) {
+    record(Kind::Begin, name, 0);
+}
+
+/// Marks the end of the stage `name`. `ret` is the result of the stage, where a negative value
+/// means that it failed.
+pub fn end(name: &'static str, ret: i64) {
+    record(Kind::End, name, ret);
+}
+
+/// Marks a point in time.
+pub fn instant(name: &'static str, arg: i64) {
+    record(Kind::Instant, name, arg);
+}
+
+/// Records the value of a counter.
+pub fn counter(name: &'static str, value: i64) {
+    record(Kind::Counter, name, value);
+}
+
+/// Runs `f` in a span named `name`.
+pub fn span<T, F: FnOnce() -> T>(name: &'static str, f: F) -> T {
+    begin(name);
+    let ret = f();
+    end(name, 0);
+    ret
+}
+
+/// Runs `f` in a span named `name` and records its return value, where a negative value means
+/// that it failed.
+pub fn stage<F: FnOnce() -> i32>(name: &'static str, f: F) -> i32 {
+    begin(name);
+    let ret = f();
+    end(name, ret.into());
+    ret
+}
+
+/// Records the kernel uptime from `/proc/uptime` as a counter in nanoseconds. This must be called
+/// once `/proc` is mounted. It is a cross check for the boot time clock of the first event.
+pub fn record_proc_uptime() {
+    let fd = unsafe { linux::open(b"/proc/uptime\0" as *const u8, linux::O_RDONLY, 0) };
+    if fd < 0 {
+        writeln!(linux::Stderr, "failed to open /proc/uptime: {fd}").unwrap();
+        return;
+    }
+    let fd = linux::Fd(fd.try_into().unwrap());
+    let mut buf = [0u8; 64];
+    let n = linux::read(fd.0, &mut buf);
+    if n < 0 {
+        writeln!(linux::Stderr, "failed to read /proc/uptime: {n}").unwrap();
+        return;
+    }
+    // The first field looks like `12.34`, in seconds with two decimals.
+    let mut ns: u64 = 0;
+    let mut decimals = None;
+    for &b in &buf[..usize::try_from(n).unwrap()] {
+        match b {
+            b'0'..=b'9' => {
+                ns = ns * 10 + u64::from(b - b'0');
+                decimals = decimals.map(|d| d + 1);
+            }
+            b'.' => decimals = Some(0),
+            _ => break,
+        }
+    }
+    let mut scale = 1_000_000_000;
+    for _ in 0..decimals.unwrap_or(0) {
+        scale /= 10;
+    }
+    counter("kernel uptime", (ns * scale) as i64);
+}
+
+fn write_all(fd: u32, mut buf: &[u8]) -> i64 {
+    while !buf.is_empty() {
+        let ret = linux::write(fd, buf);
+        if ret < 0 {
+            return ret;
+        }
+        buf = &buf[usize::try_from(ret).unwrap()..];
+    }
+    0
+}
+
+/// Writes the recorded events to the file at `path`.
+///
+/// The format is, in native endianness:
+/// - a header: the magic `GINITTRC`, a `u32` version, a `u32` name count, a `u32` event count and
+///   a `u32` count of dropped events,
+/// - the names, each as a `u16` length followed by the UTF-8 bytes,
+/// - the events, each as a `u64` monotonic time, a `u64` boot time, an `i64` argument, a `u16`
+///   name index, a `u8` kind, a padding byte and an `i32` thread ID.
+///
+/// Events that are recorded while dumping might be missing.
+///
+/// # Safety
+///
+/// `path` must be a NUL-terminated string.
+pub unsafe fn dump(path: *const u8) -> i32 {
+    let recorded = NEXT.load(Ordering::Relaxed);
+    let count = recorded.min(CAPACITY);
+    let events = slice::from_raw_parts(EVENTS.0.get() as *const Event, count);
+
+    // Deduplicate names. There are few distinct names, so a linear search is fine.
+    let mut names: [&str; MAX_NAMES] = [""; MAX_NAMES];
+    let mut name_count = 0;
+    let mut indices = [0u16; CAPACITY];
+    for (i, e) in events.iter().enumerate() {
+        indices[i] = match names[..name_count].iter().position(|n| *n == e.name) {
+            Some(p) => u16::try_from(p).unwrap(),
+            None if name_count < MAX_NAMES => {
+                names[name_count] = e.name;
+                name_count += 1;
+                u16::try_from(name_count - 1).unwrap()
+            }
+            None => u16::try_from(MAX_NAMES - 1).unwrap(),
+        };
+    }
+
+    let fd = linux::open(
+        path,
+        linux::O_WRONLY | linux::O_CREAT | linux::O_TRUNC | linux::O_CLOEXEC,
+        0o600,
+    );
+    if fd < 0 {
+        return fd;
+    }
+    let fd = linux::Fd(fd.try_into().unwrap());
+
+    let mut header = [0u8; 24];
+    header[..8].copy_from_slice(MAGIC);
+    header[8..12].copy_from_slice(&VERSION.to_ne_bytes());
+    header[12..16].copy_from_slice(&u32::try_from(name_count).unwrap().to_ne_bytes());
+    header[16..20].copy_from_slice(&u32::try_from(count).unwrap().to_ne_bytes());
+    header[20..24].copy_from_slice(&u32::try_from(recorded - count).unwrap().to_ne_bytes());
+    let mut ret = write_all(fd.0, &header);
+    if ret < 0 {
+        return ret.try_into().unwrap();
+    }
+
+    for name in &names[..name_count] {
+        let len = u16::try_from(name.len()).unwrap_or(u16::MAX);
+        ret = write_all(fd.0, &len.to_ne_bytes());
+        if ret < 0 {
+            return ret.try_into().unwrap();
+        }
+        ret = write_all(fd.0, &name.as_bytes()[..usize::from(len)]);
+        if ret < 0 {
+            return ret.try_into().unwrap();
+        }
+    }
+
+    // Write events in chunks to limit the number of system calls.
+    const EVENT_SIZE: usize = 32;
+    let mut chunk = [0u8; EVENT_SIZE * 64];
+    for (events, indices) in events.chunks(64).zip(indices.chunks(64)) {
+        for (j, (e, name)) in events.iter().zip(indices).enumerate() {
+            let out = &mut chunk[j * EVENT_SIZE..(j + 1) * EVENT_SIZE];
+            out[0..8].copy_from_slice(&e.mono_ns.to_ne_bytes());
+            out[8..16].copy_from_slice(&e.boot_ns.to_ne_bytes());
+            out[16..24].copy_from_slice(&e.arg.to_ne_bytes());
+            out[24..26].copy_from_slice(&name.to_ne_bytes());
+            out[26] = e.kind as u8;
+            out[27] = 0;
+            out[28..32].copy_from_slice(&e.tid.to_ne_bytes());
+        }
+        ret = write_all(fd.0, &chunk[..events.len() * EVENT_SIZE]);
+        if ret < 0 {
+            return ret.try_into().unwrap();
+        }
+    }
+    0
+}
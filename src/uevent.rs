@@ -0,0 +1,201 @@
+//! Listens to the uevents that the kernel broadcasts when devices are added or removed, which is
+//! what udev is built on.
+//!
+//! The kernel sends uevents for every device of every subsystem, and most of them are not
+//! interesting here, so a classic BPF filter is attached to the socket to drop everything that is
+//! not an `add` or a `remove` event before it is queued. A classic BPF program cannot search the
+//! message for the `SUBSYSTEM=` key since it has no backward jumps, so the subsystem is checked
+//! after the event is received.
+
+use core::convert::{TryFrom, TryInto};
+use core::mem;
+use core::ptr;
+
+use crate::linux::{self, Fd};
+
+/// Multicast group of the uevents sent by the kernel.
+const KERNEL_GROUP: u32 = 1;
+
+/// `add@` as a big-endian word, which is how `BPF_LD` loads words.
+const ADD_PREFIX: u32 = u32::from_be_bytes(*b"add@");
+/// `remo`, the first 4 bytes of `remove@`.
+const REMOVE_PREFIX: u32 = u32::from_be_bytes(*b"remo");
+
+const fn stmt(code: u16, k: u32) -> linux::sock_filter {
+    linux::sock_filter {
+        code,
+        jt: 0,
+        jf: 0,
+        k,
+    }
+}
+
+const fn jump(code: u16, k: u32, jt: u8, jf: u8) -> linux::sock_filter {
+    linux::sock_filter { code, jt, jf, k }
+}
+
+/// Accepts messages that start with `add@` or `remove@`. Jump offsets are relative to the next
+/// instruction.
+const FILTER: [linux::sock_filter; 9] = [
+    stmt(linux::BPF_LD | linux::BPF_W | linux::BPF_ABS, 0),
+    jump(
+        linux::BPF_JMP | linux::BPF_JEQ | linux::BPF_K,
+        ADD_PREFIX,
+        5,
+        0,
+    ),
+    jump(
+        linux::BPF_JMP | linux::BPF_JEQ | linux::BPF_K,
+        REMOVE_PREFIX,
+        0,
+        5,
+    ),
+    stmt(linux::BPF_LD | linux::BPF_H | linux::BPF_ABS, 4),
+    jump(
+        linux::BPF_JMP | linux::BPF_JEQ | linux::BPF_K,
+        u16::from_be_bytes(*b"ve") as u32,
+        0,
+        3,
+    ),
+    stmt(linux::BPF_LD | linux::BPF_B | linux::BPF_ABS, 6),
+    jump(
+        linux::BPF_JMP | linux::BPF_JEQ | linux::BPF_K,
+        b'@' as u32,
+        0,
+        1,
+    ),
+    // Keep the whole message.
+    stmt(linux::BPF_RET | linux::BPF_K, u32::MAX),
+    stmt(linux::BPF_RET | linux::BPF_K, 0),
+];
+
+#[derive(Copy, Clone, PartialEq, Eq)]
+pub enum Action {
+    Add,
+    Remove,
+}
+
+/// A parsed uevent. The fields borrow from the received message.
+pub struct Uevent<'a> {
+    pub action: Action,
+    pub subsystem: &'a [u8],
+    /// Path of the device node, relative to `/dev`, if the device has one.
+    pub devname: Option<&'a [u8]>,
+}
+
+impl<'a> Uevent<'a> {
+    /// Parses a message sent by the kernel: a `action@devpath` header followed by `KEY=value`
+    /// pairs, all NUL-terminated.
+    fn parse(msg: &'a [u8]) -> Option<Self> {
+        let mut fields = msg.split(|&b| b == 0);
+        let header = fields.next()?;
+        let action = if header.starts_with(b"add@") {
+            Action::Add
+        } else if header.starts_with(b"remove@") {
+            Action::Remove
+        } else {
+            return None;
+        };
+        let mut subsystem = None;
+        let mut devname = None;
+        for field in fields {
+            if let Some(v) = field.strip_prefix(b"SUBSYSTEM=") {
+                subsystem = Some(v);
+            } else if let Some(v) = field.strip_prefix(b"DEVNAME=") {
+                devname = Some(v);
+            }
+        }
+        Some(Self {
+            action,
+            subsystem: subsystem?,
+            devname,
+        })
+    }
+}
+
+/// A netlink socket that receives `add` and `remove` uevents from the kernel.
+pub struct UeventSocket {
+    fd: Fd,
+}
+
+impl UeventSocket {
+    pub fn new() -> Result<Self, i32> {
+        let fd = linux::socket(
+            linux::AF_NETLINK,
+            linux::SOCK_DGRAM | linux::SOCK_CLOEXEC,
+            linux::NETLINK_KOBJECT_UEVENT,
+        );
+        if fd < 0 {
+            return Err(fd);
+        }
+        let fd = Fd(fd.try_into().unwrap());
+
+        // The filter is attached before joining the group so that no unfiltered event is queued.
+        let prog = linux::sock_fprog {
+            len: u16::try_from(FILTER.len()).unwrap(),
+            filter: FILTER.as_ptr(),
+        };
+        let mut ret = unsafe {
+            linux::setsockopt(
+                fd.0,
+                linux::SOL_SOCKET,
+                linux::SO_ATTACH_FILTER,
+                &prog as *const linux::sock_fprog as *const u8,
+                mem::size_of_val(&prog),
+            )
+        };
+        if ret < 0 {
+            return Err(ret);
+        }
+
+        let addr = linux::sockaddr_nl {
+            nl_family: linux::AF_NETLINK as u16,
+            nl_pad: 0,
+            nl_pid: 0,
+            nl_groups: KERNEL_GROUP,
+        };
+        ret = unsafe {
+            linux::bind(
+                fd.0,
+                &addr as *const linux::sockaddr_nl as *const u8,
+                mem::size_of_val(&addr),
+            )
+        };
+        if ret < 0 {
+            return Err(ret);
+        }
+        Ok(Self { fd })
+    }
+
+    pub fn fd(&self) -> u32 {
+        self.fd.0
+    }
+
+    /// Receives the next uevent into `buf` without blocking, and calls `f` with it if it could be
+    /// parsed. Returns `Ok(false)` when there are no more events to receive.
+    pub fn recv<F: FnOnce(&Uevent)>(&self, buf: &mut [u8], f: F) -> Result<bool, i32> {
+        let ret = unsafe {
+            linux::recvfrom(
+                i32::try_from(self.fd.0).unwrap(),
+                buf,
+                linux::MSG_DONTWAIT,
+                ptr::null_mut(),
+                0,
+            )
+        };
+        let n = match usize::try_from(ret) {
+            Ok(n) => n,
+            Err(_) => {
+                let ret = i32::try_from(ret).unwrap();
+                if ret == -linux::EAGAIN {
+                    return Ok(false);
+                }
+                return Err(ret);
+            }
+        };
+        if let Some(uevent) = Uevent::parse(&buf[..n]) {
+            f(&uevent);
+        }
+        Ok(true)
+    }
+}
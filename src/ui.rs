@@ -5,11 +5,33 @@ use core::convert::{TryFrom, TryInto};
 use core::fmt::Write;
 use core::ptr;
 
+use crate::cgroup;
 use crate::config;
 use crate::linux;
+use crate::sched;
+use crate::seat;
+use crate::service;
 
 const SEAT_COMPOSITOR_FD: u32 = 3;
 
+/// FD number of the first pre-opened device in the user interface process. The other ones follow.
+const FIRST_DEVICE_FD: u32 = 4;
+
+/// Maximum number of environment variables of the user interface process.
+const MAX_ENV: usize = 256;
+
+/// Name of the environment variable that maps the paths of the pre-opened devices to their FDs,
+/// as a colon-separated list of `path=fd` pairs.
+const PREOPENED_ENV: &[u8] = b"SEAT_PREOPENED_FDS=";
+
+struct PreExecData {
+    seat_compositor_fd: u32,
+    /// Scheduling policy of the service that is started.
+    sched: *const sched::Policy,
+    device_fds: [u32; seat::MAX_PREOPENED],
+    device_count: usize,
+}
+
 /// Creates the XDG_RUNTIME_DIR directory.
 fn create_xdg_runtime_dir() -> i32 {
     let ret = unsafe { linux::mkdir(config::XDG_RUNTIME_DIR, 0o700) };
@@ -19,9 +41,10 @@ fn create_xdg_runtime_dir() -> i32 {
     unsafe { linux::chown(config::XDG_RUNTIME_DIR, config::USER_UID, config::USER_GID) }
 }
 
-fn ui_process_pre_exec(seat_compositor_fd: usize) -> bool {
+fn ui_process_pre_exec(data: usize) -> bool {
     let mut ret;
-    let seat_compositor_fd = u32::try_from(seat_compositor_fd).unwrap();
+    let data = unsafe { &*(data as *const PreExecData) };
+    let seat_compositor_fd = data.seat_compositor_fd;
     if seat_compositor_fd != SEAT_COMPOSITOR_FD {
         ret = linux::dup2(seat_compositor_fd, SEAT_COMPOSITOR_FD);
         if ret < 0 {
@@ -33,6 +56,17 @@ fn ui_process_pre_exec(seat_compositor_fd: usize) -> bool {
             writeln!(linux::Stderr, "failed to close seat compositor FD: {ret}").unwrap();
         }
     }
+    // The pre-opened FDs are all above the numbers that they are moved to, so they cannot be
+    // overwritten before they are moved. The new FDs do not have the `CLOEXEC` flag.
+    for (i, &fd) in data.device_fds[..data.device_count].iter().enumerate() {
+        ret = linux::dup2(fd, FIRST_DEVICE_FD + u32::try_from(i).unwrap());
+        if ret < 0 {
+            writeln!(linux::Stderr, "failed to dup2 pre-opened device FD: {ret}").unwrap();
+            return false;
+        }
+    }
+    // Real-time priorities and negative nice levels need the privileges of init.
+    unsafe { (*data.sched).apply() };
     ret = linux::setgid(config::USER_GID);
     if ret < 0 {
         writeln!(linux::Stderr, "failed to setgid: {ret}").unwrap();
@@ -96,24 +130,122 @@ pub fn set_backlight_brightness() {
     }
 }
 
-/// Starts the user interface process and returns its PID so that the caller can wait until it
-/// dies.
+/// Appends `bytes` to `buf` at `*len`, unless it does not fit.
+fn append(buf: &mut [u8], len: &mut usize, bytes: &[u8]) -> bool {
+    if buf.len() - *len < bytes.len() {
+        return false;
+    }
+    buf[*len..*len + bytes.len()].copy_from_slice(bytes);
+    *len += bytes.len();
+    true
+}
+
+/// What the user interface process inherits from the seat server. It is prepared once so that the
+/// process can be restarted by the service supervisor while the seat server runs in the event
+/// loop.
 ///
-/// To understand what `seat_compositor_fd` refers to, please look at the documentation for the
-/// `seat` module.
-pub fn start_ui_process(seat_compositor_fd: u32) -> i32 {
-    let ret = create_xdg_runtime_dir();
-    if ret < 0 {
-        return ret;
+/// To understand what the seat compositor FD refers to, please look at the documentation for the
+/// `seat` module. The devices of the seat server that were pre-opened are inherited by the process
+/// and listed in the `SEAT_PREOPENED_FDS` environment variable.
+pub struct Seat {
+    data: PreExecData,
+    /// Duplicates of the pre-opened devices, so that they stay valid if the seat server closes its
+    /// own FDs when a device is removed.
+    _devices: [Option<linux::Fd>; seat::MAX_PREOPENED],
+    env_var: [u8; 8192],
+}
+
+impl Seat {
+    pub fn new(seat_compositor_fd: u32, seat_server: &seat::SeatServer) -> Self {
+        let mut seat = Self {
+            data: PreExecData {
+                seat_compositor_fd,
+                sched: &sched::Policy::DEFAULT,
+                device_fds: [0; seat::MAX_PREOPENED],
+                device_count: 0,
+            },
+            _devices: [const { None }; seat::MAX_PREOPENED],
+            env_var: [0u8; 8192],
+        };
+        let env_var = &mut seat.env_var;
+        let data = &mut seat.data;
+        let mut env_len = 0;
+        append(env_var, &mut env_len, PREOPENED_ENV);
+        for device in seat_server.preopened() {
+            let fd = linux::fcntl(device.fd(), linux::F_DUPFD_CLOEXEC, u64::from(device.fd()));
+            let fd = match u32::try_from(fd) {
+                Ok(fd) => linux::Fd(fd),
+                Err(_) => {
+                    writeln!(linux::Stderr, "failed to duplicate device FD: {fd}").unwrap();
+                    continue;
+                }
+            };
+            let target = FIRST_DEVICE_FD + u32::try_from(data.device_count).unwrap();
+            let mut target_str = [0u8; 10];
+            let mut start = target_str.len();
+            let mut n = target;
+            loop {
+                start -= 1;
+                target_str[start] = b'0' + (n % 10) as u8;
+                n /= 10;
+                if n == 0 {
+                    break;
+                }
+            }
+            let checkpoint = env_len;
+            let ok = (data.device_count == 0 || append(env_var, &mut env_len, b":"))
+                && append(env_var, &mut env_len, device.path())
+                && append(env_var, &mut env_len, b"=")
+                && append(env_var, &mut env_len, &target_str[start..])
+                // Always leave room for the NUL byte.
+                && env_len < env_var.len();
+            if !ok {
+                // Drop the partially written pair.
+                env_var[checkpoint] = 0;
+                break;
+            }
+            data.device_fds[data.device_count] = fd.0;
+            seat._devices[data.device_count] = Some(fd);
+            data.device_count += 1;
+        }
+        seat
     }
 
-    unsafe {
-        linux::spawn_with_pre_exec(
-            b"/usr/bin/sway\0" as *const u8,
-            &[b"/usr/bin/sway\0" as *const u8, ptr::null()] as *const *const u8,
-            config::SWAY_ENVP,
-            ui_process_pre_exec,
-            usize::try_from(seat_compositor_fd).unwrap(),
-        )
+    /// Starts the user interface process of `service`, with the environment of the `[ui]` section
+    /// of `config.toml` and as its user. The process is meant to be supervised by the `service`
+    /// module, so it does not send `SIGCHLD` when it exits.
+    pub fn spawn(&self, service: &service::Service) -> Result<linux::Child, i32> {
+        let ret = create_xdg_runtime_dir();
+        // The directory is still there if the process is restarted.
+        if ret < 0 && ret != -linux::EEXIST {
+            return Err(ret);
+        }
+        let executable = unsafe { linux::open_executable(service.path) }?;
+
+        let mut envp = [ptr::null::<u8>(); MAX_ENV];
+        let mut envc = 0;
+        unsafe {
+            while envc < MAX_ENV - 2 && !(*service.envp.add(envc)).is_null() {
+                envp[envc] = *service.envp.add(envc);
+                envc += 1;
+            }
+        }
+        if self.data.device_count > 0 {
+            envp[envc] = self.env_var.as_ptr();
+        }
+
+        let cgroup = cgroup::open_for(service);
+        let mut command = linux::Command::new(&executable, service.argv, envp.as_ptr());
+        command.cgroup = cgroup.as_ref().map(|fd| fd.0);
+        command.pre_exec = ui_process_pre_exec;
+        let data = PreExecData {
+            sched: &service.sched,
+            ..self.data
+        };
+        command.pre_exec_data = &data as *const PreExecData as usize;
+        // The seat compositor FD and the pre-opened devices are moved below this one.
+        command.first_closed_fd = FIRST_DEVICE_FD + u32::try_from(self.data.device_count).unwrap();
+        command.exit_signal = 0;
+        unsafe { command.spawn() }
     }
 }
@@ -0,0 +1,173 @@
+//! Compressed swap in memory on a zram device, from the `[zram]` section of `config.toml`.
+//!
+//! The device is configured through its sysfs directory, then init writes the swap header itself,
+//! like `mkswap` would, and enables the swap with discard so that the memory of freed swap pages
+//! is given back right away. The time that this takes, the memory that the device uses and the
+//! change of the commit limit are written to the log.
+
+use core::convert::{TryFrom, TryInto};
+use core::fmt::Write;
+
+use crate::config;
+use crate::linux::{self, Fd};
+use crate::procfs::{self, meminfo_kb};
+
+/// Size of a page, which is the unit of the swap header.
+const PAGE_SIZE: usize = 4096;
+
+/// Offset of the `version` field of the swap header, after the space left for a boot loader.
+const HEADER_OFFSET: usize = 1024;
+
+/// A zram device, generated by the `build.rs` script.
+pub struct Device {
+    /// NUL-terminated path of the sysfs directory of the device.
+    pub sysfs_path: &'static [u8],
+    /// NUL-terminated path of the block device.
+    pub dev_path: &'static [u8],
+    /// Size of the device in bytes, as written to `disksize`.
+    pub disksize: &'static [u8],
+    /// Size of the device in pages.
+    pub pages: u32,
+    /// Compression algorithm, as written to `comp_algorithm`.
+    pub algorithm: Option<&'static [u8]>,
+    /// Number of compression streams. Since Linux 4.7, there is one per CPU and this is ignored.
+    pub streams: Option<&'static [u8]>,
+    /// Priority of the swap, from 0 to 32767. The kernel gives a negative one if it is not set.
+    pub priority: Option<u16>,
+}
+
+/// Sets the compression and the size of the device, which allocates its memory.
+fn configure(device: &Device, dir: &Fd) -> i32 {
+    // The algorithm and the streams can only be changed before the size is set.
+    if let Some(algorithm) = device.algorithm {
+        let ret = procfs::write_file_at(
+            i32::try_from(dir.0).unwrap(),
+            b"comp_algorithm\0",
+            algorithm,
+        );
+        if ret < 0 {
+            writeln!(
+                linux::Stderr,
+                "failed to set zram compression algorithm: {ret}"
+            )
+            .unwrap();
+        }
+    }
+    if let Some(streams) = device.streams {
+        let ret = procfs::write_file_at(
+            i32::try_from(dir.0).unwrap(),
+            b"max_comp_streams\0",
+            streams,
+        );
+        if ret < 0 {
+            writeln!(linux::Stderr, "failed to set zram streams: {ret}").unwrap();
+        }
+    }
+    procfs::write_file_at(
+        i32::try_from(dir.0).unwrap(),
+        b"disksize\0",
+        device.disksize,
+    )
+}
+
+/// Writes a version 1 swap header to the first page of the device, which is what `mkswap` does.
+fn write_header(device: &Device) -> i32 {
+    let mut page = [0u8; PAGE_SIZE];
+    let header = &mut page[HEADER_OFFSET..];
+    // `version`, `last_page` and `nr_badpages`, followed by a null UUID and the volume name.
+    header[0..4].copy_from_slice(&1u32.to_ne_bytes());
+    header[4..8].copy_from_slice(&(device.pages - 1).to_ne_bytes());
+    header[28..32].copy_from_slice(b"zram");
+    page[PAGE_SIZE - 10..].copy_from_slice(b"SWAPSPACE2");
+
+    let fd = unsafe {
+        linux::open(
+            device.dev_path.as_ptr(),
+            linux::O_WRONLY | linux::O_CLOEXEC,
+            0,
+        )
+    };
+    if fd < 0 {
+        return fd;
+    }
+    let fd = Fd(fd.try_into().unwrap());
+    let ret = linux::pwrite64(fd.0, &page, 0);
+    if ret < 0 {
+        return ret.try_into().unwrap();
+    }
+    0
+}
+
+/// Returns `MemAvailable` and `CommitLimit`, in kB.
+fn memory_kb() -> (u64, u64) {
+    let mut buf = [0u8; 4096];
+    match procfs::read_proc_file(b"/proc/meminfo\0", &mut buf) {
+        Ok(meminfo) => (
+            meminfo_kb(meminfo, b"MemAvailable").unwrap_or(0),
+            meminfo_kb(meminfo, b"CommitLimit").unwrap_or(0),
+        ),
+        Err(_) => (0, 0),
+    }
+}
+
+/// Sets up the zram device and enables it as swap, if there is one in the configuration.
+pub fn setup_zram() -> i32 {
+    let device = match &config::ZRAM {
+        Some(d) => d,
+        None => return 0,
+    };
+    let start_ns = linux::clock_ns(linux::CLOCK_MONOTONIC);
+    let (available_before, commit_before) = memory_kb();
+
+    let dir = unsafe {
+        linux::open(
+            device.sysfs_path.as_ptr(),
+            linux::O_RDONLY | linux::O_DIRECTORY | linux::O_CLOEXEC,
+            0,
+        )
+    };
+    if dir < 0 {
+        return dir;
+    }
+    let dir = Fd(dir.try_into().unwrap());
+    let ret = configure(device, &dir);
+    if ret < 0 {
+        return ret;
+    }
+    let ret = write_header(device);
+    if ret < 0 {
+        return ret;
+    }
+    let mut flags = linux::SWAP_FLAG_DISCARD;
+    if let Some(priority) = device.priority {
+        flags |= linux::SWAP_FLAG_PREFER | (i32::from(priority) & linux::SWAP_FLAG_PRIO_MASK);
+    }
+    let ret = unsafe { linux::swapon(device.dev_path.as_ptr(), flags) };
+    if ret < 0 {
+        return ret;
+    }
+
+    let ns = linux::clock_ns(linux::CLOCK_MONOTONIC) - start_ns;
+    let (available_after, commit_after) = memory_kb();
+    // `mem_used_total` is the third field of `mm_stat`, in bytes.
+    let mut buf = [0u8; 256];
+    let used_kb = procfs::read_file_at(i32::try_from(dir.0).unwrap(), b"mm_stat\0", &mut buf)
+        .ok()
+        .and_then(|s| {
+            let f = s
+                .split(|b| b.is_ascii_whitespace())
+                .filter(|f| !f.is_empty())
+                .nth(2)?;
+            core::str::from_utf8(f).ok()?.parse::<u64>().ok()
+        })
+        .map_or(0, |b| b / 1024);
+    writeln!(
+        linux::Stdout,
+        "zram: {} MiB of swap on {} in {} us, MemAvailable {available_before} kB -> {available_after} kB, device uses {used_kb} kB, CommitLimit {commit_before} kB -> {commit_after} kB",
+        u64::from(device.pages) * PAGE_SIZE as u64 / (1024 * 1024),
+        core::str::from_utf8(&device.dev_path[..device.dev_path.len() - 1]).unwrap(),
+        ns / 1000
+    )
+    .unwrap();
+    0
+}
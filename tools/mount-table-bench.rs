@@ -0,0 +1,122 @@
+//! Measures how long `MountTable::read` takes with thousands of bind mounts, next to a
+//! straightforward parser of `/proc/self/mountinfo` that allocates, and shows how a full table
+//! keeps the mounts that fit and counts the other ones.
+//!
+//! It runs as root in its own mount namespace, which it enters by running itself again under
+//! `unshare -m --propagation private`, so the mounts disappear when it exits.
+//!
+//! Usage: rustc --edition 2018 -O tools/mount-table-bench.rs -o /tmp/mount-table-bench
+//!        /tmp/mount-table-bench [<mount count>...]
+
+#![allow(dead_code)]
+
+#[path = "../src/linux.rs"]
+mod linux;
+#[path = "../src/mounts.rs"]
+mod mounts;
+
+use std::env;
+use std::ffi::CString;
+use std::fs;
+use std::os::unix::process::CommandExt;
+use std::process::Command;
+use std::time::Instant;
+
+const MS_BIND: u64 = 0x1000;
+
+/// Directory in which the mounts are made.
+const DIR: &str = "/tmp/ginit-mount-table-bench";
+
+/// Number of times each measurement is repeated.
+const RUNS: u32 = 20;
+
+/// Parses `/proc/self/mountinfo` the way a program with an allocator would.
+fn read_naive() -> Vec<(u64, u64, String, String)> {
+    let mountinfo = fs::read_to_string("/proc/self/mountinfo").unwrap();
+    mountinfo
+        .lines()
+        .filter_map(|line| {
+            let mut fields = line.split(' ');
+            let id = fields.next()?.parse().ok()?;
+            let parent_id = fields.next()?.parse().ok()?;
+            let path = fields.nth(2)?.to_owned();
+            let fs_type = fields.skip_while(|&f| f != "-").nth(1)?.to_owned();
+            Some((id, parent_id, path, fs_type))
+        })
+        .collect()
+}
+
+fn mount(source: &str, target: &str, fs_type: &str, flags: u64) {
+    let source = CString::new(source).unwrap();
+    let target = CString::new(target).unwrap();
+    let fs_type = CString::new(fs_type).unwrap();
+    let ret = unsafe {
+        linux::mount(
+            source.as_ptr() as *const u8,
+            target.as_ptr() as *const u8,
+            fs_type.as_ptr() as *const u8,
+            flags,
+            std::ptr::null(),
+        )
+    };
+    assert!(ret >= 0, "failed to mount {:?}: {}", target, ret);
+}
+
+/// Returns the average time that `f` takes, in microseconds.
+fn time_us(mut f: impl FnMut()) -> u128 {
+    let start = Instant::now();
+    for _ in 0..RUNS {
+        f();
+    }
+    start.elapsed().as_micros() / u128::from(RUNS)
+}
+
+fn main() {
+    if env::var_os("MOUNT_TABLE_BENCH_NS").is_none() {
+        let err = Command::new("unshare")
+            .args(["-m", "--propagation", "private"])
+            .arg(env::current_exe().unwrap())
+            .args(env::args_os().skip(1))
+            .env("MOUNT_TABLE_BENCH_NS", "1")
+            .exec();
+        panic!("failed to run unshare: {}", err);
+    }
+    let mut counts: Vec<usize> = env::args()
+        .skip(1)
+        .map(|a| a.parse().expect("invalid mount count"))
+        .collect();
+    if counts.is_empty() {
+        counts = vec![0, 1000, 3000, 4000, 6000];
+    }
+    counts.sort_unstable();
+
+    fs::create_dir_all(DIR).unwrap();
+    mount("tmpfs", DIR, "tmpfs", 0);
+    fs::create_dir(format!("{DIR}/source")).unwrap();
+
+    let mut table = Box::new(mounts::MountTable::new());
+    println!("bind mounts  table  dropped  MountTable::read  naive parser");
+    let mut made = 0;
+    for count in counts {
+        while made < count {
+            let target = format!("{DIR}/{made}");
+            fs::create_dir(&target).unwrap();
+            mount(&format!("{DIR}/source"), &target, "", MS_BIND);
+            made += 1;
+        }
+        let ret = table.read();
+        assert!(ret >= 0, "failed to read mounts: {}", ret);
+        let table_us = time_us(|| {
+            table.read();
+        });
+        let naive_len = read_naive().len();
+        let naive_us = time_us(|| {
+            read_naive();
+        });
+        println!(
+            "{made:>11}  {:>5}  {:>7}  {table_us:>13} us  {naive_us:>9} us ({naive_len} mounts)",
+            table.len(),
+            table.dropped()
+        );
+    }
+}
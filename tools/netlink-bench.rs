@@ -0,0 +1,281 @@
+//! Measures how long `net::setup_networking` takes to configure 8 veth interfaces, which sends all
+//! its requests in one batch, next to sending the same requests one at a time and waiting for each
+//! acknowledgement, as the init system did before.
+//!
+//! Each run happens in a new network namespace in which the veth pairs are created with `ip`, so
+//! the interfaces have the indices 2 to 9 and the host network is left alone. It needs root.
+//!
+//! Usage: rustc --edition 2018 -O tools/netlink-bench.rs -o netlink-bench
+//!        ./netlink-bench [<runs>]
+
+#![allow(dead_code)]
+
+#[path = "../src/linux.rs"]
+mod linux;
+#[path = "../src/net.rs"]
+mod net;
+
+/// The configuration that `net::setup_networking` applies: an address on each interface, and a
+/// default route through the first one.
+mod config {
+    use crate::net::Ipv4Addr;
+
+    pub struct NetInterface {
+        pub index: u32,
+        pub addr: Option<Ipv4Addr>,
+        pub gateway: Option<Ipv4Addr>,
+        pub broadcast: Option<Ipv4Addr>,
+    }
+
+    /// Returns the interface with the given index, with the address 10.0.N.1.
+    const fn veth(index: u32) -> NetInterface {
+        NetInterface {
+            index,
+            addr: Some(0x0a00_0001 | index << 8),
+            gateway: None,
+            broadcast: None,
+        }
+    }
+
+    pub const NET_INTERFACES: &[NetInterface] = &[
+        NetInterface {
+            gateway: Some(0x0a00_0202),
+            ..veth(2)
+        },
+        veth(3),
+        veth(4),
+        veth(5),
+        veth(6),
+        veth(7),
+        veth(8),
+        veth(9),
+    ];
+}
+
+use std::convert::TryFrom;
+use std::mem;
+use std::process::Command;
+use std::time::Instant;
+
+const CLONE_NEWNET: i32 = 0x4000_0000;
+
+extern "C" {
+    fn unshare(flags: i32) -> i32;
+}
+
+#[repr(C)]
+struct Attr {
+    len: u16,
+    kind: u16,
+    value: u32,
+}
+
+impl Attr {
+    fn new(kind: u16, value: u32) -> Self {
+        Self {
+            len: u16::try_from(mem::size_of::<Self>()).unwrap(),
+            kind,
+            value,
+        }
+    }
+}
+
+#[repr(C)]
+struct AddAddrRequest {
+    hdr: linux::nlmsghdr,
+    family: u8,
+    prefix_len: u8,
+    flags: u8,
+    scope: u8,
+    index: u32,
+    local: Attr,
+    addr: Attr,
+    broadcast: Attr,
+}
+
+#[repr(C)]
+struct SetLinkRequest {
+    hdr: linux::nlmsghdr,
+    family: u8,
+    link_type: u16,
+    index: i32,
+    flags: u32,
+    change: u32,
+}
+
+#[repr(C)]
+struct AddRouteRequest {
+    hdr: linux::nlmsghdr,
+    family: u8,
+    dst_len: u8,
+    src_len: u8,
+    tos: u8,
+    table: u8,
+    protocol: u8,
+    scope: u8,
+    route_type: u8,
+    flags: u32,
+    gateway: Attr,
+    interface: Attr,
+}
+
+fn header<T>(kind: u16, flags: i32, seq: u32) -> linux::nlmsghdr {
+    linux::nlmsghdr {
+        nlmsg_len: u32::try_from(mem::size_of::<T>()).unwrap(),
+        nlmsg_type: kind,
+        nlmsg_flags: u16::try_from(linux::NLM_F_REQUEST | linux::NLM_F_ACK | flags).unwrap(),
+        nlmsg_seq: seq,
+        nlmsg_pid: 0,
+    }
+}
+
+/// Sends a request and waits for its acknowledgement. Returns the error code of the request.
+fn request<T>(fd: &linux::Fd, req: &T) -> i32 {
+    let bytes =
+        unsafe { std::slice::from_raw_parts(req as *const T as *const u8, mem::size_of::<T>()) };
+    let ret = linux::write(fd.0, bytes);
+    if ret < 0 {
+        return i32::try_from(ret).unwrap();
+    }
+    let mut buf = [0u8; 8192];
+    let ret = linux::read(fd.0, &mut buf);
+    if ret < 0 {
+        return i32::try_from(ret).unwrap();
+    }
+    let err = unsafe {
+        std::ptr::read_unaligned(
+            buf[mem::size_of::<linux::nlmsghdr>()..].as_ptr() as *const linux::nlmsgerr
+        )
+    };
+    err.error
+}
+
+/// Applies `config::NET_INTERFACES` with one round trip per request.
+fn setup_networking_sequentially() -> i32 {
+    let fd = linux::socket(linux::AF_NETLINK, linux::SOCK_RAW, linux::NETLINK_ROUTE);
+    if fd < 0 {
+        return fd;
+    }
+    let fd = linux::Fd(u32::try_from(fd).unwrap());
+    linux::setsockopt_int(fd.0, linux::SOL_NETLINK, linux::NETLINK_CAP_ACK, 1);
+    let mut seq = 0;
+    let excl = linux::NLM_F_CREATE | linux::NLM_F_EXCL;
+    for interface in config::NET_INTERFACES {
+        let addr = interface.addr.unwrap();
+        // The same default as `net::setup_networking`.
+        let broadcast = interface.broadcast.unwrap_or(0xffff_ff00);
+        seq += 1;
+        let ret = request(
+            &fd,
+            &AddAddrRequest {
+                hdr: header::<AddAddrRequest>(linux::RTM_NEWADDR, excl, seq),
+                family: u8::try_from(linux::AF_INET).unwrap(),
+                prefix_len: 24,
+                flags: 0,
+                scope: 0,
+                index: interface.index,
+                local: Attr::new(linux::IFA_LOCAL, addr.to_be()),
+                addr: Attr::new(linux::IFA_ADDRESS, addr.to_be()),
+                broadcast: Attr::new(linux::IFA_BROADCAST, broadcast.to_be()),
+            },
+        );
+        if ret < 0 {
+            return ret;
+        }
+    }
+    for interface in config::NET_INTERFACES {
+        seq += 1;
+        let ret = request(
+            &fd,
+            &SetLinkRequest {
+                hdr: header::<SetLinkRequest>(linux::RTM_SETLINK, 0, seq),
+                family: u8::try_from(linux::AF_UNSPEC).unwrap(),
+                link_type: linux::ARPHRD_NONE,
+                index: i32::try_from(interface.index).unwrap(),
+                flags: u32::try_from(linux::IFF_UP).unwrap(),
+                change: u32::try_from(linux::IFF_UP).unwrap(),
+            },
+        );
+        if ret < 0 {
+            return ret;
+        }
+    }
+    for interface in config::NET_INTERFACES {
+        let gateway = match interface.gateway {
+            Some(g) => g,
+            None => continue,
+        };
+        seq += 1;
+        let ret = request(
+            &fd,
+            &AddRouteRequest {
+                hdr: header::<AddRouteRequest>(linux::RTM_NEWROUTE, excl, seq),
+                family: u8::try_from(linux::AF_INET).unwrap(),
+                dst_len: 0,
+                src_len: 0,
+                tos: 0,
+                table: linux::RT_TABLE_MAIN,
+                protocol: linux::RTPROT_BOOT,
+                scope: linux::RT_SCOPE_UNIVERSE,
+                route_type: linux::RTN_UNICAST,
+                flags: 0,
+                gateway: Attr::new(linux::RTA_GATEWAY, gateway.to_be()),
+                interface: Attr::new(linux::RTA_OIF, interface.index),
+            },
+        );
+        if ret < 0 {
+            return ret;
+        }
+    }
+    0
+}
+
+/// Moves the process to a new network namespace with 4 veth pairs.
+fn new_namespace() {
+    assert!(unsafe { unshare(CLONE_NEWNET) } == 0, "failed to unshare");
+    for i in 0..4 {
+        let status = Command::new("ip")
+            .args(["link", "add", &format!("veth{}", 2 * i), "type", "veth"])
+            .args(["peer", "name", &format!("veth{}", 2 * i + 1)])
+            .status()
+            .expect("failed to run ip");
+        assert!(status.success(), "failed to create veth pair");
+    }
+}
+
+/// Sorts `durations` and returns their average and their median.
+fn stats(durations: &mut [f64]) -> (f64, f64) {
+    durations.sort_by(|a, b| a.partial_cmp(b).unwrap());
+    let mean = durations.iter().sum::<f64>() / durations.len() as f64;
+    (mean, durations[durations.len() / 2])
+}
+
+fn main() {
+    let runs: usize = std::env::args()
+        .nth(1)
+        .map_or(200, |a| a.parse().expect("bad run count"));
+    let setups: [(&str, fn() -> i32); 2] = [
+        ("one request at a time", setup_networking_sequentially),
+        ("batch", net::setup_networking),
+    ];
+    let mut durations = [Vec::with_capacity(runs), Vec::with_capacity(runs)];
+    // The setups take turns, so that they are affected in the same way by what else happens.
+    for _ in 0..runs {
+        for ((_, setup), d) in setups.iter().zip(durations.iter_mut()) {
+            new_namespace();
+            let start = Instant::now();
+            let ret = setup();
+            d.push(start.elapsed().as_secs_f64() * 1e6);
+            assert!(ret == 0, "failed to set up networking: {}", ret);
+        }
+    }
+    println!(
+        "{runs} runs configuring {} interfaces",
+        config::NET_INTERFACES.len()
+    );
+    println!("setup                      mean    p50 (us)");
+    for ((name, _), d) in setups.iter().zip(durations.iter_mut()) {
+        let (mean, p50) = stats(d);
+        println!("{name:<24} {mean:>6.1} {p50:>6.1}");
+    }
+}
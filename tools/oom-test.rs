@@ -0,0 +1,125 @@
+//! Tests the OOM killer in a memory-limited cgroup: a process that keeps allocating memory in the
+//! cgroup must be killed by `oom::Killer`, before the kernel OOM killer acts at `memory.max`.
+//!
+//! The cgroup is created under `/sys/fs/cgroup`, so it needs root and a cgroup2 hierarchy with the
+//! memory controller enabled there. The killer watches the cgroup with periodic checks, and its
+//! decisions are printed like in the log of the init system.
+//!
+//! Usage: rustc --edition 2018 -O tools/oom-test.rs -o oom-test
+//!        ./oom-test [<memory.max in MiB>]
+
+#![allow(dead_code)]
+
+#[path = "../src/linux.rs"]
+mod linux;
+#[path = "../src/oom.rs"]
+mod oom;
+#[path = "../src/procfs.rs"]
+mod procfs;
+#[path = "../src/reactor.rs"]
+mod reactor;
+#[path = "../src/trace.rs"]
+mod trace;
+
+mod config {
+    use crate::oom;
+
+    pub const OOM: Option<oom::Policy> = Some(oom::Policy {
+        available_percent: 10,
+        pressure_available_percent: 10,
+        interval_ms: 50,
+        trigger: None,
+        cgroup: Some(b"ginit-oom-test\0"),
+        protect: &[],
+        cgroup_weights: &[],
+    });
+}
+
+use std::env;
+use std::fs;
+use std::io::{Read, Write};
+use std::os::unix::process::ExitStatusExt;
+use std::process::{self, Command, Stdio};
+use std::thread;
+use std::time::{Duration, Instant};
+
+const CGROUP: &str = "/sys/fs/cgroup/ginit-oom-test";
+
+/// Size of each allocation of the workload.
+const CHUNK: usize = 1024 * 1024;
+
+/// Allocates and touches a chunk of memory every few milliseconds until it is killed, once a
+/// byte is read from stdin.
+fn allocate() -> ! {
+    std::io::stdin().read_exact(&mut [0]).unwrap();
+    let mut chunks = Vec::new();
+    loop {
+        chunks.push(vec![1u8; CHUNK]);
+        thread::sleep(Duration::from_millis(5));
+    }
+}
+
+/// Returns the value of `key` in the `memory.events` file of the cgroup.
+fn memory_event(key: &str) -> u64 {
+    let events = fs::read_to_string(format!("{CGROUP}/memory.events")).unwrap();
+    events
+        .lines()
+        .find_map(|l| l.strip_prefix(key)?.trim().parse().ok())
+        .unwrap_or(0)
+}
+
+fn main() {
+    if env::args().nth(1).as_deref() == Some("allocate") {
+        allocate();
+    }
+    let max_mib: u64 = env::args()
+        .nth(1)
+        .map_or(256, |a| a.parse().expect("bad memory size"));
+
+    let controllers = fs::read_to_string("/sys/fs/cgroup/cgroup.subtree_control");
+    if !controllers.is_ok_and(|c| c.split_whitespace().any(|c| c == "memory")) {
+        eprintln!("/sys/fs/cgroup is not a cgroup2 hierarchy with the memory controller enabled");
+        process::exit(2);
+    }
+    fs::create_dir(CGROUP).expect("failed to create the cgroup");
+    fs::write(format!("{CGROUP}/memory.max"), format!("{}", max_mib << 20)).unwrap();
+    // Swap would let the workload grow beyond the limit. The file only exists with swap.
+    let _ = fs::write(format!("{CGROUP}/memory.swap.max"), "0");
+
+    let mut workload = Command::new(env::current_exe().unwrap())
+        .arg("allocate")
+        .stdin(Stdio::piped())
+        .spawn()
+        .unwrap();
+    fs::write(format!("{CGROUP}/cgroup.procs"), workload.id().to_string()).unwrap();
+
+    thread::spawn(|| {
+        let mut killer = oom::Killer::new().expect("failed to create the OOM killer");
+        let mut reactor = reactor::Reactor::new().unwrap();
+        assert!(
+            reactor.add(&mut killer) == 0,
+            "failed to add the OOM killer"
+        );
+        reactor.run();
+    });
+
+    println!(
+        "workload {} allocates in a cgroup limited to {max_mib} MiB",
+        workload.id()
+    );
+    let start = Instant::now();
+    workload.stdin.take().unwrap().write_all(&[0]).unwrap();
+    let status = workload.wait().unwrap();
+    let elapsed_ms = start.elapsed().as_millis();
+    let kernel_kills = memory_event("oom_kill ");
+    fs::remove_dir(CGROUP).unwrap();
+
+    if status.signal() == Some(linux::SIGKILL) && kernel_kills == 0 {
+        println!("PASS: the workload was killed by the OOM killer after {elapsed_ms} ms");
+    } else {
+        println!(
+            "FAIL: the workload ended with {status} after {elapsed_ms} ms, and the kernel OOM killer killed {kernel_kills} processes"
+        );
+        process::exit(1);
+    }
+}
@@ -0,0 +1,158 @@
+//! Measures how fast the seat server hands out 32 devices with the v1 protocol, one datagram and
+//! one FD per device, and with the v2 protocol, one datagram with all the paths and one reply with
+//! all the FDs.
+//!
+//! The server runs on its own thread with the event loop of the init system, and the devices are
+//! regular files, so it does not need root.
+//!
+//! Usage: rustc --edition 2018 -O tools/seat-bench.rs -o seat-bench
+//!        ./seat-bench [<rounds>]
+
+#![allow(dead_code)]
+
+#[path = "../src/histogram.rs"]
+mod histogram;
+#[path = "../src/linux.rs"]
+mod linux;
+#[path = "../src/reactor.rs"]
+mod reactor;
+#[path = "../src/seat.rs"]
+mod seat;
+#[path = "../src/trace.rs"]
+mod trace;
+#[path = "../src/uevent.rs"]
+mod uevent;
+
+mod config {
+    pub const DRM_DEVICES: &[&[u8]] = &[];
+}
+
+use std::convert::TryFrom;
+use std::fs;
+use std::mem;
+use std::ptr;
+use std::thread;
+use std::time::Instant;
+
+/// Number of devices opened in each round.
+const DEVICES: usize = 32;
+
+/// Directory of the fake device nodes.
+const DIR: &str = "/tmp/ginit-seat-bench";
+
+#[repr(C)]
+struct RightsCtrlMsg {
+    hdr: linux::cmsghdr,
+    fds: [i32; linux::SCM_MAX_FD],
+}
+
+/// Receives a datagram and closes the FDs attached to it. Returns the size of the datagram and
+/// the number of FDs.
+fn recv(fd: &linux::Fd, buf: &mut [u8]) -> (usize, usize) {
+    let mut iov = linux::iovec {
+        iov_base: buf.as_mut_ptr(),
+        iov_len: buf.len(),
+    };
+    let mut rights: RightsCtrlMsg = unsafe { mem::zeroed() };
+    let mut msg = linux::msghdr {
+        msg_name: ptr::null_mut(),
+        msg_namelen: 0,
+        msg_iov: &mut iov,
+        msg_iovlen: 1,
+        msg_control: &mut rights as *mut RightsCtrlMsg as *mut u8,
+        msg_controllen: mem::size_of::<RightsCtrlMsg>(),
+        msg_flags: 0,
+    };
+    let n = unsafe { linux::recvmsg(i32::try_from(fd.0).unwrap(), &mut msg, 0) };
+    assert!(n >= 0, "failed to receive reply: {}", n);
+    let mut fd_count = 0;
+    if msg.msg_controllen >= mem::size_of::<linux::cmsghdr>() {
+        fd_count = (rights.hdr.cmsg_len - mem::size_of::<linux::cmsghdr>()) / mem::size_of::<i32>();
+    }
+    for &received in &rights.fds[..fd_count] {
+        drop(linux::Fd(u32::try_from(received).unwrap()));
+    }
+    (usize::try_from(n).unwrap(), fd_count)
+}
+
+fn send(fd: &linux::Fd, data: &[u8]) {
+    let ret = linux::write(fd.0, data);
+    assert!(ret >= 0, "failed to send request: {}", ret);
+}
+
+/// Opens every device with a v1 request each.
+fn open_v1(client: &linux::Fd, paths: &[Vec<u8>]) {
+    let mut buf = [0u8; 16];
+    for path in paths {
+        send(client, path);
+        let (_, fd_count) = recv(client, &mut buf);
+        assert!(fd_count == 1, "failed to open device");
+    }
+}
+
+/// Opens all the devices with a single v2 request.
+fn open_v2(client: &linux::Fd, request: &[u8]) {
+    let mut buf = [0u8; 4096];
+    send(client, request);
+    let (n, fd_count) = recv(client, &mut buf);
+    assert!(
+        n == 4 + DEVICES * 8 && fd_count == DEVICES,
+        "failed to open devices"
+    );
+}
+
+fn main() {
+    let rounds: usize = std::env::args()
+        .nth(1)
+        .map_or(2000, |a| a.parse().expect("bad round count"));
+
+    fs::create_dir_all(DIR).unwrap();
+    let paths: Vec<Vec<u8>> = (0..DEVICES)
+        .map(|i| {
+            let path = format!("{DIR}/event{i}");
+            fs::write(&path, b"").unwrap();
+            let mut path = path.into_bytes();
+            path.push(0);
+            path
+        })
+        .collect();
+    let mut request = vec![0, 2, 1, u8::try_from(DEVICES).unwrap()];
+    for (id, path) in paths.iter().enumerate() {
+        request.extend_from_slice(&u32::try_from(id).unwrap().to_ne_bytes());
+        request.extend_from_slice(path);
+    }
+
+    let (mut server, client) = seat::SeatServer::new().expect("failed to create seat server");
+    // The server thread runs until the process exits.
+    thread::spawn(move || {
+        let mut reactor = reactor::Reactor::new().unwrap();
+        assert!(reactor.add(&mut server) == 0, "failed to add seat server");
+        reactor.run();
+    });
+
+    let mut v1 = Vec::with_capacity(rounds);
+    let mut v2 = Vec::with_capacity(rounds);
+    // The protocols take turns, so that they are affected in the same way by what else happens.
+    for _ in 0..rounds {
+        let start = Instant::now();
+        open_v1(&client, &paths);
+        v1.push(start.elapsed().as_secs_f64() * 1e6);
+        let start = Instant::now();
+        open_v2(&client, &request);
+        v2.push(start.elapsed().as_secs_f64() * 1e6);
+    }
+
+    println!("{rounds} rounds opening {DEVICES} devices");
+    println!("protocol    mean    p50    p99 (us per round)  devices/s");
+    for (name, d) in [("v1", &mut v1), ("v2", &mut v2)] {
+        d.sort_by(|a, b| a.partial_cmp(b).unwrap());
+        let mean = d.iter().sum::<f64>() / d.len() as f64;
+        println!(
+            "{name:<8} {mean:>7.1} {:>6.1} {:>6.1}                  {:>9.0}",
+            d[d.len() / 2],
+            d[d.len() * 99 / 100],
+            DEVICES as f64 * 1e6 / mean
+        );
+    }
+    fs::remove_dir_all(DIR).unwrap();
+}
@@ -0,0 +1,135 @@
+//! Measures the time to spawn a program and wait for it to exit, with three ways of spawning:
+//!
+//! - the legacy `clone` with `CLONE_VM | CLONE_VFORK` followed by `execve`, which the init system
+//!   used before `linux::Command`, reimplemented here;
+//! - `linux::Command`, which uses `clone3` with a pidfd and `execveat` on an `O_PATH` FD;
+//! - `fork` followed by `execve`, whose cost grows with the memory of the parent since its page
+//!   tables are copied.
+//!
+//! The parent can touch some memory first, to show how `fork` compares with a larger process.
+//!
+//! Usage: rustc --edition 2018 -O tools/spawn-bench.rs -o spawn-bench
+//!        ./spawn-bench [<iterations> [<MiB touched by the parent>]]
+
+#![allow(dead_code)]
+
+#[path = "../src/linux.rs"]
+mod linux;
+
+use std::env;
+use std::ptr;
+use std::time::Instant;
+
+/// Program that is spawned. It exits right away.
+const PROGRAM: &[u8] = b"/bin/true\0";
+
+extern "C" {
+    fn fork() -> i32;
+}
+
+struct Program {
+    argv: [*const u8; 2],
+    envp: [*const u8; 1],
+    fd: linux::Fd,
+}
+
+impl Program {
+    fn new() -> Self {
+        Self {
+            argv: [PROGRAM.as_ptr(), ptr::null()],
+            envp: [ptr::null()],
+            fd: unsafe { linux::open_executable(PROGRAM.as_ptr()) }.expect("cannot open program"),
+        }
+    }
+}
+
+unsafe fn vfork_helper(arg: usize) {
+    let program = &*(arg as *const Program);
+    linux::execve(
+        PROGRAM.as_ptr(),
+        program.argv.as_ptr(),
+        program.envp.as_ptr(),
+    );
+    linux::exit(127);
+}
+
+/// Spawns the program like the init system did before `linux::Command`, on a 512-byte stack.
+fn spawn_vfork(program: &Program) -> i32 {
+    let mut stack = [0u8; 512];
+    unsafe {
+        let sp = (stack.as_mut_ptr().add(stack.len()) as usize & !0xf) as *mut u8;
+        linux::clone(
+            linux::CLONE_VM | linux::CLONE_VFORK | linux::SIGCHLD as u64,
+            sp,
+            ptr::null_mut(),
+            ptr::null_mut(),
+            ptr::null_mut(),
+            vfork_helper,
+            program as *const Program as usize,
+        )
+    }
+}
+
+fn spawn_command(program: &Program) -> i32 {
+    let command = linux::Command::new(&program.fd, program.argv.as_ptr(), program.envp.as_ptr());
+    // The pidfd is closed when the child is dropped, and the process is reaped with its PID.
+    unsafe { command.spawn() }.map_or_else(|err| err, |child| child.pid)
+}
+
+fn spawn_fork(program: &Program) -> i32 {
+    unsafe {
+        let pid = fork();
+        if pid == 0 {
+            vfork_helper(program as *const Program as usize);
+        }
+        pid
+    }
+}
+
+/// Spawns the program and waits for it to exit. Returns the time this took, in microseconds.
+fn spawn_and_wait(program: &Program, spawn: fn(&Program) -> i32) -> f64 {
+    let start = Instant::now();
+    let pid = spawn(program);
+    assert!(pid > 0, "failed to spawn: {}", pid);
+    let mut status = 0;
+    let ret = unsafe { linux::wait4(pid, &mut status, 0, ptr::null_mut()) };
+    assert!(ret == pid && status == 0, "{} exited with {}", pid, status);
+    start.elapsed().as_secs_f64() * 1e6
+}
+
+fn main() {
+    let mut args = env::args().skip(1);
+    let iterations: usize = args
+        .next()
+        .map_or(2000, |a| a.parse().expect("bad iterations"));
+    let touched_mib: usize = args
+        .next()
+        .map_or(0, |a| a.parse().expect("bad memory size"));
+    let memory = vec![1u8; touched_mib * 1024 * 1024];
+
+    let program = Program::new();
+    println!("{iterations} spawns of /bin/true, {touched_mib} MiB touched by the parent");
+    println!("method                 mean    p50    p99 (us)");
+    let methods: [(&str, fn(&Program) -> i32); 3] = [
+        ("clone+CLONE_VFORK", spawn_vfork),
+        ("clone3+execveat", spawn_command),
+        ("fork+execve", spawn_fork),
+    ];
+    // The methods take turns, so that they are affected in the same way by what else happens.
+    let mut durations = [(); 3].map(|_| Vec::with_capacity(iterations));
+    for _ in 0..iterations {
+        for ((_, spawn), d) in methods.iter().zip(durations.iter_mut()) {
+            d.push(spawn_and_wait(&program, *spawn));
+        }
+    }
+    for ((name, _), d) in methods.iter().zip(durations.iter_mut()) {
+        d.sort_by(|a, b| a.partial_cmp(b).unwrap());
+        let mean = d.iter().sum::<f64>() / d.len() as f64;
+        println!(
+            "{name:<18} {mean:>8.1} {:>6.1} {:>6.1}",
+            d[d.len() / 2],
+            d[d.len() * 99 / 100]
+        );
+    }
+    drop(memory);
+}